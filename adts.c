@@ -0,0 +1,45 @@
+/*
+ * Copyright (c) 2014 veecr.
+ */
+
+#include "adts.h"
+
+int AdtsConfigFromAsc(AdtsConfig* c, const uint8_t* asc, int ascSize) {
+    if (!asc || ascSize < 2) {
+        return -1;
+    }
+
+    c->objectType = asc[0] >> 3;
+    c->sampleRateIndex = ((asc[0] & 0x07) << 1) | (asc[1] >> 7);
+    c->channelConfig = (asc[1] >> 3) & 0x0f;
+
+    // The 2 bit profile field holds object types 1 to 4 only. Channel
+    // configuration 0 means a PCE in the ASC, which ADTS cannot carry
+    // without writing it in-band.
+    if (c->objectType < 1 || c->objectType > 4 || c->sampleRateIndex > 12 || c->channelConfig == 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+int AdtsSampleRate(const AdtsConfig* c) {
+    static const int rates[13] = {
+        96000, 88200, 64000, 48000, 44100, 32000, 24000,
+        22050, 16000, 12000, 11025, 8000, 7350
+    };
+
+    return rates[c->sampleRateIndex];
+}
+
+void AdtsWriteHeader(const AdtsConfig* c, uint8_t* hdr, int payloadSize) {
+    int frameLength = payloadSize + ADTS_HEADER_SIZE;
+
+    hdr[0] = 0xff;
+    hdr[1] = 0xf1;  // MPEG-4, layer 0, no CRC
+    hdr[2] = ((c->objectType - 1) << 6) | (c->sampleRateIndex << 2) | (c->channelConfig >> 2);
+    hdr[3] = ((c->channelConfig & 0x03) << 6) | ((frameLength >> 11) & 0x03);
+    hdr[4] = (frameLength >> 3) & 0xff;
+    hdr[5] = ((frameLength & 0x07) << 5) | 0x1f;  // buffer fullness 0x7ff (VBR)
+    hdr[6] = 0xfc;  // one raw data block
+}
@@ -0,0 +1,25 @@
+#ifndef ADTS_H
+#define ADTS_H
+
+#include <stdint.h>
+
+#define ADTS_HEADER_SIZE 7
+
+typedef struct _AdtsConfig {
+    int objectType;
+    int sampleRateIndex;
+    int channelConfig;
+} AdtsConfig;
+
+// Parses the fields ADTS needs from an AudioSpecificConfig. Fails for
+// configurations ADTS cannot describe (object types above 4, explicit
+// sample rates, channel layouts given by a PCE).
+int AdtsConfigFromAsc(AdtsConfig* c, const uint8_t* asc, int ascSize);
+
+// Sample rate in Hz of a parsed config.
+int AdtsSampleRate(const AdtsConfig* c);
+
+// Writes a header without CRC for a raw AAC frame of payloadSize bytes.
+void AdtsWriteHeader(const AdtsConfig* c, uint8_t* hdr, int payloadSize);
+
+#endif
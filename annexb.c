@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2014 veecr.
+ */
+
+#include "annexb.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+static const uint8_t* find_start_code_scalar(const uint8_t* p, const uint8_t* end) {
+    for (; p + 3 <= end; p++) {
+        if (p[0] == 0 && p[1] == 0 && p[2] == 1) {
+            return p;
+        }
+    }
+
+    return end;
+}
+
+#ifdef __SSE2__
+// Compares 16 positions at a time for a pair of zero bytes; only those
+// candidates are checked for the trailing 01.
+const uint8_t* AnnexBFindStartCode(const uint8_t* p, const uint8_t* end) {
+    const __m128i zero = _mm_setzero_si128();
+
+    while (end - p >= 18) {
+        __m128i a = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)p), zero);
+        __m128i b = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + 1)), zero);
+        unsigned int mask = _mm_movemask_epi8(_mm_and_si128(a, b));
+
+        while (mask) {
+            int i = __builtin_ctz(mask);
+            if (p[i + 2] == 1) {
+                return p + i;
+            }
+            mask &= mask - 1;
+        }
+        p += 16;
+    }
+
+    return find_start_code_scalar(p, end);
+}
+#else
+const uint8_t* AnnexBFindStartCode(const uint8_t* p, const uint8_t* end) {
+    return find_start_code_scalar(p, end);
+}
+#endif
+
+int AnnexBNextNal(const uint8_t** pos, const uint8_t* end, AnnexBNal* nal) {
+    const uint8_t* start = AnnexBFindStartCode(*pos, end);
+    const uint8_t* next;
+    const uint8_t* nalEnd;
+
+    if (start == end) {
+        *pos = end;
+        return 0;
+    }
+
+    start += 3;
+    next = AnnexBFindStartCode(start, end);
+    nalEnd = next;
+    if (next < end) {
+        while (nalEnd > start && nalEnd[-1] == 0) {
+            nalEnd--;
+        }
+    }
+
+    nal->data = start;
+    nal->size = nalEnd - start;
+    nal->type = nal->size > 0 ? nal->data[0] & 0x1f : 0;
+    *pos = next;
+
+    return 1;
+}
@@ -0,0 +1,20 @@
+#ifndef ANNEXB_H
+#define ANNEXB_H
+
+#include <stdint.h>
+
+typedef struct _AnnexBNal {
+    const uint8_t* data;  // NAL header byte
+    int size;
+    int type;
+} AnnexBNal;
+
+// Returns the next 00 00 01 in [p, end), or end.
+const uint8_t* AnnexBFindStartCode(const uint8_t* p, const uint8_t* end);
+
+// Steps to the next NAL unit at or after *pos. Zero bytes ahead of a start
+// code are not part of the preceding NAL unit. Returns 0 when there are no
+// more.
+int AnnexBNextNal(const uint8_t** pos, const uint8_t* end, AnnexBNal* nal);
+
+#endif
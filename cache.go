@@ -0,0 +1,238 @@
+package grune
+
+import (
+	"container/list"
+	"io"
+	"sync"
+)
+
+// CacheKey identifies a remux output. Input should change whenever the
+// input bytes do (e.g. a path plus modification time, or a content hash).
+// Start and End describe the requested range in the caller's units.
+type CacheKey struct {
+	Input  string
+	Format string
+	Start  int64
+	End    int64
+}
+
+// RemuxCache keeps finished remux outputs in memory up to a byte budget,
+// evicting the least recently used. Concurrent requests for the same key
+// share a single remux and receive its output as it is produced.
+//
+// Remuxes in progress reserve their output against the same budget as it
+// is written. One that cannot reserve more stops caching: its requesters
+// still receive the output, but only the chunk not yet read by all of them
+// is held, and new requests for the key start their own remux.
+type RemuxCache struct {
+	mu     sync.Mutex
+	budget int64
+	size   int64
+	// Bytes of the finished entries in lru, the most eviction can free.
+	finished int64
+	entries  map[CacheKey]*cacheEntry
+	lru      *list.List
+}
+
+type cacheEntry struct {
+	key   CacheKey
+	cache *RemuxCache
+	mu    sync.Mutex
+	cond  *sync.Cond
+	buf   []byte
+	// Stream offset of buf[0]; only uncached entries drop output.
+	base     int64
+	reserved int64
+	uncached bool
+	readers  map[*cacheReader]struct{}
+	done     bool
+	err      error
+	elem     *list.Element
+}
+
+type cacheReader struct {
+	off int64
+}
+
+func NewRemuxCache(budget int64) *RemuxCache {
+	return &RemuxCache{
+		budget:  budget,
+		entries: make(map[CacheKey]*cacheEntry),
+		lru:     list.New(),
+	}
+}
+
+// Do writes the output for key to w, either from the cache, by attaching to
+// an identical remux already in flight, or by starting remux. The remux runs
+// to completion even if every requester has gone away.
+func (c *RemuxCache) Do(key CacheKey, w io.Writer, remux func(w io.Writer) error) error {
+	c.mu.Lock()
+	e, ok := c.entries[key]
+	if ok {
+		if e.elem != nil {
+			c.lru.MoveToFront(e.elem)
+		}
+	} else {
+		e = &cacheEntry{key: key, cache: c, readers: make(map[*cacheReader]struct{})}
+		e.cond = sync.NewCond(&e.mu)
+		c.entries[key] = e
+		go c.fill(e, remux)
+	}
+	// Attach while the entry is still in the map, so it has not dropped any
+	// output yet.
+	r := &cacheReader{}
+	e.mu.Lock()
+	e.readers[r] = struct{}{}
+	e.mu.Unlock()
+	c.mu.Unlock()
+
+	return e.stream(w, r)
+}
+
+// Mp4ToTs is Mp4ToTs through the cache. open is only called when the
+// output is neither cached nor in flight.
+func (c *RemuxCache) Mp4ToTs(key CacheKey, open func() (ar io.Reader, vr io.Reader, err error), w io.Writer) error {
+	return c.Do(key, w, func(out io.Writer) error {
+		ar, vr, err := open()
+		if err != nil {
+			return err
+		}
+		return Mp4ToTs(ar, vr, out)
+	})
+}
+
+// Size returns the number of bytes reserved by finished entries and by
+// remuxes in progress.
+func (c *RemuxCache) Size() int64 {
+	c.mu.Lock()
+	defer c.mu.Unlock()
+	return c.size
+}
+
+func (c *RemuxCache) fill(e *cacheEntry, remux func(w io.Writer) error) {
+	err := remux(e)
+
+	e.mu.Lock()
+	e.done = true
+	e.err = err
+	e.cond.Broadcast()
+	e.mu.Unlock()
+
+	c.mu.Lock()
+	defer c.mu.Unlock()
+
+	if e.uncached {
+		return
+	}
+	if err != nil {
+		c.drop(e)
+		return
+	}
+	e.elem = c.lru.PushFront(e)
+	c.finished += int64(len(e.buf))
+}
+
+// reserve charges n more bytes of e's output to the budget, evicting
+// finished entries to make room. If even evicting all of them would not
+// be enough, e stops caching and the finished entries are kept.
+func (c *RemuxCache) reserve(e *cacheEntry, n int64) bool {
+	c.mu.Lock()
+	defer c.mu.Unlock()
+
+	if c.size-c.finished+n > c.budget {
+		c.drop(e)
+		e.uncached = true
+		return false
+	}
+	for c.size+n > c.budget {
+		c.evict(c.lru.Back().Value.(*cacheEntry))
+	}
+	c.size += n
+	e.reserved += n
+	return true
+}
+
+// drop removes an unfinished entry and releases its reservation.
+func (c *RemuxCache) drop(e *cacheEntry) {
+	if c.entries[e.key] == e {
+		delete(c.entries, e.key)
+	}
+	c.size -= e.reserved
+	e.reserved = 0
+}
+
+func (c *RemuxCache) evict(e *cacheEntry) {
+	c.lru.Remove(e.elem)
+	delete(c.entries, e.key)
+	c.size -= int64(len(e.buf))
+	c.finished -= int64(len(e.buf))
+}
+
+// Write appends remux output and wakes up waiting readers. Bytes already
+// handed out are never modified, so readers copy them outside the lock.
+// Once the entry is uncached, Write waits for every reader to take the
+// previous chunk and then lets it go.
+func (e *cacheEntry) Write(p []byte) (int, error) {
+	if !e.uncached {
+		e.cache.reserve(e, int64(len(p)))
+	}
+
+	e.mu.Lock()
+	if e.uncached {
+		for e.unread() {
+			e.cond.Wait()
+		}
+		e.base += int64(len(e.buf))
+		e.buf = nil
+	}
+	e.buf = append(e.buf, p...)
+	e.cond.Broadcast()
+	e.mu.Unlock()
+	return len(p), nil
+}
+
+// unread reports whether a reader has not taken all of buf yet.
+func (e *cacheEntry) unread() bool {
+	end := e.base + int64(len(e.buf))
+	for r := range e.readers {
+		if r.off < end {
+			return true
+		}
+	}
+	return false
+}
+
+func (e *cacheEntry) stream(w io.Writer, r *cacheReader) error {
+	defer func() {
+		e.mu.Lock()
+		delete(e.readers, r)
+		e.cond.Broadcast()
+		e.mu.Unlock()
+	}()
+
+	for {
+		e.mu.Lock()
+		for r.off == e.base+int64(len(e.buf)) && !e.done {
+			e.cond.Wait()
+		}
+		chunk := e.buf[r.off-e.base:]
+		done, err := e.done, e.err
+		e.mu.Unlock()
+
+		if err != nil {
+			return err
+		}
+		if len(chunk) > 0 {
+			if _, werr := w.Write(chunk); werr != nil {
+				return werr
+			}
+			e.mu.Lock()
+			r.off += int64(len(chunk))
+			e.cond.Broadcast()
+			e.mu.Unlock()
+		}
+		if done {
+			return nil
+		}
+	}
+}
@@ -0,0 +1,239 @@
+package grune
+
+import (
+	"bytes"
+	"errors"
+	"io"
+	"sync"
+	"sync/atomic"
+	"testing"
+	"time"
+)
+
+// chunks returns a remux writing n chunks of size bytes, chunk i filled
+// with byte i, and counts its runs.
+func chunks(runs *int32, n, size int, delay time.Duration) func(w io.Writer) error {
+	return func(w io.Writer) error {
+		atomic.AddInt32(runs, 1)
+		for i := 0; i < n; i++ {
+			if _, err := w.Write(bytes.Repeat([]byte{byte(i)}, size)); err != nil {
+				return err
+			}
+			time.Sleep(delay)
+		}
+		return nil
+	}
+}
+
+func checkChunks(t *testing.T, b []byte, n, size int) {
+	t.Helper()
+	if len(b) != n*size {
+		t.Fatalf("Got %d bytes, expected %d.", len(b), n*size)
+	}
+	for i := range b {
+		if b[i] != byte(i/size) {
+			t.Fatalf("Byte %d is %d, expected %d.", i, b[i], byte(i/size))
+		}
+	}
+}
+
+// waitReaders waits until n requests are attached to the remux for key.
+func waitReaders(t *testing.T, c *RemuxCache, key CacheKey, n int) {
+	t.Helper()
+	for start := time.Now(); time.Since(start) < 5*time.Second; time.Sleep(time.Millisecond) {
+		c.mu.Lock()
+		e := c.entries[key]
+		c.mu.Unlock()
+		if e == nil {
+			continue
+		}
+		e.mu.Lock()
+		attached := len(e.readers)
+		e.mu.Unlock()
+		if attached >= n {
+			return
+		}
+	}
+	t.Fatalf("%d requests did not attach.", n)
+}
+
+func TestRemuxCacheSingleFlight(t *testing.T) {
+	c := NewRemuxCache(1 << 20)
+	key := CacheKey{Input: "a", Format: "ts"}
+	var runs int32
+	remux := chunks(&runs, 100, 100, time.Millisecond)
+
+	var wg sync.WaitGroup
+	for i := 0; i < 20; i++ {
+		wg.Add(1)
+		go func() {
+			defer wg.Done()
+			var b bytes.Buffer
+			if err := c.Do(key, &b, remux); err != nil {
+				t.Error(err)
+				return
+			}
+			checkChunks(t, b.Bytes(), 100, 100)
+		}()
+	}
+	wg.Wait()
+
+	var b bytes.Buffer
+	if err := c.Do(key, &b, remux); err != nil {
+		t.Fatal(err)
+	}
+	checkChunks(t, b.Bytes(), 100, 100)
+	if runs != 1 {
+		t.Fatalf("Remuxed %d times, expected once.", runs)
+	}
+	if c.Size() != 10000 {
+		t.Fatalf("Cache holds %d bytes, expected 10000.", c.Size())
+	}
+}
+
+func TestRemuxCacheLRU(t *testing.T) {
+	c := NewRemuxCache(30000)
+	runs := make([]int32, 4)
+	do := func(i int) {
+		var b bytes.Buffer
+		if err := c.Do(CacheKey{Input: "lru", Start: int64(i)}, &b, chunks(&runs[i], 10, 1000, 0)); err != nil {
+			t.Fatal(err)
+		}
+		checkChunks(t, b.Bytes(), 10, 1000)
+	}
+
+	do(0)
+	do(1)
+	do(2)
+	// 0 is now more recent than 1, so 3 evicts 1.
+	do(0)
+	do(3)
+	if c.Size() != 30000 {
+		t.Fatalf("Cache holds %d bytes, expected 30000.", c.Size())
+	}
+
+	do(0)
+	do(2)
+	do(3)
+	if runs[0] != 1 || runs[2] != 1 || runs[3] != 1 {
+		t.Fatalf("Cached entries remuxed again: %v.", runs)
+	}
+	do(1)
+	if runs[1] != 2 {
+		t.Fatalf("Entry 1 remuxed %d times, expected it evicted and remuxed again.", runs[1])
+	}
+}
+
+func TestRemuxCacheUncached(t *testing.T) {
+	c := NewRemuxCache(25000)
+	var small [2]int32
+	for i := range small {
+		if err := c.Do(CacheKey{Input: "small", Start: int64(i)}, io.Discard, chunks(&small[i], 10, 1000, 0)); err != nil {
+			t.Fatal(err)
+		}
+	}
+
+	// A 26000-byte write can never fit, so the finished entries stay. Only
+	// the chunk not yet taken by the slow reader is held.
+	key := CacheKey{Input: "big"}
+	var runs int32
+	remux := func(w io.Writer) error {
+		e := w.(*cacheEntry)
+		for i := 0; i < 10; i++ {
+			if _, err := w.Write(bytes.Repeat([]byte{byte(i)}, 26000)); err != nil {
+				return err
+			}
+			e.mu.Lock()
+			held := len(e.buf)
+			e.mu.Unlock()
+			if held > 26000 {
+				t.Errorf("Uncached remux holds %d bytes.", held)
+			}
+		}
+		atomic.AddInt32(&runs, 1)
+		return nil
+	}
+	slow := &slowWriter{delay: time.Millisecond}
+	if err := c.Do(key, slow, remux); err != nil {
+		t.Fatal(err)
+	}
+	checkChunks(t, slow.Bytes(), 10, 26000)
+
+	if c.Size() != 20000 {
+		t.Fatalf("Cache holds %d bytes, expected the 20000 already finished.", c.Size())
+	}
+	for i := range small {
+		if err := c.Do(CacheKey{Input: "small", Start: int64(i)}, io.Discard, chunks(&small[i], 10, 1000, 0)); err != nil {
+			t.Fatal(err)
+		}
+		if small[i] != 1 {
+			t.Fatalf("Entry %d was evicted for an output that could not be cached.", i)
+		}
+	}
+
+	// The oversized output was not kept, so it is remuxed again.
+	if err := c.Do(key, io.Discard, remux); err != nil {
+		t.Fatal(err)
+	}
+	if runs != 2 {
+		t.Fatalf("Remuxed %d times, expected twice.", runs)
+	}
+}
+
+type slowWriter struct {
+	bytes.Buffer
+	delay time.Duration
+}
+
+func (w *slowWriter) Write(p []byte) (int, error) {
+	time.Sleep(w.delay)
+	return w.Buffer.Write(p)
+}
+
+func TestRemuxCacheError(t *testing.T) {
+	c := NewRemuxCache(1 << 20)
+	key := CacheKey{Input: "broken"}
+	failure := errors.New("remux failed")
+	start := make(chan struct{})
+	var runs int32
+	remux := func(w io.Writer) error {
+		atomic.AddInt32(&runs, 1)
+		<-start
+		w.Write(make([]byte, 1000))
+		return failure
+	}
+
+	var wg sync.WaitGroup
+	errs := make(chan error, 3)
+	for i := 0; i < 3; i++ {
+		wg.Add(1)
+		go func() {
+			defer wg.Done()
+			errs <- c.Do(key, io.Discard, remux)
+		}()
+	}
+	waitReaders(t, c, key, 3)
+	close(start)
+	wg.Wait()
+	close(errs)
+
+	for err := range errs {
+		if err != failure {
+			t.Fatalf("Got %v, expected the remux error.", err)
+		}
+	}
+	if runs != 1 {
+		t.Fatalf("Remuxed %d times, expected once.", runs)
+	}
+	if c.Size() != 0 {
+		t.Fatalf("Failed remux left %d bytes reserved.", c.Size())
+	}
+
+	// A failed output is not cached.
+	if err := c.Do(key, io.Discard, func(w io.Writer) error {
+		atomic.AddInt32(&runs, 1)
+		return nil
+	}); err != nil || runs != 2 {
+		t.Fatalf("Retry after a failure: %v, %d runs.", err, runs)
+	}
+}
@@ -0,0 +1,352 @@
+/*
+ * Copyright (c) 2014 veecr.
+ */
+
+#include "dash_ondemand.h"
+#include "fmp4_writer.h"
+#include "uring_input.h"
+#include <stdio.h>
+#include <libavformat/avformat.h>
+#include <libavutil/intreadwrite.h>
+
+#define SIDX_HEADER_SIZE 40
+#define SIDX_ENTRY_SIZE 12
+#define SIDX_MAX_REFERENCES 0xffff
+
+typedef struct {
+    int first;
+    int count;
+    int64_t bytes;
+    int64_t duration;
+} DashFragment;
+
+// Counts output bytes so the MPD ranges can be reported.
+typedef struct {
+    void* wopaque;
+    BufferCallback writeFunction;
+    int64_t written;
+} CountingOutput;
+
+static int counting_write(void* opaque, uint8_t* buf, int size) {
+    CountingOutput* out = opaque;
+
+    out->written += size;
+
+    return out->writeFunction(out->wopaque, buf, size);
+}
+
+static int64_t sample_duration(const AVStream* st, int i) {
+    const AVIndexEntry* e = st->index_entries;
+    int last = st->nb_index_entries - 1;
+
+    if (i < last) {
+        return e[i + 1].timestamp - e[i].timestamp;
+    }
+    // The last sample runs to the end of the track.
+    if (st->duration > 0 && e[0].timestamp + st->duration > e[last].timestamp) {
+        return e[0].timestamp + st->duration - e[last].timestamp;
+    }
+
+    return last > 0 ? e[last].timestamp - e[last - 1].timestamp : 0;
+}
+
+// Cuts the sample table into fragments that start at key frames. Returns
+// the number of fragments; maxSamples is the largest fragment.
+static int plan_fragments(const AVStream* st, int64_t fragmentTicks, DashFragment* frags, int* maxSamples) {
+    const AVIndexEntry* e = st->index_entries;
+    DashFragment* f = 0;
+    int n = 0, i;
+
+    *maxSamples = 0;
+
+    for (i = 0; i < st->nb_index_entries; i++) {
+        if (!f || ((e[i].flags & AVINDEX_KEYFRAME) && e[i].timestamp - e[f->first].timestamp >= fragmentTicks)) {
+            f = &frags[n++];
+            f->first = i;
+            f->count = 0;
+            f->bytes = 0;
+            f->duration = 0;
+        }
+        f->count++;
+        f->bytes += e[i].size;
+        f->duration += sample_duration(st, i);
+        if (f->count > *maxSamples) {
+            *maxSamples = f->count;
+        }
+    }
+
+    return n;
+}
+
+static int write_sidx(CountingOutput* out, const Fmp4Writer* writer, const AVIndexEntry* e,
+                      const DashFragment* frags, int nbFrags, int timescale, int64_t earliest) {
+    int size = SIDX_HEADER_SIZE + nbFrags * SIDX_ENTRY_SIZE;
+    uint8_t* buf = av_malloc(size);
+    uint8_t* p = buf;
+    int i, ret;
+
+    if (!buf) {
+        return AVERROR(ENOMEM);
+    }
+
+    AV_WB32(p, size);
+    memcpy(p + 4, "sidx", 4);
+    AV_WB32(p + 8, 0x01000000);  // version 1
+    AV_WB32(p + 12, 1);  // reference_ID
+    AV_WB32(p + 16, timescale);
+    AV_WB64(p + 20, earliest);
+    AV_WB64(p + 28, 0);  // first fragment follows the sidx
+    AV_WB16(p + 36, 0);
+    AV_WB16(p + 38, nbFrags);
+    p += SIDX_HEADER_SIZE;
+
+    for (i = 0; i < nbFrags; i++) {
+        int counts[FMP4_MAX_TRACKS] = { frags[i].count };
+        int64_t referencedSize = Fmp4WriterMoofSize(writer, counts) + 8 + frags[i].bytes;
+
+        if (referencedSize >= 0x80000000LL || frags[i].duration > UINT32_MAX) {
+            fprintf(stderr, "Fragment %d too large for sidx\n", i);
+            av_free(buf);
+            return AVERROR(EINVAL);
+        }
+
+        AV_WB32(p, referencedSize);
+        AV_WB32(p + 4, frags[i].duration);
+        // Fragments after the first start at key frames; the first starts
+        // wherever the track does.
+        AV_WB32(p + 8, (e[frags[i].first].flags & AVINDEX_KEYFRAME) ? 0x90000000 : 0);  // SAP type 1
+        p += SIDX_ENTRY_SIZE;
+    }
+
+    ret = counting_write(out, buf, size);
+    av_free(buf);
+
+    return ret < 0 ? ret : 0;
+}
+
+static int read_track_packet(AVFormatContext* ifmt_ctx, int track, AVPacket* pkt) {
+    int ret;
+
+    while ((ret = av_read_frame(ifmt_ctx, pkt)) >= 0) {
+        if (pkt->stream_index == track) {
+            return 0;
+        }
+        av_free_packet(pkt);
+    }
+
+    return ret;
+}
+
+static int init_track_config(Fmp4TrackConfig* config, const AVStream* st) {
+    const AVCodecContext* codec = st->codec;
+
+    memset(config, 0, sizeof(Fmp4TrackConfig));
+    config->timescale = st->time_base.den;
+
+    if (codec->codec_id == AV_CODEC_ID_H264) {
+        config->type = FMP4_TRACK_VIDEO;
+        config->width = codec->width;
+        config->height = codec->height;
+        config->avcc = codec->extradata;
+        config->avccSize = codec->extradata_size;
+    } else if (codec->codec_id == AV_CODEC_ID_AAC) {
+        config->type = FMP4_TRACK_AUDIO;
+        config->sampleRate = codec->sample_rate;
+        config->channels = codec->channels;
+        config->asc = codec->extradata;
+        config->ascSize = codec->extradata_size;
+    } else {
+        fprintf(stderr, "DASH on-demand output supports H.264 and AAC only\n");
+        return AVERROR(EINVAL);
+    }
+
+    if (st->time_base.num != 1) {
+        fprintf(stderr, "Unexpected track time base\n");
+        return AVERROR(EINVAL);
+    }
+
+    return 0;
+}
+
+int Mp4RemuxToDashOnDemand(
+        char const* filePath, int track, int64_t fragmentMs,
+        void* wopaque, BufferCallback writeFunction,
+        DashSegmentBase* segmentBase)
+{
+    AVFormatContext *ifmt_ctx = 0;
+    AVStream *st;
+    const AVIndexEntry *e;
+    Fmp4Writer *writer = 0;
+    Fmp4TrackConfig config;
+    DashFragment *frags = 0;
+    AVPacket *pkts = 0;
+    CountingOutput out = { wopaque, writeFunction, 0 };
+    int64_t base, earliest, duration = 0;
+    int nbFrags, maxSamples, held = 0, i, j, ret;
+    unsigned int s;
+
+    if ((ret = UringOpenInput(&ifmt_ctx, filePath)) < 0) {
+        fprintf(stderr, "Could not open input.");
+        goto end;
+    }
+
+    if ((ret = avformat_find_stream_info(ifmt_ctx, 0)) < 0) {
+        fprintf(stderr, "Failed to retrieve input stream information");
+        goto end;
+    }
+
+    if (track < 0 || track >= (int)ifmt_ctx->nb_streams) {
+        fprintf(stderr, "No track %d in input\n", track);
+        ret = AVERROR(EINVAL);
+        goto end;
+    }
+    for (s = 0; s < ifmt_ctx->nb_streams; s++) {
+        if ((int)s != track) {
+            ifmt_ctx->streams[s]->discard = AVDISCARD_ALL;
+        }
+    }
+
+    st = ifmt_ctx->streams[track];
+    e = st->index_entries;
+    if (st->nb_index_entries == 0) {
+        fprintf(stderr, "Input has no sample table\n");
+        ret = AVERROR(EINVAL);
+        goto end;
+    }
+
+    if ((ret = init_track_config(&config, st)) < 0) {
+        goto end;
+    }
+
+    UringHintIndex(ifmt_ctx);
+
+    // Plan every fragment from the sample table before writing anything.
+    frags = av_malloc(st->nb_index_entries * sizeof(DashFragment));
+    if (!frags) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    nbFrags = plan_fragments(st, av_rescale(fragmentMs, config.timescale, 1000), frags, &maxSamples);
+    if (nbFrags > SIDX_MAX_REFERENCES) {
+        fprintf(stderr, "Too many fragments for one sidx\n");
+        ret = AVERROR(EINVAL);
+        goto end;
+    }
+
+    pkts = av_mallocz(maxSamples * sizeof(AVPacket));
+    writer = NewFmp4Writer(&out, counting_write, maxSamples);
+    if (!pkts || !writer) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    if (Fmp4WriterAddTrack(writer, &config) < 0 || Fmp4WriterWriteInit(writer) < 0) {
+        ret = AVERROR_UNKNOWN;
+        goto end;
+    }
+    segmentBase->initStart = 0;
+    segmentBase->initEnd = out.written - 1;
+
+    // Decode times start at zero; the earliest presentation time also needs
+    // the first sample's composition offset.
+    base = e[0].timestamp < 0 ? e[0].timestamp : 0;
+    if ((ret = read_track_packet(ifmt_ctx, track, &pkts[0])) < 0) {
+        fprintf(stderr, "Input has no samples\n");
+        if (ret == AVERROR_EOF) {
+            ret = AVERROR_INVALIDDATA;
+        }
+        goto end;
+    }
+    held = 1;
+    earliest = (pkts[0].pts != AV_NOPTS_VALUE ? pkts[0].pts : e[0].timestamp) - base;
+    if (earliest < 0) {
+        earliest = 0;
+    }
+
+    if ((ret = write_sidx(&out, writer, e, frags, nbFrags, config.timescale, earliest)) < 0) {
+        goto end;
+    }
+    segmentBase->indexStart = segmentBase->initEnd + 1;
+    segmentBase->indexEnd = out.written - 1;
+
+    for (i = 0; i < nbFrags; i++) {
+        const DashFragment* f = &frags[i];
+
+        for (j = 0; j < f->count; j++) {
+            const AVIndexEntry* entry = &e[f->first + j];
+            AVPacket* pkt = &pkts[j];
+            int64_t cts = 0;
+
+            if (held <= j) {
+                if ((ret = read_track_packet(ifmt_ctx, track, pkt)) < 0) {
+                    fprintf(stderr, "Input ended before its sample table\n");
+                    // The sidx has promised the missing fragments.
+                    if (ret == AVERROR_EOF) {
+                        ret = AVERROR_INVALIDDATA;
+                    }
+                    goto end;
+                }
+                held++;
+            }
+            // The sidx is already out; the samples must match the plan.
+            if (pkt->size != entry->size) {
+                fprintf(stderr, "Sample %d does not match the sample table\n", f->first + j);
+                ret = AVERROR_INVALIDDATA;
+                goto end;
+            }
+            if (pkt->pts != AV_NOPTS_VALUE && pkt->dts != AV_NOPTS_VALUE) {
+                cts = pkt->pts - pkt->dts;
+            }
+
+            ret = Fmp4WriterAddSample(writer, 0, pkt->data, pkt->size, entry->timestamp - base,
+                                      (int)sample_duration(st, f->first + j), (int)cts,
+                                      entry->flags & AVINDEX_KEYFRAME);
+            if (ret < 0) {
+                fprintf(stderr, "Sample %d rejected by the fragment writer\n", f->first + j);
+                ret = AVERROR_INVALIDDATA;
+                goto end;
+            }
+        }
+
+        ret = Fmp4WriterFlushFragment(writer);
+
+        for (j = 0; j < held; j++) {
+            av_free_packet(&pkts[j]);
+        }
+        held = 0;
+
+        if (ret < 0) {
+            goto end;
+        }
+        duration += f->duration;
+    }
+
+    segmentBase->totalSize = out.written;
+    segmentBase->timescale = config.timescale;
+    segmentBase->duration = duration;
+
+end:
+    for (j = 0; j < held; j++) {
+        av_free_packet(&pkts[j]);
+    }
+    av_free(pkts);
+    av_free(frags);
+    FreeFmp4Writer(writer);
+    UringCloseInput(&ifmt_ctx);
+
+    if (ret < 0 && ret != AVERROR_EOF) {
+        fprintf(stderr, "Error occurred: %s\n", av_err2str(ret));
+        return 1;
+    }
+
+    return 0;
+}
+
+int DashFormatSegmentBase(const DashSegmentBase* sb, char* buf, int size) {
+    int n = snprintf(buf, size,
+                     "<SegmentBase timescale=\"%d\" indexRange=\"%lld-%lld\" indexRangeExact=\"true\">"
+                     "<Initialization range=\"%lld-%lld\"/></SegmentBase>",
+                     sb->timescale, (long long)sb->indexStart, (long long)sb->indexEnd,
+                     (long long)sb->initStart, (long long)sb->initEnd);
+
+    return n < size ? n : -1;
+}
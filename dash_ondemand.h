@@ -0,0 +1,31 @@
+#ifndef DASH_ONDEMAND_H
+#define DASH_ONDEMAND_H
+
+#include "muxer.h"
+
+// Byte ranges of a single-file representation, inclusive as in the MPD.
+typedef struct _DashSegmentBase {
+    int64_t initStart;
+    int64_t initEnd;
+    int64_t indexStart;
+    int64_t indexEnd;
+    int64_t totalSize;
+    int timescale;
+    int64_t duration;
+} DashSegmentBase;
+
+// Writes one track of an MP4 as a DASH on-demand representation: ftyp and
+// moov, a sidx indexing every fragment, then the fragments. Fragment
+// boundaries and sizes come from the input sample tables, so everything is
+// written in one forward pass. Fragments start at key frames at least
+// fragmentMs apart. H.264 and AAC only.
+int Mp4RemuxToDashOnDemand(
+    char const* filePath, int track, int64_t fragmentMs,
+    void* wopaque, BufferCallback writeFunction,
+    DashSegmentBase* segmentBase);
+
+// Formats the MPD SegmentBase element for the representation. Returns the
+// length, or -1 if buf is too small.
+int DashFormatSegmentBase(const DashSegmentBase* segmentBase, char* buf, int size);
+
+#endif
@@ -0,0 +1,259 @@
+/*
+ * Copyright (c) 2014 veecr.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "fd_sink.h"
+#include <libavutil/error.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#define FD_SINK_DEFAULT_SIZE (1 << 20)
+
+// Older C libraries lack the memfd and sealing definitions.
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#define MFD_ALLOW_SEALING 0x0002U
+#endif
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS 1033
+#define F_SEAL_SEAL 0x0001
+#define F_SEAL_SHRINK 0x0002
+#define F_SEAL_GROW 0x0004
+#define F_SEAL_WRITE 0x0008
+#endif
+
+struct _FdSink {
+    char name[64];
+    int64_t sizeHint;
+    int64_t pageSize;
+
+    // The current segment. fd is -1 until the segment's first write.
+    int fd;
+    int ownsFd;
+    uint8_t* map;
+    int64_t capacity;
+    int64_t length;
+    int error;
+};
+
+static int create_memfd(const char* name) {
+#if defined(__linux__) && defined(SYS_memfd_create)
+    return (int)syscall(SYS_memfd_create, name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+#else
+    // No memfd: an unlinked POSIX shared memory object serves the same
+    // purpose, without seals.
+    static int counter;
+    char path[96];
+    int fd;
+
+    snprintf(path, sizeof(path), "/%s-%d-%d", name, (int)getpid(), __sync_fetch_and_add(&counter, 1));
+    fd = shm_open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd >= 0) {
+        shm_unlink(path);
+    }
+    return fd;
+#endif
+}
+
+static int64_t round_to_page(FdSink* s, int64_t size) {
+    return (size + s->pageSize - 1) / s->pageSize * s->pageSize;
+}
+
+// Grows the segment file and its mapping to hold at least need bytes.
+static int grow(FdSink* s, int64_t need) {
+    int64_t capacity = s->capacity ? s->capacity * 2 : s->sizeHint;
+    uint8_t* map;
+
+    if (capacity < need) {
+        capacity = need;
+    }
+    capacity = round_to_page(s, capacity);
+
+    if (ftruncate(s->fd, capacity) < 0) {
+        return AVERROR(errno);
+    }
+
+#ifdef __linux__
+    if (s->map) {
+        map = mremap(s->map, s->capacity, capacity, MREMAP_MAYMOVE);
+    } else {
+        map = mmap(0, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, s->fd, 0);
+    }
+#else
+    if (s->map) {
+        munmap(s->map, s->capacity);
+        s->map = 0;
+    }
+    map = mmap(0, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, s->fd, 0);
+#endif
+    if (map == MAP_FAILED) {
+        return AVERROR(errno);
+    }
+
+    s->map = map;
+    s->capacity = capacity;
+
+    return 0;
+}
+
+static void reset_segment(FdSink* s) {
+    if (s->map) {
+        munmap(s->map, s->capacity);
+    }
+    s->fd = -1;
+    s->ownsFd = 0;
+    s->map = 0;
+    s->capacity = 0;
+    s->length = 0;
+    s->error = 0;
+}
+
+static int open_segment(FdSink* s) {
+    s->fd = create_memfd(s->name);
+    if (s->fd < 0) {
+        fprintf(stderr, "Could not create memfd for output segment.\n");
+        return AVERROR(errno);
+    }
+    s->ownsFd = 1;
+
+    return 0;
+}
+
+FdSink* NewFdSink(const char* name, int64_t sizeHint) {
+    FdSink* s = calloc(1, sizeof(FdSink));
+
+    if (!s) {
+        return 0;
+    }
+
+    snprintf(s->name, sizeof(s->name), "%s", name ? name : "grune");
+    s->sizeHint = sizeHint > 0 ? sizeHint : FD_SINK_DEFAULT_SIZE;
+    s->pageSize = sysconf(_SC_PAGESIZE);
+    if (s->pageSize <= 0) {
+        s->pageSize = 4096;
+    }
+    s->fd = -1;
+
+    return s;
+}
+
+int FdSinkUseFd(FdSink* s, int fd) {
+    if (s->fd >= 0) {
+        fprintf(stderr, "Segment already started.\n");
+        return AVERROR(EINVAL);
+    }
+
+    s->fd = fd;
+    s->ownsFd = 0;
+
+    return 0;
+}
+
+int FdSinkWrite(void* opaque, uint8_t* buf, int size) {
+    FdSink* s = opaque;
+    int ret;
+
+    if (s->error < 0) {
+        return s->error;
+    }
+
+    if (s->fd < 0 && (ret = open_segment(s)) < 0) {
+        s->error = ret;
+        return ret;
+    }
+
+    if (s->length + size > s->capacity && (ret = grow(s, s->length + size)) < 0) {
+        fprintf(stderr, "Could not grow output segment: %s\n", av_err2str(ret));
+        s->error = ret;
+        return ret;
+    }
+
+    memcpy(s->map + s->length, buf, size);
+    s->length += size;
+
+    return size;
+}
+
+int FdSinkFinishSegment(FdSink* s, int* fd, int64_t* length) {
+    int ret = s->error;
+
+    *fd = -1;
+    *length = 0;
+
+    if (ret == 0 && s->fd < 0) {
+        // An empty segment still gets a descriptor.
+        ret = open_segment(s);
+    }
+
+    if (s->map) {
+        munmap(s->map, s->capacity);
+        s->map = 0;
+    }
+
+    // Drop the slack past the end of the segment so that the file length is
+    // the segment length.
+    if (ret == 0 && ftruncate(s->fd, s->length) < 0) {
+        ret = AVERROR(errno);
+    }
+
+#ifdef __linux__
+    // The mapping is gone, so the write seal can be taken. Seals fail on
+    // kernels without them, which only costs the protection.
+    if (ret == 0 && s->ownsFd) {
+        fcntl(s->fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+    }
+#endif
+
+    if (ret == 0) {
+        *fd = s->fd;
+        *length = s->length;
+    } else if (s->ownsFd && s->fd >= 0) {
+        close(s->fd);
+    }
+
+    reset_segment(s);
+
+    return ret;
+}
+
+void FdSinkDiscardSegment(FdSink* s) {
+    if (s->map) {
+        munmap(s->map, s->capacity);
+        s->map = 0;
+    }
+
+    if (s->ownsFd) {
+        close(s->fd);
+    } else if (s->fd >= 0 && ftruncate(s->fd, 0) < 0) {
+        fprintf(stderr, "Could not truncate discarded segment.\n");
+    }
+
+    reset_segment(s);
+}
+
+void FreeFdSink(FdSink* s) {
+    if (!s) {
+        return;
+    }
+
+    if (s->map) {
+        munmap(s->map, s->capacity);
+    }
+    if (s->ownsFd && s->fd >= 0) {
+        close(s->fd);
+    }
+    free(s);
+}
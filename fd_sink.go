@@ -0,0 +1,91 @@
+package grune
+
+// #include "fd_sink.h"
+// #include <stdlib.h>
+import "C"
+import (
+	"fmt"
+	"io"
+	"os"
+	"runtime"
+	"unsafe"
+)
+
+// FdSink collects remux output in file descriptors instead of an io.Writer.
+// The native muxer writes straight into the segment's pages, and a finished
+// segment comes back as a file that can be served with sendfile or splice,
+// or passed to other processes. An FdSink must not be used concurrently.
+type FdSink struct {
+	s    *C.FdSink
+	name string
+	file *os.File
+}
+
+// NewFdSink creates a sink whose segments go into memfds named name.
+// sizeHint is the expected segment size, or 0 for a default.
+func NewFdSink(name string, sizeHint int64) (*FdSink, error) {
+	cname := C.CString(name)
+	defer C.free(unsafe.Pointer(cname))
+	s := C.NewFdSink(cname, C.int64_t(sizeHint))
+	if s == nil {
+		return nil, fmt.Errorf("Could not create output sink.")
+	}
+	return &FdSink{s: s, name: name}, nil
+}
+
+// UseFile writes the next segment into f from offset 0 instead of a new
+// memfd. f must be mappable, such as a regular or tmpfs file; Finish
+// returns f itself.
+func (s *FdSink) UseFile(f *os.File) error {
+	if C.FdSinkUseFd(s.s, C.int(f.Fd())) != 0 {
+		return fmt.Errorf("Segment already started.")
+	}
+	s.file = f
+	return nil
+}
+
+// Finish ends the current segment and returns it with its length. Memfd
+// segments are sealed against modification and owned by the caller.
+func (s *FdSink) Finish() (*os.File, int64, error) {
+	var (
+		fd     C.int
+		length C.int64_t
+	)
+	file := s.file
+	s.file = nil
+	ret := C.FdSinkFinishSegment(s.s, &fd, &length)
+	runtime.KeepAlive(file)
+	if ret != 0 {
+		return nil, 0, fmt.Errorf("Error writing output segment.")
+	}
+	if file == nil {
+		file = os.NewFile(uintptr(fd), s.name)
+	}
+	return file, int64(length), nil
+}
+
+// Close frees the sink and any unfinished memfd segment.
+func (s *FdSink) Close() {
+	C.FreeFdSink(s.s)
+	s.s = nil
+}
+
+// Discard throws the current segment away. A file given to UseFile is
+// truncated and no longer used.
+func (s *FdSink) Discard() {
+	C.FdSinkDiscardSegment(s.s)
+	runtime.KeepAlive(s.file)
+	s.file = nil
+}
+
+// Mp4ToTsSegment is Mp4ToTsWithOptions writing into the current segment of
+// sink. Call sink.Finish for the result. If the remux fails, the partial
+// segment is discarded.
+func Mp4ToTsSegment(ar io.Reader, vr io.Reader, sink *FdSink, opts TsOptions) (TsStats, error) {
+	stats, err := mp4ToTs(ar, vr, unsafe.Pointer(sink.s), unsafe.Pointer(C.FdSinkWrite), opts)
+	if err != nil {
+		sink.Discard()
+	}
+	runtime.KeepAlive(sink.file)
+	return stats, err
+}
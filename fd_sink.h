@@ -0,0 +1,38 @@
+#ifndef FD_SINK_H
+#define FD_SINK_H
+
+#include "muxer.h"
+
+typedef struct _FdSink FdSink;
+
+// An output sink that writes segments into file descriptors instead of
+// handing buffers back to the caller. Each segment is written through a
+// shared mapping grown in page multiples. Finished segments are sized to
+// their length and returned as a descriptor, ready for sendfile/splice or
+// passing to another process.
+//
+// Segments go into a new memfd named name unless the caller supplies a
+// descriptor with FdSinkUseFd. sizeHint is the expected segment size, or
+// 0 for a default.
+FdSink* NewFdSink(const char* name, int64_t sizeHint);
+
+// Writes the next segment into fd from offset 0 instead of a new memfd.
+// fd must be mappable (a regular file, tmpfs file or memfd) and stays
+// owned by the caller. Must be called before the segment's first write.
+int FdSinkUseFd(FdSink* s, int fd);
+
+// BufferCallback appending to the current segment.
+int FdSinkWrite(void* opaque, uint8_t* buf, int size);
+
+// Ends the current segment and returns its descriptor and length. A memfd
+// is sealed against writes and resizing, and the caller owns it. The next
+// write starts a new segment.
+int FdSinkFinishSegment(FdSink* s, int* fd, int64_t* length);
+
+// Throws the current segment away, e.g. after a failed remux. A memfd is
+// closed; a caller-supplied fd is truncated to 0 and stays with the caller.
+void FdSinkDiscardSegment(FdSink* s);
+
+void FreeFdSink(FdSink* s);
+
+#endif
@@ -0,0 +1,687 @@
+/*
+ * Copyright (c) 2014 veecr.
+ */
+
+#include "fmp4_writer.h"
+#include <stdio.h>
+#include <string.h>
+#include <libavutil/mem.h>
+
+// Layout of the per-track traf template: traf, tfhd, tfdt, trun header.
+#define TRAF_TEMPLATE_SIZE 64
+#define TRAF_TFDT_TIME 36
+#define TRAF_TRUN_SIZE 44
+#define TRAF_TRUN_COUNT 56
+#define TRAF_TRUN_DATA_OFFSET 60
+
+#define MOOF_HEADER_SIZE 24  // moof + mfhd
+#define MDAT_HEADER_SIZE 8
+
+#define TFHD_DEFAULT_BASE_IS_MOOF 0x020000
+#define TRUN_DATA_OFFSET 0x000001
+#define TRUN_SAMPLE_DURATION 0x000100
+#define TRUN_SAMPLE_SIZE 0x000200
+#define TRUN_SAMPLE_FLAGS 0x000400
+#define TRUN_SAMPLE_CTS 0x000800
+
+#define SAMPLE_FLAGS_SYNC 0x02000000
+#define SAMPLE_FLAGS_NON_SYNC 0x01010000
+
+#define MAX_CONFIG_SIZE 1024
+
+typedef struct {
+    const uint8_t* data;
+    uint32_t size;
+    uint32_t duration;
+    int32_t ctsOffset;
+    uint8_t track;
+    uint8_t isKeyFrame;
+} Fmp4Sample;
+
+typedef struct {
+    Fmp4TrackConfig config;
+    uint8_t* avcc;
+    uint8_t* asc;
+    uint8_t traf[TRAF_TEMPLATE_SIZE];
+    int entrySize;
+    int count;
+    int64_t bytes;
+    int64_t fragDts;
+} Fmp4Track;
+
+struct _Fmp4Writer {
+    void* wopaque;
+    BufferCallback writeFunction;
+
+    Fmp4Track tracks[FMP4_MAX_TRACKS];
+    int nbTracks;
+    int initWritten;
+    uint32_t sequence;
+
+    Fmp4Sample* samples;
+    int nbSamples;
+    int maxSamples;
+
+    uint8_t* moof;
+};
+
+typedef struct {
+    uint8_t* buf;
+    int pos;
+} ByteWriter;
+
+static void put8(ByteWriter* bw, int v) {
+    bw->buf[bw->pos++] = v;
+}
+
+static void put16(ByteWriter* bw, int v) {
+    put8(bw, v >> 8);
+    put8(bw, v);
+}
+
+static void put32(ByteWriter* bw, uint32_t v) {
+    put16(bw, v >> 16);
+    put16(bw, v);
+}
+
+static void put64(ByteWriter* bw, uint64_t v) {
+    put32(bw, v >> 32);
+    put32(bw, v);
+}
+
+static void put_tag(ByteWriter* bw, const char* tag) {
+    memcpy(bw->buf + bw->pos, tag, 4);
+    bw->pos += 4;
+}
+
+static void put_bytes(ByteWriter* bw, const uint8_t* data, int size) {
+    memcpy(bw->buf + bw->pos, data, size);
+    bw->pos += size;
+}
+
+static void put_zeros(ByteWriter* bw, int size) {
+    memset(bw->buf + bw->pos, 0, size);
+    bw->pos += size;
+}
+
+static void set32(uint8_t* p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static void set64(uint8_t* p, uint64_t v) {
+    set32(p, v >> 32);
+    set32(p + 4, v);
+}
+
+// Returns the box start; box_end fills in its size.
+static int box_start(ByteWriter* bw, const char* tag) {
+    int start = bw->pos;
+
+    put32(bw, 0);
+    put_tag(bw, tag);
+
+    return start;
+}
+
+static int full_box_start(ByteWriter* bw, const char* tag, int version, int flags) {
+    int start = box_start(bw, tag);
+
+    put32(bw, (version << 24) | flags);
+
+    return start;
+}
+
+static void box_end(ByteWriter* bw, int start) {
+    set32(bw->buf + start, bw->pos - start);
+}
+
+static void put_matrix(ByteWriter* bw) {
+    put32(bw, 0x00010000);
+    put32(bw, 0);
+    put32(bw, 0);
+    put32(bw, 0);
+    put32(bw, 0x00010000);
+    put32(bw, 0);
+    put32(bw, 0);
+    put32(bw, 0);
+    put32(bw, 0x40000000);
+}
+
+static void put_ftyp(ByteWriter* bw) {
+    int box = box_start(bw, "ftyp");
+
+    put_tag(bw, "iso5");
+    put32(bw, 512);
+    put_tag(bw, "iso5");
+    put_tag(bw, "iso6");
+    put_tag(bw, "avc1");
+    put_tag(bw, "mp41");
+    put_tag(bw, "dash");
+    box_end(bw, box);
+}
+
+static void put_mvhd(ByteWriter* bw, int nextTrackId) {
+    int box = full_box_start(bw, "mvhd", 0, 0);
+
+    put32(bw, 0);  // creation time
+    put32(bw, 0);  // modification time
+    put32(bw, 1000);
+    put32(bw, 0);  // duration, carried by the fragments
+    put32(bw, 0x00010000);
+    put16(bw, 0x0100);
+    put_zeros(bw, 10);
+    put_matrix(bw);
+    put_zeros(bw, 24);
+    put32(bw, nextTrackId);
+    box_end(bw, box);
+}
+
+static void put_tkhd(ByteWriter* bw, const Fmp4Track* t, int trackId) {
+    int box = full_box_start(bw, "tkhd", 0, 0x000003);  // enabled, in movie
+    int video = t->config.type == FMP4_TRACK_VIDEO;
+
+    put32(bw, 0);
+    put32(bw, 0);
+    put32(bw, trackId);
+    put32(bw, 0);
+    put32(bw, 0);  // duration
+    put_zeros(bw, 8);
+    put16(bw, 0);  // layer
+    put16(bw, 0);  // alternate group
+    put16(bw, video ? 0 : 0x0100);
+    put16(bw, 0);
+    put_matrix(bw);
+    put32(bw, video ? (uint32_t)t->config.width << 16 : 0);
+    put32(bw, video ? (uint32_t)t->config.height << 16 : 0);
+    box_end(bw, box);
+}
+
+static void put_mdhd(ByteWriter* bw, const Fmp4Track* t) {
+    int box = full_box_start(bw, "mdhd", 0, 0);
+
+    put32(bw, 0);
+    put32(bw, 0);
+    put32(bw, t->config.timescale);
+    put32(bw, 0);
+    put16(bw, 0x55c4);  // und
+    put16(bw, 0);
+    box_end(bw, box);
+}
+
+static void put_hdlr(ByteWriter* bw, const Fmp4Track* t) {
+    int box = full_box_start(bw, "hdlr", 0, 0);
+    const char* name = t->config.type == FMP4_TRACK_VIDEO ? "VideoHandler" : "SoundHandler";
+
+    put32(bw, 0);
+    put_tag(bw, t->config.type == FMP4_TRACK_VIDEO ? "vide" : "soun");
+    put_zeros(bw, 12);
+    put_bytes(bw, (const uint8_t*)name, strlen(name) + 1);
+    box_end(bw, box);
+}
+
+static void put_avc1(ByteWriter* bw, const Fmp4Track* t) {
+    int box = box_start(bw, "avc1");
+    int avcc;
+
+    put_zeros(bw, 6);
+    put16(bw, 1);  // data reference index
+    put_zeros(bw, 16);
+    put16(bw, t->config.width);
+    put16(bw, t->config.height);
+    put32(bw, 0x00480000);  // 72 dpi
+    put32(bw, 0x00480000);
+    put32(bw, 0);
+    put16(bw, 1);  // frame count
+    put_zeros(bw, 32);  // compressor name
+    put16(bw, 0x0018);
+    put16(bw, 0xffff);
+
+    avcc = box_start(bw, "avcC");
+    put_bytes(bw, t->avcc, t->config.avccSize);
+    box_end(bw, avcc);
+
+    box_end(bw, box);
+}
+
+static void put_mp4a(ByteWriter* bw, const Fmp4Track* t) {
+    int box = box_start(bw, "mp4a");
+    int esds, ascSize = t->config.ascSize;
+
+    put_zeros(bw, 6);
+    put16(bw, 1);
+    put_zeros(bw, 8);
+    put16(bw, t->config.channels);
+    put16(bw, 16);
+    put16(bw, 0);
+    put16(bw, 0);
+    put32(bw, t->config.sampleRate < 0x10000 ? (uint32_t)t->config.sampleRate << 16 : 0);
+
+    esds = full_box_start(bw, "esds", 0, 0);
+    put8(bw, 0x03);  // ES_Descriptor
+    put8(bw, 23 + ascSize);
+    put16(bw, 0);  // ES_ID
+    put8(bw, 0);
+    put8(bw, 0x04);  // DecoderConfigDescriptor
+    put8(bw, 15 + ascSize);
+    put8(bw, 0x40);  // MPEG-4 audio
+    put8(bw, 0x15);  // audio stream
+    put_zeros(bw, 3);  // buffer size
+    put32(bw, 0);  // max bitrate
+    put32(bw, 0);  // average bitrate
+    put8(bw, 0x05);  // DecoderSpecificInfo
+    put8(bw, ascSize);
+    put_bytes(bw, t->asc, ascSize);
+    put8(bw, 0x06);  // SLConfigDescriptor
+    put8(bw, 1);
+    put8(bw, 0x02);
+    box_end(bw, esds);
+
+    box_end(bw, box);
+}
+
+static void put_stbl(ByteWriter* bw, const Fmp4Track* t) {
+    int stbl = box_start(bw, "stbl");
+    int box;
+
+    box = full_box_start(bw, "stsd", 0, 0);
+    put32(bw, 1);
+    if (t->config.type == FMP4_TRACK_VIDEO) {
+        put_avc1(bw, t);
+    } else {
+        put_mp4a(bw, t);
+    }
+    box_end(bw, box);
+
+    // The sample tables are empty; samples live in the fragments.
+    box = full_box_start(bw, "stts", 0, 0);
+    put32(bw, 0);
+    box_end(bw, box);
+    box = full_box_start(bw, "stsc", 0, 0);
+    put32(bw, 0);
+    box_end(bw, box);
+    box = full_box_start(bw, "stsz", 0, 0);
+    put32(bw, 0);
+    put32(bw, 0);
+    box_end(bw, box);
+    box = full_box_start(bw, "stco", 0, 0);
+    put32(bw, 0);
+    box_end(bw, box);
+
+    box_end(bw, stbl);
+}
+
+static void put_trak(ByteWriter* bw, const Fmp4Track* t, int trackId) {
+    int trak = box_start(bw, "trak");
+    int mdia, minf, dinf, dref, box;
+
+    put_tkhd(bw, t, trackId);
+
+    mdia = box_start(bw, "mdia");
+    put_mdhd(bw, t);
+    put_hdlr(bw, t);
+
+    minf = box_start(bw, "minf");
+    if (t->config.type == FMP4_TRACK_VIDEO) {
+        box = full_box_start(bw, "vmhd", 0, 1);
+        put_zeros(bw, 8);
+    } else {
+        box = full_box_start(bw, "smhd", 0, 0);
+        put_zeros(bw, 4);
+    }
+    box_end(bw, box);
+
+    dinf = box_start(bw, "dinf");
+    dref = full_box_start(bw, "dref", 0, 0);
+    put32(bw, 1);
+    box = full_box_start(bw, "url ", 0, 1);  // data in this file
+    box_end(bw, box);
+    box_end(bw, dref);
+    box_end(bw, dinf);
+
+    put_stbl(bw, t);
+
+    box_end(bw, minf);
+    box_end(bw, mdia);
+    box_end(bw, trak);
+}
+
+static void put_mvex(ByteWriter* bw, const Fmp4Writer* w) {
+    int mvex = box_start(bw, "mvex");
+    int i, box;
+
+    for (i = 0; i < w->nbTracks; i++) {
+        box = full_box_start(bw, "trex", 0, 0);
+        put32(bw, i + 1);
+        put32(bw, 1);  // sample description index
+        put32(bw, 0);
+        put32(bw, 0);
+        put32(bw, 0);
+        box_end(bw, box);
+    }
+
+    box_end(bw, mvex);
+}
+
+// traf with tfhd, tfdt and the trun header; sizes, times, counts and the
+// data offset are patched per fragment.
+static void init_traf_template(Fmp4Track* t, int trackId) {
+    ByteWriter bw = { t->traf, 0 };
+    int flags = TRUN_DATA_OFFSET | TRUN_SAMPLE_DURATION | TRUN_SAMPLE_SIZE;
+    int box;
+
+    if (t->config.type == FMP4_TRACK_VIDEO) {
+        flags |= TRUN_SAMPLE_FLAGS | TRUN_SAMPLE_CTS;
+        t->entrySize = 16;
+    } else {
+        t->entrySize = 8;
+    }
+
+    box_start(&bw, "traf");
+    box = full_box_start(&bw, "tfhd", 0, TFHD_DEFAULT_BASE_IS_MOOF);
+    put32(&bw, trackId);
+    box_end(&bw, box);
+    box = full_box_start(&bw, "tfdt", 1, 0);
+    put64(&bw, 0);
+    box_end(&bw, box);
+    // Version 1 for signed composition offsets.
+    full_box_start(&bw, "trun", 1, flags);
+    put32(&bw, 0);
+    put32(&bw, 0);
+}
+
+Fmp4Writer* NewFmp4Writer(void* wopaque, BufferCallback writeFunction, int maxSamples) {
+    Fmp4Writer* w;
+
+    if (maxSamples <= 0) {
+        return NULL;
+    }
+
+    w = av_mallocz(sizeof(Fmp4Writer));
+    if (!w) {
+        return NULL;
+    }
+
+    w->wopaque = wopaque;
+    w->writeFunction = writeFunction;
+    w->maxSamples = maxSamples;
+    w->sequence = 1;
+
+    w->samples = av_malloc(maxSamples * sizeof(Fmp4Sample));
+    w->moof = av_malloc(MOOF_HEADER_SIZE + FMP4_MAX_TRACKS * TRAF_TEMPLATE_SIZE + maxSamples * 16);
+    if (!w->samples || !w->moof) {
+        FreeFmp4Writer(w);
+        return NULL;
+    }
+
+    return w;
+}
+
+int Fmp4WriterAddTrack(Fmp4Writer* w, const Fmp4TrackConfig* config) {
+    Fmp4Track* t;
+
+    if (w->initWritten || w->nbTracks == FMP4_MAX_TRACKS) {
+        fprintf(stderr, "Cannot add another fMP4 track\n");
+        return -1;
+    }
+    if (config->type == FMP4_TRACK_VIDEO && (!config->avcc || config->avccSize <= 0)) {
+        fprintf(stderr, "H.264 track needs an avcC record\n");
+        return -1;
+    }
+    if (config->type == FMP4_TRACK_AUDIO &&
+        (!config->asc || config->ascSize <= 0 || config->ascSize > 64)) {
+        fprintf(stderr, "AAC track needs an AudioSpecificConfig\n");
+        return -1;
+    }
+    if (config->avccSize > MAX_CONFIG_SIZE) {
+        fprintf(stderr, "avcC record too large\n");
+        return -1;
+    }
+
+    t = &w->tracks[w->nbTracks];
+    t->config = *config;
+    if (t->config.timescale <= 0) {
+        t->config.timescale = config->type == FMP4_TRACK_VIDEO ? 90000 : config->sampleRate;
+    }
+    if (t->config.timescale <= 0) {
+        fprintf(stderr, "Track has no timescale\n");
+        return -1;
+    }
+
+    if (config->type == FMP4_TRACK_VIDEO) {
+        t->avcc = av_malloc(config->avccSize);
+        if (!t->avcc) {
+            return -1;
+        }
+        memcpy(t->avcc, config->avcc, config->avccSize);
+    } else {
+        t->asc = av_malloc(config->ascSize);
+        if (!t->asc) {
+            return -1;
+        }
+        memcpy(t->asc, config->asc, config->ascSize);
+    }
+    t->config.avcc = t->avcc;
+    t->config.asc = t->asc;
+
+    init_traf_template(t, w->nbTracks + 1);
+
+    return w->nbTracks++;
+}
+
+int Fmp4WriterWriteInit(Fmp4Writer* w) {
+    uint8_t* buf;
+    ByteWriter bw;
+    int moov, i, ret, size = 1024;
+
+    if (w->nbTracks == 0) {
+        fprintf(stderr, "fMP4 writer has no tracks\n");
+        return -1;
+    }
+
+    for (i = 0; i < w->nbTracks; i++) {
+        size += 512 + w->tracks[i].config.avccSize + w->tracks[i].config.ascSize;
+    }
+    buf = av_malloc(size);
+    if (!buf) {
+        return -1;
+    }
+    bw.buf = buf;
+    bw.pos = 0;
+
+    put_ftyp(&bw);
+    moov = box_start(&bw, "moov");
+    put_mvhd(&bw, w->nbTracks + 1);
+    for (i = 0; i < w->nbTracks; i++) {
+        put_trak(&bw, &w->tracks[i], i + 1);
+    }
+    put_mvex(&bw, w);
+    box_end(&bw, moov);
+
+    ret = w->writeFunction(w->wopaque, buf, bw.pos);
+    av_free(buf);
+    w->initWritten = 1;
+
+    return ret < 0 ? ret : 0;
+}
+
+int Fmp4WriterAddSample(Fmp4Writer* w, int track, const uint8_t* data, int size,
+                        int64_t dts, int duration, int ctsOffset, int isKeyFrame) {
+    Fmp4Track* t;
+    Fmp4Sample* s;
+
+    if (track < 0 || track >= w->nbTracks || size < 0 || duration < 0) {
+        return -1;
+    }
+    if (w->nbSamples == w->maxSamples) {
+        fprintf(stderr, "fMP4 fragment is full\n");
+        return -1;
+    }
+
+    t = &w->tracks[track];
+    if (t->count == 0) {
+        t->fragDts = dts;
+    }
+    t->count++;
+    t->bytes += size;
+
+    s = &w->samples[w->nbSamples++];
+    s->data = data;
+    s->size = size;
+    s->duration = duration;
+    s->ctsOffset = ctsOffset;
+    s->track = track;
+    s->isKeyFrame = isKeyFrame != 0;
+
+    return 0;
+}
+
+int Fmp4WriterMoofSize(const Fmp4Writer* w, const int* sampleCounts) {
+    int i, size = MOOF_HEADER_SIZE;
+
+    for (i = 0; i < w->nbTracks; i++) {
+        if (sampleCounts[i] > 0) {
+            size += TRAF_TEMPLATE_SIZE + sampleCounts[i] * w->tracks[i].entrySize;
+        }
+    }
+
+    return size;
+}
+
+int Fmp4WriterPendingSamples(const Fmp4Writer* w) {
+    return w->nbSamples;
+}
+
+// Writes the track's samples, one call per run of adjacent buffers.
+static int write_payloads(Fmp4Writer* w, int track) {
+    const uint8_t* run = 0;
+    int64_t runSize = 0;
+    int i, ret;
+
+    for (i = 0; i < w->nbSamples; i++) {
+        const Fmp4Sample* s = &w->samples[i];
+
+        if (s->track != track || s->size == 0) {
+            continue;
+        }
+        if (run && run + runSize == s->data) {
+            runSize += s->size;
+            continue;
+        }
+        if (run && (ret = w->writeFunction(w->wopaque, (uint8_t*)run, runSize)) < 0) {
+            return ret;
+        }
+        run = s->data;
+        runSize = s->size;
+    }
+
+    if (run && (ret = w->writeFunction(w->wopaque, (uint8_t*)run, runSize)) < 0) {
+        return ret;
+    }
+
+    return 0;
+}
+
+int Fmp4WriterFlushFragment(Fmp4Writer* w) {
+    int counts[FMP4_MAX_TRACKS];
+    int64_t dataOffset, mdatSize = MDAT_HEADER_SIZE;
+    uint8_t mdat[MDAT_HEADER_SIZE];
+    ByteWriter bw = { w->moof, 0 };
+    int moofSize, i, j, ret;
+
+    if (!w->initWritten) {
+        fprintf(stderr, "fMP4 init segment not written\n");
+        return -1;
+    }
+    if (w->nbSamples == 0) {
+        return 0;
+    }
+
+    for (i = 0; i < w->nbTracks; i++) {
+        counts[i] = w->tracks[i].count;
+        mdatSize += w->tracks[i].bytes;
+    }
+    if (mdatSize > UINT32_MAX) {
+        fprintf(stderr, "fMP4 fragment too large\n");
+        return -1;
+    }
+
+    moofSize = Fmp4WriterMoofSize(w, counts);
+    dataOffset = moofSize + MDAT_HEADER_SIZE;
+
+    put32(&bw, moofSize);
+    put_tag(&bw, "moof");
+    put32(&bw, 16);
+    put_tag(&bw, "mfhd");
+    put32(&bw, 0);
+    put32(&bw, w->sequence++);
+
+    for (i = 0; i < w->nbTracks; i++) {
+        Fmp4Track* t = &w->tracks[i];
+        uint8_t* traf = w->moof + bw.pos;
+        int trafSize = TRAF_TEMPLATE_SIZE + t->count * t->entrySize;
+
+        if (t->count == 0) {
+            continue;
+        }
+
+        memcpy(traf, t->traf, TRAF_TEMPLATE_SIZE);
+        set32(traf, trafSize);
+        set64(traf + TRAF_TFDT_TIME, t->fragDts);
+        set32(traf + TRAF_TRUN_SIZE, trafSize - TRAF_TRUN_SIZE);
+        set32(traf + TRAF_TRUN_COUNT, t->count);
+        set32(traf + TRAF_TRUN_DATA_OFFSET, dataOffset);
+        bw.pos += TRAF_TEMPLATE_SIZE;
+
+        for (j = 0; j < w->nbSamples; j++) {
+            const Fmp4Sample* s = &w->samples[j];
+            if (s->track != i) {
+                continue;
+            }
+            put32(&bw, s->duration);
+            put32(&bw, s->size);
+            if (t->entrySize == 16) {
+                put32(&bw, s->isKeyFrame ? SAMPLE_FLAGS_SYNC : SAMPLE_FLAGS_NON_SYNC);
+                put32(&bw, s->ctsOffset);
+            }
+        }
+
+        dataOffset += t->bytes;
+    }
+
+    set32(mdat, mdatSize);
+    memcpy(mdat + 4, "mdat", 4);
+
+    if ((ret = w->writeFunction(w->wopaque, w->moof, bw.pos)) < 0 ||
+        (ret = w->writeFunction(w->wopaque, mdat, MDAT_HEADER_SIZE)) < 0) {
+        return ret;
+    }
+    for (i = 0; i < w->nbTracks; i++) {
+        if ((ret = write_payloads(w, i)) < 0) {
+            return ret;
+        }
+        w->tracks[i].count = 0;
+        w->tracks[i].bytes = 0;
+    }
+    w->nbSamples = 0;
+
+    return 0;
+}
+
+void FreeFmp4Writer(Fmp4Writer* w) {
+    int i;
+
+    if (!w) {
+        return;
+    }
+
+    for (i = 0; i < w->nbTracks; i++) {
+        av_free(w->tracks[i].avcc);
+        av_free(w->tracks[i].asc);
+    }
+    av_free(w->samples);
+    av_free(w->moof);
+    av_free(w);
+}
@@ -0,0 +1,59 @@
+#ifndef FMP4_WRITER_H
+#define FMP4_WRITER_H
+
+#include "muxer.h"
+
+#define FMP4_MAX_TRACKS 2
+
+typedef enum {
+    FMP4_TRACK_VIDEO,
+    FMP4_TRACK_AUDIO,
+} Fmp4TrackType;
+
+typedef struct _Fmp4TrackConfig {
+    Fmp4TrackType type;
+    int timescale;
+    // H.264: AVCDecoderConfigurationRecord.
+    int width;
+    int height;
+    const uint8_t* avcc;
+    int avccSize;
+    // AAC: AudioSpecificConfig.
+    int sampleRate;
+    int channels;
+    const uint8_t* asc;
+    int ascSize;
+} Fmp4TrackConfig;
+
+typedef struct _Fmp4Writer Fmp4Writer;
+
+// Writes fragmented MP4 for H.264 and AAC without libavformat. Every
+// buffer is allocated up front for at most maxSamples samples per
+// fragment, so writing fragments does not allocate.
+Fmp4Writer* NewFmp4Writer(void* wopaque, BufferCallback writeFunction, int maxSamples);
+
+// Returns the track index, or -1.
+int Fmp4WriterAddTrack(Fmp4Writer* w, const Fmp4TrackConfig* config);
+
+// Writes ftyp and moov. Tracks cannot be added afterwards.
+int Fmp4WriterWriteInit(Fmp4Writer* w);
+
+// Adds a sample to the current fragment. The data is referenced, not
+// copied, and must stay valid until the fragment is flushed. Timestamps
+// are in the track timescale.
+int Fmp4WriterAddSample(Fmp4Writer* w, int track, const uint8_t* data, int size,
+                        int64_t dts, int duration, int ctsOffset, int isKeyFrame);
+
+// Writes moof and mdat for the samples added since the last flush.
+int Fmp4WriterFlushFragment(Fmp4Writer* w);
+
+// Size of the moof for a fragment with sampleCounts[track] samples, for
+// computing fragment offsets before writing.
+int Fmp4WriterMoofSize(const Fmp4Writer* w, const int* sampleCounts);
+
+// Number of samples in the current fragment.
+int Fmp4WriterPendingSamples(const Fmp4Writer* w);
+
+void FreeFmp4Writer(Fmp4Writer* w);
+
+#endif
@@ -0,0 +1,223 @@
+/*
+ * Copyright (c) 2014 veecr.
+ */
+
+#include "fragment_ring.h"
+#include <pthread.h>
+#include <libavutil/mem.h>
+
+typedef struct {
+    int64_t seq;
+    int64_t startMs;
+    int64_t durationMs;
+    uint8_t* data;
+    int size;
+} RingFragment;
+
+struct _FragmentRing {
+    pthread_mutex_t lock;
+    RingFragment* entries;
+    int capacity;
+    int head;
+    int count;
+    int64_t nextSeq;
+    int64_t bytes;
+    int64_t memoryBudget;
+    int64_t windowMs;
+};
+
+static RingFragment* entry_at(FragmentRing* ring, int i) {
+    return &ring->entries[(ring->head + i) % ring->capacity];
+}
+
+static void evict_oldest(FragmentRing* ring) {
+    RingFragment* f = entry_at(ring, 0);
+
+    ring->bytes -= f->size;
+    av_freep(&f->data);
+    ring->head = (ring->head + 1) % ring->capacity;
+    ring->count--;
+}
+
+// Index of the last fragment starting at or before timeMs, or -1.
+static int find_index(FragmentRing* ring, int64_t timeMs) {
+    int lo = 0, hi = ring->count - 1, found = -1;
+
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (entry_at(ring, mid)->startMs <= timeMs) {
+            found = mid;
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+
+    return found;
+}
+
+FragmentRing* NewFragmentRing(int maxFragments, int64_t memoryBudget, int64_t windowMs) {
+    FragmentRing* ring;
+
+    if (maxFragments <= 0) {
+        return 0;
+    }
+
+    ring = calloc(1, sizeof(FragmentRing));
+    if (!ring) {
+        return 0;
+    }
+
+    ring->entries = calloc(maxFragments, sizeof(RingFragment));
+    if (!ring->entries) {
+        free(ring);
+        return 0;
+    }
+
+    pthread_mutex_init(&ring->lock, 0);
+    ring->capacity = maxFragments;
+    ring->memoryBudget = memoryBudget;
+    ring->windowMs = windowMs;
+
+    return ring;
+}
+
+int64_t FragmentRingAppend(FragmentRing* ring, uint8_t* data, int size, int64_t startMs, int64_t durationMs) {
+    RingFragment* f;
+    int64_t seq;
+
+    if (ring->memoryBudget > 0 && size > ring->memoryBudget) {
+        av_free(data);
+        return -1;
+    }
+
+    pthread_mutex_lock(&ring->lock);
+
+    while (ring->count == ring->capacity ||
+           (ring->count > 0 && ring->memoryBudget > 0 && ring->bytes + size > ring->memoryBudget)) {
+        evict_oldest(ring);
+    }
+
+    f = entry_at(ring, ring->count);
+    f->seq = seq = ring->nextSeq++;
+    f->startMs = startMs;
+    f->durationMs = durationMs;
+    f->data = data;
+    f->size = size;
+    ring->count++;
+    ring->bytes += size;
+
+    while (ring->windowMs > 0 && ring->count > 1 &&
+           startMs + durationMs - entry_at(ring, 1)->startMs >= ring->windowMs) {
+        evict_oldest(ring);
+    }
+
+    pthread_mutex_unlock(&ring->lock);
+
+    return seq;
+}
+
+int FragmentRingGetFragment(FragmentRing* ring, int64_t seq, void* opaque, BufferCallback cb) {
+    int ret = -1;
+
+    pthread_mutex_lock(&ring->lock);
+
+    if (ring->count > 0) {
+        int64_t first = entry_at(ring, 0)->seq;
+        if (seq >= first && seq < first + ring->count) {
+            RingFragment* f = entry_at(ring, (int)(seq - first));
+            cb(opaque, f->data, f->size);
+            ret = f->size;
+        }
+    }
+
+    pthread_mutex_unlock(&ring->lock);
+
+    return ret;
+}
+
+int FragmentRingGetRange(FragmentRing* ring, int64_t startMs, int64_t endMs, void* opaque, BufferCallback cb) {
+    int i, n = 0;
+
+    pthread_mutex_lock(&ring->lock);
+
+    i = find_index(ring, startMs);
+    if (i < 0) {
+        i = 0;
+    }
+
+    for (; i < ring->count; i++) {
+        RingFragment* f = entry_at(ring, i);
+        if (f->startMs >= endMs) {
+            break;
+        }
+        if (cb(opaque, f->data, f->size) < 0) {
+            break;
+        }
+        n++;
+    }
+
+    pthread_mutex_unlock(&ring->lock);
+
+    return n;
+}
+
+int64_t FragmentRingFindByTime(FragmentRing* ring, int64_t timeMs) {
+    int64_t seq = -1;
+    int i;
+
+    pthread_mutex_lock(&ring->lock);
+
+    i = find_index(ring, timeMs);
+    if (i >= 0) {
+        seq = entry_at(ring, i)->seq;
+    } else if (ring->count > 0) {
+        seq = entry_at(ring, 0)->seq;
+    }
+
+    pthread_mutex_unlock(&ring->lock);
+
+    return seq;
+}
+
+void FragmentRingGetBounds(FragmentRing* ring, int64_t* firstSeq, int64_t* lastSeq, int64_t* startMs, int64_t* endMs) {
+    pthread_mutex_lock(&ring->lock);
+
+    if (ring->count > 0) {
+        RingFragment* first = entry_at(ring, 0);
+        RingFragment* last = entry_at(ring, ring->count - 1);
+        *firstSeq = first->seq;
+        *lastSeq = last->seq;
+        *startMs = first->startMs;
+        *endMs = last->startMs + last->durationMs;
+    } else {
+        *firstSeq = *lastSeq = -1;
+        *startMs = *endMs = 0;
+    }
+
+    pthread_mutex_unlock(&ring->lock);
+}
+
+int64_t FragmentRingGetMemoryUsage(FragmentRing* ring) {
+    int64_t bytes;
+
+    pthread_mutex_lock(&ring->lock);
+    bytes = ring->bytes;
+    pthread_mutex_unlock(&ring->lock);
+
+    return bytes;
+}
+
+void FreeFragmentRing(FragmentRing* ring) {
+    if (!ring) {
+        return;
+    }
+
+    while (ring->count > 0) {
+        evict_oldest(ring);
+    }
+
+    pthread_mutex_destroy(&ring->lock);
+    free(ring->entries);
+    free(ring);
+}
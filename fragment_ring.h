@@ -0,0 +1,26 @@
+#ifndef FRAGMENT_RING_H
+#define FRAGMENT_RING_H
+
+#include "muxer.h"
+
+typedef struct _FragmentRing FragmentRing;
+
+// A bounded in-memory window of completed fragments, indexed by sequence
+// number and start time (milliseconds). The oldest fragments are evicted
+// when the fragment count, memory budget or window duration is exceeded.
+// All functions are safe to call concurrently with FragmentRingAppend.
+FragmentRing* NewFragmentRing(int maxFragments, int64_t memoryBudget, int64_t windowMs);
+
+// Takes ownership of data (allocated with av_malloc). Returns the sequence
+// number of the fragment, or -1 if it is larger than the memory budget.
+int64_t FragmentRingAppend(FragmentRing* ring, uint8_t* data, int size, int64_t startMs, int64_t durationMs);
+
+// The callbacks below run with the ring locked and must not call back into it.
+int FragmentRingGetFragment(FragmentRing* ring, int64_t seq, void* opaque, BufferCallback writeFunction);
+int FragmentRingGetRange(FragmentRing* ring, int64_t startMs, int64_t endMs, void* opaque, BufferCallback writeFunction);
+int64_t FragmentRingFindByTime(FragmentRing* ring, int64_t timeMs);
+void FragmentRingGetBounds(FragmentRing* ring, int64_t* firstSeq, int64_t* lastSeq, int64_t* startMs, int64_t* endMs);
+int64_t FragmentRingGetMemoryUsage(FragmentRing* ring);
+void FreeFragmentRing(FragmentRing* ring);
+
+#endif
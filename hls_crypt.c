@@ -0,0 +1,661 @@
+/*
+ * Copyright (c) 2014 veecr.
+ */
+
+#include "hls_crypt.h"
+#include "annexb.h"
+#include <stdio.h>
+#include <string.h>
+#include <libavutil/aes.h>
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <wmmintrin.h>
+#define HAVE_AESNI 1
+#else
+#define HAVE_AESNI 0
+#endif
+
+#define TS_PACKET_SIZE 188
+#define AES_BLOCK_SIZE 16
+#define AES_ROUNDS 10
+
+// SAMPLE-AES leaves this much of a slice or AAC frame in the clear.
+#define VIDEO_CLEAR_LEADER 32
+#define VIDEO_MIN_ENCRYPTED 48
+#define VIDEO_CLEAR_RUN 144
+#define AUDIO_CLEAR_LEADER 16
+
+struct _HlsCrypt {
+    HlsCryptMethod method;
+    void* kopaque;
+    HlsKeyCallback keyFunction;
+    void* wopaque;
+    BufferCallback writeFunction;
+
+    uint8_t key[HLS_KEY_SIZE];
+    uint8_t iv[AES_BLOCK_SIZE];
+    int keyed;
+
+    int aesni;
+    uint8_t roundKeys[(AES_ROUNDS + 1) * AES_BLOCK_SIZE];
+    struct AVAES* aes;
+
+    // AES-128: CBC state and the bytes of an incomplete block.
+    uint8_t chain[AES_BLOCK_SIZE];
+    uint8_t pending[AES_BLOCK_SIZE];
+    int pendingSize;
+
+    // SAMPLE-AES: TS packet reassembly for the PMT rewrite.
+    uint8_t partial[TS_PACKET_SIZE];
+    int partialSize;
+    int pmtPid;
+    uint8_t* asc;
+    int ascSize;
+    // Set when the PMT could not be rewritten or a slice could not be
+    // encrypted; the segment is unplayable.
+    int error;
+
+    // Unescaped NAL unit being encrypted.
+    uint8_t* scratch;
+    int scratchCapacity;
+
+    uint8_t* out;
+    int outCapacity;
+};
+
+#if HAVE_AESNI
+static int cpu_has_aesni(void) {
+    unsigned int eax, ebx, ecx, edx;
+
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        return 0;
+    }
+
+    return (ecx & bit_AES) && (edx & bit_SSE2);
+}
+
+__attribute__((target("aes,sse2")))
+static __m128i aesni_expand_step(__m128i key, __m128i assist) {
+    assist = _mm_shuffle_epi32(assist, 0xff);
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    return _mm_xor_si128(key, assist);
+}
+
+#define AESNI_EXPAND(i, rcon) \
+    k[i] = aesni_expand_step(k[i - 1], _mm_aeskeygenassist_si128(k[i - 1], rcon))
+
+__attribute__((target("aes,sse2")))
+static void aesni_init_key(uint8_t* roundKeys, const uint8_t* key) {
+    __m128i k[AES_ROUNDS + 1];
+    int i;
+
+    k[0] = _mm_loadu_si128((const __m128i*)key);
+    AESNI_EXPAND(1, 0x01);
+    AESNI_EXPAND(2, 0x02);
+    AESNI_EXPAND(3, 0x04);
+    AESNI_EXPAND(4, 0x08);
+    AESNI_EXPAND(5, 0x10);
+    AESNI_EXPAND(6, 0x20);
+    AESNI_EXPAND(7, 0x40);
+    AESNI_EXPAND(8, 0x80);
+    AESNI_EXPAND(9, 0x1b);
+    AESNI_EXPAND(10, 0x36);
+
+    for (i = 0; i <= AES_ROUNDS; i++) {
+        _mm_storeu_si128((__m128i*)(roundKeys + i * AES_BLOCK_SIZE), k[i]);
+    }
+}
+
+__attribute__((target("aes,sse2")))
+static void aesni_cbc_encrypt(const uint8_t* roundKeys, uint8_t* dst, const uint8_t* src,
+                              int blocks, uint8_t* iv) {
+    __m128i k[AES_ROUNDS + 1];
+    __m128i b = _mm_loadu_si128((const __m128i*)iv);
+    int i, r;
+
+    for (i = 0; i <= AES_ROUNDS; i++) {
+        k[i] = _mm_loadu_si128((const __m128i*)(roundKeys + i * AES_BLOCK_SIZE));
+    }
+
+    for (i = 0; i < blocks; i++) {
+        b = _mm_xor_si128(b, _mm_loadu_si128((const __m128i*)(src + i * AES_BLOCK_SIZE)));
+        b = _mm_xor_si128(b, k[0]);
+        for (r = 1; r < AES_ROUNDS; r++) {
+            b = _mm_aesenc_si128(b, k[r]);
+        }
+        b = _mm_aesenclast_si128(b, k[AES_ROUNDS]);
+        _mm_storeu_si128((__m128i*)(dst + i * AES_BLOCK_SIZE), b);
+    }
+
+    _mm_storeu_si128((__m128i*)iv, b);
+}
+#endif
+
+// CBC encrypts whole blocks, leaving the last cipher block in iv. src and
+// dst may be the same.
+static void cbc_encrypt(HlsCrypt* c, uint8_t* dst, const uint8_t* src, int blocks, uint8_t* iv) {
+    if (blocks <= 0) {
+        return;
+    }
+#if HAVE_AESNI
+    if (c->aesni) {
+        aesni_cbc_encrypt(c->roundKeys, dst, src, blocks, iv);
+        return;
+    }
+#endif
+    av_aes_crypt(c->aes, dst, src, blocks, iv, 0);
+}
+
+static int set_key(HlsCrypt* c, const uint8_t* key) {
+    if (c->keyed && memcmp(c->key, key, HLS_KEY_SIZE) == 0) {
+        return 0;
+    }
+
+    memcpy(c->key, key, HLS_KEY_SIZE);
+#if HAVE_AESNI
+    if (c->aesni) {
+        aesni_init_key(c->roundKeys, key);
+        c->keyed = 1;
+        return 0;
+    }
+#endif
+    if (av_aes_init(c->aes, key, 128, 0) < 0) {
+        return -1;
+    }
+    c->keyed = 1;
+
+    return 0;
+}
+
+static int reserve(uint8_t** buf, int* capacity, int size) {
+    uint8_t* p;
+
+    if (size <= *capacity) {
+        return 0;
+    }
+
+    p = av_realloc(*buf, size);
+    if (!p) {
+        return -1;
+    }
+    *buf = p;
+    *capacity = size;
+
+    return 0;
+}
+
+static int write_output(HlsCrypt* c, uint8_t* buf, int size) {
+    int ret;
+
+    if (size == 0) {
+        return 0;
+    }
+
+    ret = c->writeFunction(c->wopaque, buf, size);
+
+    return ret < 0 ? ret : 0;
+}
+
+// MPEG-2 CRC32 over a PSI section.
+static uint32_t psi_crc(const uint8_t* data, int size) {
+    uint32_t crc = 0xffffffff;
+    int i, b;
+
+    for (i = 0; i < size; i++) {
+        crc ^= (uint32_t)data[i] << 24;
+        for (b = 0; b < 8; b++) {
+            crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04c11db7 : crc << 1;
+        }
+    }
+
+    return crc;
+}
+
+static int put_fourcc(uint8_t* p, const char* tag) {
+    memcpy(p, tag, 4);
+    return 4;
+}
+
+// Replaces the H.264 and AAC stream types with their SAMPLE-AES variants
+// and adds the descriptors the HLS sample encryption format requires. The
+// mpegts muxer has no way to signal these itself. Fails if the rewritten
+// section does not fit in the packet.
+static int rewrite_pmt(HlsCrypt* c, uint8_t* p) {
+    uint8_t section[TS_PACKET_SIZE];
+    const uint8_t* s;
+    int offset, sectionLength, end, programInfo, i, n;
+    uint32_t crc;
+
+    offset = 4;
+    if (p[3] & 0x20) {
+        offset += 1 + p[4];
+    }
+    if (!(p[1] & 0x40) || !(p[3] & 0x10) || offset >= TS_PACKET_SIZE) {
+        return 0;
+    }
+    offset += 1 + p[offset];
+    if (offset + 12 > TS_PACKET_SIZE || p[offset] != 0x02) {
+        return 0;
+    }
+
+    s = p + offset;
+    sectionLength = ((s[1] & 0x0f) << 8) | s[2];
+    end = 3 + sectionLength - 4;
+    if (offset + end + 4 > TS_PACKET_SIZE) {
+        fprintf(stderr, "SAMPLE-AES cannot rewrite a multi-packet PMT\n");
+        return AVERROR(EINVAL);
+    }
+
+    programInfo = 12 + (((s[10] & 0x0f) << 8) | s[11]);
+    memcpy(section, s, programInfo);
+    n = programInfo;
+
+    for (i = programInfo; i + 5 <= end; ) {
+        int streamType = s[i];
+        int esInfo = ((s[i + 3] & 0x0f) << 8) | s[i + 4];
+        int entry = n;
+
+        if (n + 5 + esInfo + 32 + c->ascSize > TS_PACKET_SIZE - offset - 4) {
+            fprintf(stderr, "SAMPLE-AES PMT does not fit in one packet\n");
+            return AVERROR(EINVAL);
+        }
+
+        memcpy(section + n, s + i, 5 + esInfo);
+        n += 5 + esInfo;
+
+        if (streamType == 0x1b) {
+            section[entry] = 0xdb;
+            section[n++] = 0x0f;  // private_data_indicator_descriptor
+            section[n++] = 4;
+            n += put_fourcc(section + n, "zavc");
+            esInfo += 6;
+        } else if (streamType == 0x0f) {
+            section[entry] = 0xcf;
+            section[n++] = 0x0f;
+            section[n++] = 4;
+            n += put_fourcc(section + n, "aacd");
+            // registration_descriptor carrying the audio setup information.
+            section[n++] = 0x05;
+            section[n++] = 4 + 4 + 2 + 1 + 1 + c->ascSize;
+            n += put_fourcc(section + n, "apad");
+            n += put_fourcc(section + n, "zaac");
+            section[n++] = 0;  // priming
+            section[n++] = 0;
+            section[n++] = 1;  // version
+            section[n++] = c->ascSize;
+            memcpy(section + n, c->asc, c->ascSize);
+            n += c->ascSize;
+            esInfo += 6 + 14 + c->ascSize;
+        }
+
+        section[entry + 3] = 0xf0 | (esInfo >> 8);
+        section[entry + 4] = esInfo & 0xff;
+        i += 5 + (((s[i + 3] & 0x0f) << 8) | s[i + 4]);
+    }
+
+    section[1] = (section[1] & 0xf0) | (((n + 4 - 3) >> 8) & 0x0f);
+    section[2] = (n + 4 - 3) & 0xff;
+    crc = psi_crc(section, n);
+    section[n++] = crc >> 24;
+    section[n++] = crc >> 16;
+    section[n++] = crc >> 8;
+    section[n++] = crc;
+
+    memcpy(p + offset, section, n);
+    memset(p + offset + n, 0xff, TS_PACKET_SIZE - offset - n);
+
+    return 0;
+}
+
+static int inspect_packet(HlsCrypt* c, uint8_t* p) {
+    int pid = ((p[1] & 0x1f) << 8) | p[2];
+
+    if (pid == 0 && (p[1] & 0x40) && (p[3] & 0x10)) {
+        int offset = 4 + ((p[3] & 0x20) ? 1 + p[4] : 0);
+        if (offset < TS_PACKET_SIZE - 17) {
+            offset += 1 + p[offset];
+            // First program of the PAT.
+            c->pmtPid = ((p[offset + 10] & 0x1f) << 8) | p[offset + 11];
+        }
+    } else if (pid == c->pmtPid) {
+        return rewrite_pmt(c, p);
+    }
+
+    return 0;
+}
+
+static int write_sample_aes(HlsCrypt* c, const uint8_t* buf, int size) {
+    int n = 0;
+
+    if (c->error < 0) {
+        return c->error;
+    }
+
+    if (reserve(&c->out, &c->outCapacity, size + TS_PACKET_SIZE) < 0) {
+        return AVERROR(ENOMEM);
+    }
+
+    if (c->partialSize > 0) {
+        int take = TS_PACKET_SIZE - c->partialSize;
+        if (take > size) {
+            take = size;
+        }
+        memcpy(c->partial + c->partialSize, buf, take);
+        c->partialSize += take;
+        buf += take;
+        size -= take;
+
+        if (c->partialSize < TS_PACKET_SIZE) {
+            return 0;
+        }
+        if ((c->error = inspect_packet(c, c->partial)) < 0) {
+            return c->error;
+        }
+        memcpy(c->out, c->partial, TS_PACKET_SIZE);
+        n = TS_PACKET_SIZE;
+        c->partialSize = 0;
+    }
+
+    while (size >= TS_PACKET_SIZE) {
+        memcpy(c->out + n, buf, TS_PACKET_SIZE);
+        if ((c->error = inspect_packet(c, c->out + n)) < 0) {
+            return c->error;
+        }
+        n += TS_PACKET_SIZE;
+        buf += TS_PACKET_SIZE;
+        size -= TS_PACKET_SIZE;
+    }
+
+    memcpy(c->partial, buf, size);
+    c->partialSize = size;
+
+    return write_output(c, c->out, n);
+}
+
+static int write_aes_128(HlsCrypt* c, const uint8_t* buf, int size) {
+    int n = 0, blocks;
+
+    if (reserve(&c->out, &c->outCapacity, size + AES_BLOCK_SIZE) < 0) {
+        return AVERROR(ENOMEM);
+    }
+
+    if (c->pendingSize > 0) {
+        int take = AES_BLOCK_SIZE - c->pendingSize;
+        if (take > size) {
+            take = size;
+        }
+        memcpy(c->pending + c->pendingSize, buf, take);
+        c->pendingSize += take;
+        buf += take;
+        size -= take;
+
+        if (c->pendingSize < AES_BLOCK_SIZE) {
+            return 0;
+        }
+        cbc_encrypt(c, c->out, c->pending, 1, c->chain);
+        n = AES_BLOCK_SIZE;
+        c->pendingSize = 0;
+    }
+
+    blocks = size / AES_BLOCK_SIZE;
+    cbc_encrypt(c, c->out + n, buf, blocks, c->chain);
+    n += blocks * AES_BLOCK_SIZE;
+
+    c->pendingSize = size - blocks * AES_BLOCK_SIZE;
+    memcpy(c->pending, buf + blocks * AES_BLOCK_SIZE, c->pendingSize);
+
+    return write_output(c, c->out, n);
+}
+
+HlsCrypt* NewHlsCrypt(HlsCryptMethod method, void* kopaque, HlsKeyCallback keyFunction) {
+    HlsCrypt* c;
+
+    if (method != HLS_CRYPT_AES_128 && method != HLS_CRYPT_SAMPLE_AES) {
+        fprintf(stderr, "Unknown encryption method %d\n", method);
+        return NULL;
+    }
+    if (!keyFunction) {
+        fprintf(stderr, "Encryption needs a key callback\n");
+        return NULL;
+    }
+
+    c = av_mallocz(sizeof(HlsCrypt));
+    if (!c) {
+        return NULL;
+    }
+
+    c->method = method;
+    c->kopaque = kopaque;
+    c->keyFunction = keyFunction;
+    c->pmtPid = -1;
+
+#if HAVE_AESNI
+    c->aesni = cpu_has_aesni();
+#endif
+    if (!c->aesni) {
+        c->aes = av_aes_alloc();
+        if (!c->aes) {
+            av_free(c);
+            return NULL;
+        }
+    }
+
+    return c;
+}
+
+int HlsCryptStartSegment(HlsCrypt* c, int64_t segment, void* wopaque, BufferCallback writeFunction) {
+    uint8_t key[HLS_KEY_SIZE];
+
+    if (c->keyFunction(c->kopaque, segment, key, c->iv) < 0) {
+        fprintf(stderr, "No key for segment %lld\n", (long long)segment);
+        return -1;
+    }
+    if (set_key(c, key) < 0) {
+        return -1;
+    }
+
+    c->wopaque = wopaque;
+    c->writeFunction = writeFunction;
+    memcpy(c->chain, c->iv, AES_BLOCK_SIZE);
+    c->pendingSize = 0;
+    c->partialSize = 0;
+    c->pmtPid = -1;
+    c->error = 0;
+
+    return 0;
+}
+
+int HlsCryptWrite(void* opaque, uint8_t* buf, int size) {
+    HlsCrypt* c = opaque;
+    int ret;
+
+    if (c->method == HLS_CRYPT_AES_128) {
+        ret = write_aes_128(c, buf, size);
+    } else {
+        ret = write_sample_aes(c, buf, size);
+    }
+
+    return ret < 0 ? ret : size;
+}
+
+int HlsCryptEndSegment(HlsCrypt* c) {
+    if (c->method == HLS_CRYPT_AES_128) {
+        int pad = AES_BLOCK_SIZE - c->pendingSize;
+        uint8_t block[AES_BLOCK_SIZE];
+
+        memset(c->pending + c->pendingSize, pad, pad);
+        cbc_encrypt(c, block, c->pending, 1, c->chain);
+        c->pendingSize = 0;
+
+        return write_output(c, block, AES_BLOCK_SIZE);
+    }
+
+    if (c->error < 0) {
+        return c->error;
+    }
+
+    if (c->partialSize > 0) {
+        int size = c->partialSize;
+
+        fprintf(stderr, "Segment ends with a partial TS packet\n");
+        c->partialSize = 0;
+        return write_output(c, c->partial, size);
+    }
+
+    return 0;
+}
+
+static int unescape_nal(uint8_t* dst, const uint8_t* src, int size) {
+    int i, n = 0, zeros = 0;
+
+    for (i = 0; i < size; i++) {
+        if (zeros >= 2 && src[i] == 0x03) {
+            zeros = 0;
+            continue;
+        }
+        dst[n++] = src[i];
+        zeros = src[i] == 0 ? zeros + 1 : 0;
+    }
+
+    return n;
+}
+
+static int escape_nal(uint8_t* dst, const uint8_t* src, int size) {
+    int i, n = 0, zeros = 0;
+
+    for (i = 0; i < size; i++) {
+        if (zeros >= 2 && src[i] <= 0x03) {
+            dst[n++] = 0x03;
+            zeros = 0;
+        }
+        dst[n++] = src[i];
+        zeros = src[i] == 0 ? zeros + 1 : 0;
+    }
+    // A NAL unit may not end in a zero byte.
+    if (n > 0 && dst[n - 1] == 0) {
+        dst[n++] = 0x03;
+    }
+
+    return n;
+}
+
+// Encrypts one 16 byte block in every 160 after the clear leader, chaining
+// across the encrypted blocks of the NAL unit only.
+static void encrypt_slice(HlsCrypt* c, uint8_t* nal, int size) {
+    uint8_t iv[AES_BLOCK_SIZE];
+    uint8_t* data = nal + VIDEO_CLEAR_LEADER;
+    int remaining = size - VIDEO_CLEAR_LEADER;
+
+    memcpy(iv, c->iv, AES_BLOCK_SIZE);
+
+    while (remaining > 0) {
+        int clear;
+
+        if (remaining > AES_BLOCK_SIZE) {
+            cbc_encrypt(c, data, data, 1, iv);
+            data += AES_BLOCK_SIZE;
+            remaining -= AES_BLOCK_SIZE;
+        }
+        clear = remaining < VIDEO_CLEAR_RUN ? remaining : VIDEO_CLEAR_RUN;
+        data += clear;
+        remaining -= clear;
+    }
+}
+
+int HlsCryptEncryptVideo(HlsCrypt* c, const uint8_t* in, int size, uint8_t* out) {
+    const uint8_t* end = in + size;
+    const uint8_t* nal = AnnexBFindStartCode(in, end);
+    int n;
+
+    // Anything before the first start code is passed through.
+    n = nal - in;
+    memcpy(out, in, n);
+
+    while (nal < end) {
+        const uint8_t* next;
+        int type, length;
+
+        memcpy(out + n, nal, 3);
+        n += 3;
+        nal += 3;
+
+        next = AnnexBFindStartCode(nal, end);
+        length = next - nal;
+        // Zero bytes ahead of a four byte start code belong to it.
+        if (next < end) {
+            while (length > 0 && nal[length - 1] == 0) {
+                length--;
+            }
+        }
+
+        type = length > 0 ? nal[0] & 0x1f : 0;
+        if ((type == 1 || type == 5) && length > VIDEO_MIN_ENCRYPTED) {
+            int clear;
+
+            // Never let a slice through in the clear.
+            if (reserve(&c->scratch, &c->scratchCapacity, length) < 0) {
+                fprintf(stderr, "Could not allocate a slice buffer for encryption\n");
+                c->error = AVERROR(ENOMEM);
+                return c->error;
+            }
+            clear = unescape_nal(c->scratch, nal, length);
+            encrypt_slice(c, c->scratch, clear);
+            n += escape_nal(out + n, c->scratch, clear);
+        } else {
+            memcpy(out + n, nal, length);
+            n += length;
+        }
+
+        memcpy(out + n, nal + length, next - nal - length);
+        n += next - nal - length;
+        nal = next;
+    }
+
+    return n;
+}
+
+void HlsCryptEncryptAudio(HlsCrypt* c, uint8_t* frame, int size) {
+    uint8_t iv[AES_BLOCK_SIZE];
+
+    if (size <= AUDIO_CLEAR_LEADER) {
+        return;
+    }
+
+    memcpy(iv, c->iv, AES_BLOCK_SIZE);
+    cbc_encrypt(c, frame + AUDIO_CLEAR_LEADER, frame + AUDIO_CLEAR_LEADER,
+                (size - AUDIO_CLEAR_LEADER) / AES_BLOCK_SIZE, iv);
+}
+
+int HlsCryptSetAudioConfig(HlsCrypt* c, const uint8_t* asc, int size) {
+    if (size > 64) {
+        fprintf(stderr, "AudioSpecificConfig too large for the PMT\n");
+        return -1;
+    }
+    av_freep(&c->asc);
+    c->ascSize = 0;
+    c->asc = av_malloc(size);
+    if (!c->asc) {
+        return -1;
+    }
+    memcpy(c->asc, asc, size);
+    c->ascSize = size;
+
+    return 0;
+}
+
+void FreeHlsCrypt(HlsCrypt* c) {
+    if (!c) {
+        return;
+    }
+
+    av_free(c->aes);
+    av_free(c->asc);
+    av_free(c->scratch);
+    av_free(c->out);
+    av_free(c);
+}
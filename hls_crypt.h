@@ -0,0 +1,51 @@
+#ifndef HLS_CRYPT_H
+#define HLS_CRYPT_H
+
+#include "muxer.h"
+
+#define HLS_KEY_SIZE 16
+
+typedef enum {
+    HLS_CRYPT_NONE = 0,
+    // AES-128-CBC over the whole segment with PKCS#7 padding.
+    HLS_CRYPT_AES_128,
+    // Partial encryption of H.264 slice NAL units and AAC frames.
+    HLS_CRYPT_SAMPLE_AES,
+} HlsCryptMethod;
+
+// Supplies the key and IV for a segment. Returning the previous key rotates
+// it only as often as the caller wants. Returns < 0 on error.
+typedef int(*HlsKeyCallback)(void *opaque, int64_t segment, uint8_t *key, uint8_t *iv);
+
+typedef struct _HlsCrypt HlsCrypt;
+
+HlsCrypt* NewHlsCrypt(HlsCryptMethod method, void* kopaque, HlsKeyCallback keyFunction);
+
+// Fetches the segment key and directs output to writeFunction.
+int HlsCryptStartSegment(HlsCrypt* c, int64_t segment, void* wopaque, BufferCallback writeFunction);
+
+// BufferCallback taking the muxer output, with the HlsCrypt as opaque.
+// AES-128 encrypts it; SAMPLE-AES rewrites the PMT to signal encrypted
+// streams.
+int HlsCryptWrite(void* opaque, uint8_t* buf, int size);
+
+// Pads and writes the end of the segment.
+int HlsCryptEndSegment(HlsCrypt* c);
+
+// Largest output HlsCryptEncryptVideo writes for size bytes of input.
+#define HLS_CRYPT_VIDEO_BOUND(size) ((size) + (size) / 2 + 16)
+
+// SAMPLE-AES encrypts the slices of an Annex-B access unit into out, which
+// must hold HLS_CRYPT_VIDEO_BOUND(size) bytes. Returns the output size, or
+// < 0 if a slice could not be encrypted; HlsCryptEndSegment then fails too.
+int HlsCryptEncryptVideo(HlsCrypt* c, const uint8_t* in, int size, uint8_t* out);
+
+// SAMPLE-AES encrypts a raw AAC frame, without its ADTS header, in place.
+void HlsCryptEncryptAudio(HlsCrypt* c, uint8_t* frame, int size);
+
+// AudioSpecificConfig signalled in the PMT for SAMPLE-AES audio.
+int HlsCryptSetAudioConfig(HlsCrypt* c, const uint8_t* asc, int size);
+
+void FreeHlsCrypt(HlsCrypt* c);
+
+#endif
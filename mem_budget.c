@@ -0,0 +1,31 @@
+/*
+ * Copyright (c) 2014 veecr.
+ */
+
+#include "mem_budget.h"
+
+void MemBudgetInit(MemBudget* b, int64_t limit) {
+    b->limit = limit;
+    b->used = 0;
+    b->peak = 0;
+}
+
+void MemBudgetCharge(MemBudget* b, int64_t bytes) {
+    b->used += bytes;
+    if (b->used > b->peak) {
+        b->peak = b->used;
+    }
+}
+
+void MemBudgetRelease(MemBudget* b, int64_t bytes) {
+    b->used -= bytes;
+}
+
+// Within 1/8 of the limit.
+int MemBudgetNearLimit(const MemBudget* b) {
+    return b->limit > 0 && b->used >= b->limit - b->limit / 8;
+}
+
+int MemBudgetOverLimit(const MemBudget* b) {
+    return b->limit > 0 && b->used > b->limit;
+}
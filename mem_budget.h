@@ -0,0 +1,20 @@
+#ifndef MEM_BUDGET_H
+#define MEM_BUDGET_H
+
+#include <stdint.h>
+
+// Tracks the memory held by one remux session. A limit of 0 only records
+// usage.
+typedef struct _MemBudget {
+    int64_t limit;
+    int64_t used;
+    int64_t peak;
+} MemBudget;
+
+void MemBudgetInit(MemBudget* b, int64_t limit);
+void MemBudgetCharge(MemBudget* b, int64_t bytes);
+void MemBudgetRelease(MemBudget* b, int64_t bytes);
+int MemBudgetNearLimit(const MemBudget* b);
+int MemBudgetOverLimit(const MemBudget* b);
+
+#endif
@@ -3,27 +3,136 @@
  */
 
 #include "mp4_frame_writer.h"
+#include "fragment_ring.h"
+#include "annexb.h"
+#include <libavutil/intreadwrite.h>
 #include <libavutil/timestamp.h>
 #include <libavutil/opt.h>
 #include <libavformat/avformat.h>
 
+// Without a video track there are no key frames to cut DVR fragments at.
+#define DVR_AUDIO_FRAGMENT_MS 2000
+
 typedef struct {
     AVStream *st;
 } OutputStream;
 
+typedef struct {
+    FragmentRing* ring;
+    uint8_t* init;
+    int initSize;
+    uint8_t* pending;
+    int pendingSize;
+    int pendingCapacity;
+    int64_t fragStartMs;
+    int64_t fragEndMs;
+    // Set when bytes of the pending fragment could not be buffered.
+    int error;
+} DvrState;
+
+// Annex-B ingest: the AVCC conversion buffer for frames that cannot be
+// converted in place, and the unconsumed tail of a byte stream.
+typedef struct {
+    uint8_t* scratch;
+    int scratchCapacity;
+    uint8_t* stream;
+    int streamSize;
+    int streamCapacity;
+    int scanPos;
+    int hasVcl;
+    int64_t nextDts;
+    int frameDuration;
+} AnnexBState;
+
 struct _FrameWriter {
     AVFormatContext *ofmt_ctx;
     OutputStream video_st;
     OutputStream audio_st;
+    void* wopaque;
+    BufferCallback writeFunction;
+    DvrState dvr;
+    AnnexBState annexb;
+    int headerWritten;
 };
 
+static int dvr_append(DvrState* dvr, const uint8_t* buf, int size) {
+    if (dvr->pendingSize + size > dvr->pendingCapacity) {
+        int capacity = FFMAX(dvr->pendingCapacity * 2, dvr->pendingSize + size);
+        uint8_t* pending = av_realloc(dvr->pending, capacity);
+        if (!pending) {
+            return AVERROR(ENOMEM);
+        }
+        dvr->pending = pending;
+        dvr->pendingCapacity = capacity;
+    }
+
+    memcpy(dvr->pending + dvr->pendingSize, buf, size);
+    dvr->pendingSize += size;
+
+    return 0;
+}
+
+// A DVR buffering failure is kept until the fragment boundary rather than
+// returned here, where avio would stop the live output as well.
+static int write_output(void* opaque, uint8_t* buf, int size) {
+    FrameWriter* fw = opaque;
+    int ret;
+
+    if (fw->dvr.ring && fw->dvr.error == 0 && (ret = dvr_append(&fw->dvr, buf, size)) < 0) {
+        fprintf(stderr, "Could not buffer DVR fragment.\n");
+        fw->dvr.error = ret;
+    }
+
+    return fw->writeFunction ? fw->writeFunction(fw->wopaque, buf, size) : size;
+}
+
+// Moves the bytes written since the last boundary into the DVR ring. A
+// fragment with bytes missing is dropped and its error returned.
+static int dvr_close_fragment(FrameWriter* fw) {
+    DvrState* dvr = &fw->dvr;
+    int ret = 0;
+
+    avio_flush(fw->ofmt_ctx->pb);
+
+    if (dvr->error < 0) {
+        ret = dvr->error;
+        dvr->error = 0;
+        av_freep(&dvr->pending);
+    } else if (dvr->pendingSize > 0) {
+        FragmentRingAppend(dvr->ring, dvr->pending, dvr->pendingSize,
+                           dvr->fragStartMs, dvr->fragEndMs - dvr->fragStartMs);
+        dvr->pending = 0;
+    } else {
+        return 0;
+    }
+
+    dvr->pendingSize = dvr->pendingCapacity = 0;
+    dvr->fragStartMs = AV_NOPTS_VALUE;
+
+    return ret;
+}
+
+static void dvr_track_sample(DvrState* dvr, AVStream* st, int64_t dts, int duration) {
+    int64_t startMs = av_rescale_q(dts, st->time_base, (AVRational){ 1, 1000 });
+    int64_t endMs = av_rescale_q(dts + duration, st->time_base, (AVRational){ 1, 1000 });
+
+    if (dvr->fragStartMs == AV_NOPTS_VALUE || startMs < dvr->fragStartMs) {
+        dvr->fragStartMs = startMs;
+    }
+    if (endMs > dvr->fragEndMs) {
+        dvr->fragEndMs = endMs;
+    }
+}
+
 FrameWriter* NewMp4FrameWriter(void* wopaque, BufferCallback writeFunction)
 {
     int ret;
     unsigned char *obuf;
     FrameWriter* fw;
 
-    fw = malloc(sizeof(FrameWriter));
+    fw = calloc(1, sizeof(FrameWriter));
+    fw->wopaque = wopaque;
+    fw->writeFunction = writeFunction;
     
     // Open output.
     obuf = av_malloc(8192);
@@ -44,7 +153,7 @@ FrameWriter* NewMp4FrameWriter(void* wopaque, BufferCallback writeFunction)
         goto end;
     }
 
-    fw->ofmt_ctx->pb = avio_alloc_context(obuf, 8192, 1, wopaque, 0, writeFunction, 0);
+    fw->ofmt_ctx->pb = avio_alloc_context(obuf, 8192, 1, fw, 0, write_output, 0);
     if (fw->ofmt_ctx->pb == NULL) {
         fprintf(stderr, "Could not create output buffer.");
         goto end;
@@ -143,6 +252,33 @@ void Mp4FrameWriterSetSpsPps(FrameWriter* fw, const uint8_t* spsBuf, int spsSize
     memcpy(c->extradata+offset, ppsBuf, ppsSize);
 }
 
+int Mp4FrameWriterEnableDvr(FrameWriter* fw, int maxFragments, int64_t memoryBudget, int64_t windowMs) {
+    if (fw->dvr.ring) {
+        return 0;
+    }
+
+    fw->dvr.ring = NewFragmentRing(maxFragments, memoryBudget, windowMs);
+    if (!fw->dvr.ring) {
+        fprintf(stderr, "Could not create DVR fragment ring.\n");
+        return AVERROR(ENOMEM);
+    }
+    fw->dvr.fragStartMs = AV_NOPTS_VALUE;
+
+    return 0;
+}
+
+FragmentRing* Mp4FrameWriterGetDvrRing(FrameWriter* fw) {
+    return fw->dvr.ring;
+}
+
+int Mp4FrameWriterGetDvrInitSegment(FrameWriter* fw, void* opaque, BufferCallback writeFunction) {
+    if (!fw->dvr.init) {
+        return -1;
+    }
+    writeFunction(opaque, fw->dvr.init, fw->dvr.initSize);
+    return fw->dvr.initSize;
+}
+
 int Mp4FrameWriterWriteHeader(FrameWriter* fw) {
     int ret = avformat_write_header(fw->ofmt_ctx, NULL);
     if (ret < 0) {
@@ -150,6 +286,21 @@ int Mp4FrameWriterWriteHeader(FrameWriter* fw) {
         return ret;
     }
 
+    fw->headerWritten = 1;
+
+    // With empty_moov the header is the init segment; keep it out of the ring.
+    if (fw->dvr.ring) {
+        avio_flush(fw->ofmt_ctx->pb);
+        if (fw->dvr.error < 0) {
+            fprintf(stderr, "Could not buffer DVR init segment.\n");
+            return fw->dvr.error;
+        }
+        fw->dvr.init = fw->dvr.pending;
+        fw->dvr.initSize = fw->dvr.pendingSize;
+        fw->dvr.pending = 0;
+        fw->dvr.pendingSize = fw->dvr.pendingCapacity = 0;
+    }
+
     // Dump format.
     av_dump_format(fw->ofmt_ctx, 0, NULL, 1);
 
@@ -158,57 +309,317 @@ int Mp4FrameWriterWriteHeader(FrameWriter* fw) {
 
 int Mp4FrameWriterWriteVclFrame(FrameWriter* fw, const uint8_t* buf, int size, int64_t pts, int64_t dts, int duration, int isKeyFrame) {
     AVPacket pkt = { 0 };
+    int dvrRet = 0;
     av_init_packet(&pkt);
     
     pkt.stream_index = fw->video_st.st->index;
     pkt.pts = pts;
     pkt.dts = dts;
     pkt.duration = duration;
-    pkt.buf = av_buffer_alloc(size);
-    memcpy(pkt.buf->data, buf, size);
-    pkt.data = pkt.buf->data;
-    pkt.size = pkt.buf->size;
+    // movenc copies the payload into the fragment before av_write_frame
+    // returns, so the caller's buffer is used without a reference.
+    pkt.data = (uint8_t*)buf;
+    pkt.size = size;
     pkt.flags = isKeyFrame ? AV_PKT_FLAG_KEY : 0;
     
     //fw->next_dts += 640;
+
+    // Cut the fragment ourselves so its bytes end exactly at the boundary.
+    if (fw->dvr.ring) {
+        if (isKeyFrame) {
+            av_write_frame(fw->ofmt_ctx, 0);
+            dvrRet = dvr_close_fragment(fw);
+        }
+        dvr_track_sample(&fw->dvr, fw->video_st.st, dts, duration);
+    }
     
     int ret = av_write_frame(fw->ofmt_ctx, &pkt);
     
-    av_buffer_unref(&pkt.buf);
-    
-    return ret;
+    // The frame still went to the live output.
+    return ret < 0 ? ret : dvrRet;
 }
 
 int Mp4FrameWriterWriteAudioPacket(FrameWriter* fw, const uint8_t* buf, int size, int64_t pts) {
     AVPacket pkt = { 0 };
+    int dvrRet = 0;
     av_init_packet(&pkt);
     
     pkt.stream_index = fw->audio_st.st->index;
     pkt.pts = pts;
     pkt.dts = pts;
     pkt.duration = 1024;
-    pkt.buf = av_buffer_alloc(size);
-    memcpy(pkt.buf->data, buf, size);
-    pkt.data = pkt.buf->data;
-    pkt.size = pkt.buf->size;
+    pkt.data = (uint8_t*)buf;
+    pkt.size = size;
     pkt.flags = AV_PKT_FLAG_KEY;
+
+    if (fw->dvr.ring && !fw->video_st.st) {
+        int64_t ms = av_rescale_q(pts, fw->audio_st.st->time_base, (AVRational){ 1, 1000 });
+        if (fw->dvr.fragStartMs != AV_NOPTS_VALUE && ms - fw->dvr.fragStartMs >= DVR_AUDIO_FRAGMENT_MS) {
+            av_write_frame(fw->ofmt_ctx, 0);
+            dvrRet = dvr_close_fragment(fw);
+        }
+        dvr_track_sample(&fw->dvr, fw->audio_st.st, pts, 1024);
+    }
     
     int ret = av_write_frame(fw->ofmt_ctx, &pkt);
     
-    av_buffer_unref(&pkt.buf);
-    
+    return ret < 0 ? ret : dvrRet;
+}
+
+static int grow_buffer(uint8_t** buf, int* capacity, int size) {
+    uint8_t* p;
+
+    if (size <= *capacity) {
+        return 0;
+    }
+
+    size = FFMAX(size, *capacity * 2);
+    p = av_realloc(*buf, size);
+    if (!p) {
+        return AVERROR(ENOMEM);
+    }
+    *buf = p;
+    *capacity = size;
+
+    return 0;
+}
+
+static int is_vcl(int type) {
+    return type == 1 || type == 5;
+}
+
+// Whether the SPS or PPS is one of those in the avcC.
+static int in_avcc(const AVCodecContext* c, const uint8_t* nal, int size) {
+    const uint8_t* p;
+    const uint8_t* end;
+    int count, list, len;
+
+    if (!c->extradata || c->extradata_size < 7) {
+        return 0;
+    }
+
+    p = c->extradata + 5;
+    end = c->extradata + c->extradata_size;
+
+    for (list = 0; list < 2 && p < end; list++) {
+        count = *p++ & (list == 0 ? 0x1f : 0xff);
+        for (; count > 0 && end - p >= 2; count--) {
+            len = AV_RB16(p);
+            p += 2;
+            if (len > end - p) {
+                return 0;
+            }
+            if (len == size && memcmp(p, nal, size) == 0) {
+                return 1;
+            }
+            p += len;
+        }
+    }
+
+    return 0;
+}
+
+int Mp4FrameWriterWriteAnnexBFrame(FrameWriter* fw, uint8_t* buf, int size, int64_t pts, int64_t dts, int duration) {
+    const uint8_t* end = buf + size;
+    const uint8_t* pos;
+    const uint8_t* sps = 0;
+    const uint8_t* pps = 0;
+    int spsSize = 0, ppsSize = 0;
+    int outSize = 0, inPlace = 1, isKeyFrame = 0, hasVcl = 0, ret;
+    AnnexBNal nal;
+    uint8_t* out;
+
+    if (!fw->video_st.st) {
+        fprintf(stderr, "No video stream for Annex-B frame.\n");
+        return AVERROR(EINVAL);
+    }
+
+    // First pass: find parameter sets and key frames, and check whether
+    // every length prefix fits in the bytes already consumed. Parameter sets
+    // are counted as if they all stay in the sample, which only makes the
+    // check stricter.
+    pos = buf;
+    while (AnnexBNextNal(&pos, end, &nal)) {
+        if (nal.type == 9) {
+            continue;
+        }
+        if (nal.type == 7 && !sps) {
+            sps = nal.data;
+            spsSize = nal.size;
+        } else if (nal.type == 8 && !pps) {
+            pps = nal.data;
+            ppsSize = nal.size;
+        } else if (nal.type == 5) {
+            isKeyFrame = 1;
+        }
+        hasVcl |= is_vcl(nal.type);
+        if (buf + outSize + 4 > nal.data) {
+            inPlace = 0;
+        }
+        outSize += 4 + nal.size;
+    }
+
+    if (!fw->video_st.st->codec->extradata && sps && pps) {
+        Mp4FrameWriterSetSpsPps(fw, sps, spsSize, pps, ppsSize);
+    }
+
+    // The header needs the avcC, so it waits for the first SPS and PPS.
+    // Frames ahead of them cannot be decoded and are dropped.
+    if (!fw->headerWritten) {
+        if (!fw->video_st.st->codec->extradata) {
+            return 0;
+        }
+        if ((ret = Mp4FrameWriterWriteHeader(fw)) < 0) {
+            return ret;
+        }
+    }
+
+    if (!hasVcl) {
+        return 0;
+    }
+
+    if (inPlace) {
+        out = buf;
+    } else {
+        if ((ret = grow_buffer(&fw->annexb.scratch, &fw->annexb.scratchCapacity, outSize)) < 0) {
+            return ret;
+        }
+        out = fw->annexb.scratch;
+    }
+
+    // Second pass: write length-prefixed NAL units. In place, the write
+    // position never passes the NAL unit being read. Parameter sets already
+    // in the avcC are dropped; new or changed ones stay in-band so that the
+    // frames using them can be decoded.
+    outSize = 0;
+    pos = buf;
+    while (AnnexBNextNal(&pos, end, &nal)) {
+        if (nal.type == 9 ||
+            ((nal.type == 7 || nal.type == 8) && in_avcc(fw->video_st.st->codec, nal.data, nal.size))) {
+            continue;
+        }
+        memmove(out + outSize + 4, nal.data, nal.size);
+        AV_WB32(out + outSize, nal.size);
+        outSize += 4 + nal.size;
+    }
+
+    return Mp4FrameWriterWriteVclFrame(fw, out, outSize, pts, dts, duration, isKeyFrame);
+}
+
+// A NAL unit after a slice that opens a new access unit (H.264 7.4.1.2.3).
+static int starts_access_unit(AnnexBState* st, const uint8_t* nal) {
+    int type = nal[0] & 0x1f;
+
+    if (!st->hasVcl) {
+        return 0;
+    }
+    if (type == 6 || type == 7 || type == 8 || type == 9 || (type >= 14 && type <= 18)) {
+        return 1;
+    }
+    // first_mb_in_slice == 0 is a single 1 bit.
+    return is_vcl(type) && (nal[1] & 0x80);
+}
+
+static int write_stream_unit(FrameWriter* fw, int size) {
+    AnnexBState* st = &fw->annexb;
+    int64_t dts = st->nextDts;
+    int ret;
+
+    st->nextDts += st->frameDuration;
+    st->hasVcl = 0;
+    st->scanPos = 0;
+
+    ret = Mp4FrameWriterWriteAnnexBFrame(fw, st->stream, size, dts, dts, st->frameDuration);
+
+    st->streamSize -= size;
+    memmove(st->stream, st->stream + size, st->streamSize);
+
     return ret;
 }
 
-void Mp4FrameWriterFlushFragment(FrameWriter* fw) {
+int Mp4FrameWriterWriteAnnexBStream(FrameWriter* fw, const uint8_t* buf, int size, int frameDuration) {
+    AnnexBState* st = &fw->annexb;
+    int ret;
+
+    if ((ret = grow_buffer(&st->stream, &st->streamCapacity, st->streamSize + size)) < 0) {
+        return ret;
+    }
+    memcpy(st->stream + st->streamSize, buf, size);
+    st->streamSize += size;
+    st->frameDuration = frameDuration;
+
+    while (1) {
+        const uint8_t* end = st->stream + st->streamSize;
+        const uint8_t* sc = AnnexBFindStartCode(st->stream + st->scanPos, end);
+        const uint8_t* nal = sc + 3;
+        int boundary;
+
+        if (sc == end) {
+            // A start code may straddle the next chunk.
+            st->scanPos = FFMAX(st->scanPos, st->streamSize - 2);
+            return 0;
+        }
+        if (end - nal < 2) {
+            st->scanPos = sc - st->stream;
+            return 0;
+        }
+
+        if (starts_access_unit(st, nal)) {
+            boundary = sc - st->stream;
+            while (boundary > 0 && st->stream[boundary - 1] == 0) {
+                boundary--;
+            }
+            if ((ret = write_stream_unit(fw, boundary)) < 0) {
+                return ret;
+            }
+            nal -= boundary;
+        }
+
+        if (is_vcl(nal[0] & 0x1f)) {
+            st->hasVcl = 1;
+        }
+        st->scanPos = nal - st->stream;
+    }
+}
+
+int Mp4FrameWriterFlushFragment(FrameWriter* fw) {
     av_write_frame(fw->ofmt_ctx, 0);
+    if (fw->dvr.ring) {
+        return dvr_close_fragment(fw);
+    }
+    return 0;
 }
 
-void Mp4FrameWriterComplete(FrameWriter* fw) {
+int Mp4FrameWriterComplete(FrameWriter* fw) {
+    int ret = 0, dvrRet = 0;
+
+    // The last access unit of a byte stream ends with the stream.
+    if (fw->annexb.hasVcl) {
+        ret = write_stream_unit(fw, fw->annexb.streamSize);
+    }
+
+    // Without a header, e.g. an Annex-B stream that never carried an SPS,
+    // there is nothing to finish.
+    if (!fw->headerWritten) {
+        fprintf(stderr, "Completing a writer whose header was never written.\n");
+        return ret < 0 ? ret : AVERROR(EINVAL);
+    }
+
+    if (fw->dvr.ring) {
+        av_write_frame(fw->ofmt_ctx, 0);
+        dvrRet = dvr_close_fragment(fw);
+    }
     av_write_trailer(fw->ofmt_ctx);
+
+    return ret < 0 ? ret : dvrRet;
 }
 
 void FreeMp4FrameWriter(FrameWriter* fw) {
     avformat_free_context(fw->ofmt_ctx);
+    FreeFragmentRing(fw->dvr.ring);
+    av_free(fw->dvr.init);
+    av_free(fw->dvr.pending);
+    av_free(fw->annexb.scratch);
+    av_free(fw->annexb.stream);
     free(fw);
 }
@@ -2,6 +2,7 @@
 #define MP4_MUXER_H
 
 #include "muxer.h"
+#include "fragment_ring.h"
 
 typedef struct _FrameWriter FrameWriter;
 
@@ -12,8 +13,27 @@ void Mp4FrameWriterSetSpsPps(FrameWriter* fw, const uint8_t* spsBuf, int spsSize
 int Mp4FrameWriterWriteHeader(FrameWriter* fw);
 int Mp4FrameWriterWriteVclFrame(FrameWriter* fw, const uint8_t* buf, int size, int64_t pts, int64_t dts, int duration, int isKeyFrame);
 int Mp4FrameWriterWriteAudioPacket(FrameWriter* fw, const uint8_t* buf, int size, int64_t pts);
-void Mp4FrameWriterFlushFragment(FrameWriter* fw);
-void Mp4FrameWriterComplete(FrameWriter* fw);
+// Annex-B ingest. SPS and PPS are taken out of the stream; the first pair
+// becomes the avcC, and Mp4FrameWriterWriteHeader is called then if it has
+// not been already. buf is converted to AVCC in place when every start
+// code leaves room for a length prefix.
+int Mp4FrameWriterWriteAnnexBFrame(FrameWriter* fw, uint8_t* buf, int size, int64_t pts, int64_t dts, int duration);
+// Takes a raw byte stream in any chunking and splits it into access units,
+// stamped frameDuration apart in decode order. Streams with B-frames need
+// Mp4FrameWriterWriteAnnexBFrame and real timestamps.
+int Mp4FrameWriterWriteAnnexBStream(FrameWriter* fw, const uint8_t* buf, int size, int frameDuration);
+int Mp4FrameWriterFlushFragment(FrameWriter* fw);
+int Mp4FrameWriterComplete(FrameWriter* fw);
 void FreeMp4FrameWriter(FrameWriter* fw);
 
+// DVR mode keeps the most recent fragments in memory for rewind. Call before
+// Mp4FrameWriterWriteHeader; a fragment is cut before every key frame, or
+// every 2 seconds when there is no video track.
+// writeFunction may be null to record without streaming. A fragment that
+// could not be buffered is left out of the ring, and the write that ends
+// it returns the error; the live output is not affected.
+int Mp4FrameWriterEnableDvr(FrameWriter* fw, int maxFragments, int64_t memoryBudget, int64_t windowMs);
+FragmentRing* Mp4FrameWriterGetDvrRing(FrameWriter* fw);
+int Mp4FrameWriterGetDvrInitSegment(FrameWriter* fw, void* opaque, BufferCallback writeFunction);
+
 #endif
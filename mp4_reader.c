@@ -11,13 +11,16 @@
 struct _FrameReader {
     AVFormatContext *ifmt_ctx;
     void* ropaque;
+    // A frame that did not fit the previous batch.
+    AVPacket pending;
+    int hasPending;
 };
 
 FrameReader* NewMp4FrameReader(void* ropaque, BufferCallback readFunction) {
     int ret;
     unsigned char *vibuf;
     
-    FrameReader* fr = malloc(sizeof(FrameReader));
+    FrameReader* fr = calloc(1, sizeof(FrameReader));
     fr->ropaque = ropaque;
     
     vibuf = av_malloc(8192);
@@ -49,36 +52,141 @@ end:
     return 0;
 }
 
+static AVStream* track_stream(FrameReader* fr, int track) {
+    if (!fr || track < 0 || track >= (int)fr->ifmt_ctx->nb_streams) {
+        return 0;
+    }
+    return fr->ifmt_ctx->streams[track];
+}
+
+// The mov demuxer skips samples of discarded streams without reading them;
+// the discard check here only guards against demuxers that don't. A frame
+// held back by Mp4FrameReaderReadFrames comes first, whichever read
+// function asks.
+static int read_selected_packet(FrameReader* fr, AVPacket* pkt) {
+    int ret;
+
+    if (fr->hasPending) {
+        *pkt = fr->pending;
+        fr->hasPending = 0;
+        return 0;
+    }
+
+    while ((ret = av_read_frame(fr->ifmt_ctx, pkt)) >= 0) {
+        if (fr->ifmt_ctx->streams[pkt->stream_index]->discard != AVDISCARD_ALL) {
+            return ret;
+        }
+        av_free_packet(pkt);
+    }
+
+    return ret;
+}
+
 enum AVMediaType Mp4FrameReaderGetMediaType(FrameReader* fr) {
-    return fr->ifmt_ctx->streams[0]->codec->codec_type;
+    return Mp4FrameReaderGetTrackMediaType(fr, 0);
 }
 
 void Mp4FrameReaderGetSpsAndPps(FrameReader* fr, uint8_t const** spsBuf, int* spsSize, uint8_t const** ppsBuf, int* ppsSize) {
-    uint8_t* ed = fr->ifmt_ctx->streams[0]->codec->extradata;
+    Mp4FrameReaderGetTrackSpsAndPps(fr, 0, spsBuf, spsSize, ppsBuf, ppsSize);
+}
+
+void Mp4FrameReaderGetAsc(FrameReader* fr, uint8_t const** ascBuf, int* ascSize) {
+    Mp4FrameReaderGetTrackAsc(fr, 0, ascBuf, ascSize);
+}
+
+int Mp4FrameReaderReadFrame(FrameReader* fr, void* opaque, WriteFrameCallback cb) {
+    AVPacket pkt;
+
+    if (read_selected_packet(fr, &pkt) < 0) {
+        return 0;
+    }
+
+    cb(opaque, pkt.data, pkt.size, pkt.pts, pkt.dts, pkt.duration);
+
+    av_free_packet(&pkt);
+
+    return 1;
+}
+
+int Mp4FrameReaderGetNumTracks(FrameReader* fr) {
+    return fr ? (int)fr->ifmt_ctx->nb_streams : 0;
+}
+
+enum AVMediaType Mp4FrameReaderGetTrackMediaType(FrameReader* fr, int track) {
+    AVStream* st = track_stream(fr, track);
+    return st ? st->codec->codec_type : AVMEDIA_TYPE_UNKNOWN;
+}
+
+void Mp4FrameReaderGetTrackSpsAndPps(FrameReader* fr, int track, uint8_t const** spsBuf, int* spsSize, uint8_t const** ppsBuf, int* ppsSize) {
+    AVStream* st = track_stream(fr, track);
+
+    *spsBuf = *ppsBuf = 0;
+    *spsSize = *ppsSize = 0;
+
+    // avcC: 6 byte header, 2 byte SPS length, SPS, PPS count, 2 byte PPS length, PPS.
+    if (!st || st->codec->codec_id != AV_CODEC_ID_H264 || st->codec->extradata_size < 8) {
+        return;
+    }
+
+    uint8_t* ed = st->codec->extradata;
     uint16_t spsSizeBigEnd = *(uint16_t*)(ed+6);
     *spsSize = ntohs(spsSizeBigEnd);
     *spsBuf = ed + 8;
-    
+
+    if (*spsSize + 11 > st->codec->extradata_size) {
+        return;
+    }
+
     uint16_t ppsSizeBigEnd = *(uint16_t*)(ed+*spsSize+9);
     *ppsSize = ntohs(ppsSizeBigEnd);
     *ppsBuf = ed + *spsSize + 11;
 }
 
-void Mp4FrameReaderGetAsc(FrameReader* fr, uint8_t const** ascBuf, int* ascSize) {
-    *ascBuf = fr->ifmt_ctx->streams[0]->codec->extradata;
-    *ascSize = fr->ifmt_ctx->streams[0]->codec->extradata_size;
+void Mp4FrameReaderGetTrackAsc(FrameReader* fr, int track, uint8_t const** ascBuf, int* ascSize) {
+    AVStream* st = track_stream(fr, track);
+
+    *ascBuf = st ? st->codec->extradata : 0;
+    *ascSize = st ? st->codec->extradata_size : 0;
 }
 
-int Mp4FrameReaderReadFrame(FrameReader* fr, void* opaque, WriteFrameCallback cb) {
-    int ret;
+void Mp4FrameReaderGetTrackTimeBase(FrameReader* fr, int track, int* num, int* den) {
+    AVStream* st = track_stream(fr, track);
+
+    *num = st ? st->time_base.num : 0;
+    *den = st ? st->time_base.den : 0;
+}
+
+int64_t Mp4FrameReaderGetTrackDuration(FrameReader* fr, int track) {
+    AVStream* st = track_stream(fr, track);
+    if (!st || st->duration == AV_NOPTS_VALUE) {
+        return 0;
+    }
+    return av_rescale_q(st->duration - (st->start_time != AV_NOPTS_VALUE ? st->start_time : 0),
+                        st->time_base, (AVRational){ 1, 1000 });
+}
+
+int64_t Mp4FrameReaderGetTrackNumFrames(FrameReader* fr, int track) {
+    AVStream* st = track_stream(fr, track);
+    return st ? st->nb_index_entries : 0;
+}
+
+void Mp4FrameReaderSelectTracks(FrameReader* fr, uint64_t trackMask) {
+    unsigned int i;
+
+    for (i = 0; i < fr->ifmt_ctx->nb_streams; i++) {
+        int selected = i < 64 && (trackMask & ((uint64_t)1 << i));
+        fr->ifmt_ctx->streams[i]->discard = selected ? AVDISCARD_DEFAULT : AVDISCARD_ALL;
+    }
+}
+
+int Mp4FrameReaderReadTrackFrame(FrameReader* fr, void* opaque, WriteTrackFrameCallback cb) {
     AVPacket pkt;
 
-    ret = av_read_frame(fr->ifmt_ctx, &pkt);
-    if (ret < 0) {
+    if (read_selected_packet(fr, &pkt) < 0) {
         return 0;
     }
 
-    cb(opaque, pkt.data, pkt.size, pkt.pts, pkt.dts, pkt.duration);
+    cb(opaque, pkt.stream_index, pkt.data, pkt.size, pkt.pts, pkt.dts, pkt.duration, (pkt.flags & AV_PKT_FLAG_KEY) != 0);
 
     av_free_packet(&pkt);
 
@@ -90,19 +198,64 @@ void* Mp4FrameReaderGetOpaquePointer(FrameReader* fr) {
 }
 
 int64_t Mp4FrameReaderGetDuration(FrameReader* fr) {
-    return ((fr->ifmt_ctx->streams[0]->duration - fr->ifmt_ctx->streams[0]->start_time) * 1000) / fr->ifmt_ctx->streams[0]->time_base.den;
+    return Mp4FrameReaderGetTrackDuration(fr, 0);
+}
+
+int Mp4FrameReaderReadFrames(FrameReader* fr, FrameDesc* frames, int maxFrames, uint8_t* arena, int64_t arenaSize) {
+    AVPacket pkt;
+    int64_t used = 0;
+    int n = 0;
+
+    while (n < maxFrames) {
+        if (read_selected_packet(fr, &pkt) < 0) {
+            break;
+        }
+
+        if (used + pkt.size > arenaSize) {
+            fr->pending = pkt;
+            fr->hasPending = 1;
+            if (n == 0) {
+                frames[0].size = pkt.size;
+                return -1;
+            }
+            break;
+        }
+
+        FrameDesc* f = &frames[n++];
+        f->track = pkt.stream_index;
+        f->isKeyFrame = (pkt.flags & AV_PKT_FLAG_KEY) != 0;
+        f->pts = pkt.pts;
+        f->dts = pkt.dts;
+        f->duration = pkt.duration;
+        f->offset = used;
+        f->size = pkt.size;
+
+        memcpy(arena + used, pkt.data, pkt.size);
+        used += pkt.size;
+
+        av_free_packet(&pkt);
+    }
+
+    return n;
 }
 
 void Mp4FrameReaderSeekToFrame(FrameReader* fr, int64_t frameIndex) {
     int64_t seekTarget = frameIndex * 19200;
+    if (fr->hasPending) {
+        av_free_packet(&fr->pending);
+        fr->hasPending = 0;
+    }
     av_seek_frame(fr->ifmt_ctx, -1, seekTarget, AVSEEK_FLAG_ANY);
 }
 
 int64_t Mp4FrameReaderGetNumFrames(FrameReader* fr) {
-    return fr ? fr->ifmt_ctx->streams[0]->nb_index_entries : 0;
+    return Mp4FrameReaderGetTrackNumFrames(fr, 0);
 }
 
 void FreeMp4FrameReader(FrameReader* fr) {
+    if (fr->hasPending) {
+        av_free_packet(&fr->pending);
+    }
     avformat_free_context(fr->ifmt_ctx);
     free(fr);
 }
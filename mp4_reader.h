@@ -6,6 +6,17 @@
 typedef struct _FrameReader FrameReader;
 
 typedef void(*WriteFrameCallback)(void* opaque, uint8_t* buf, int size, int64_t pts, int64_t dts, int duration);
+typedef struct _FrameDesc {
+    int track;
+    int isKeyFrame;
+    int64_t pts;
+    int64_t dts;
+    int duration;
+    int64_t offset;
+    int size;
+} FrameDesc;
+
+typedef void(*WriteTrackFrameCallback)(void* opaque, int track, uint8_t* buf, int size, int64_t pts, int64_t dts, int duration, int isKeyFrame);
 
 FrameReader* NewMp4FrameReader(void* ropaque, BufferCallback readFunction);
 enum AVMediaType Mp4FrameReaderGetMediaType(FrameReader* fr);
@@ -16,6 +27,29 @@ int Mp4FrameReaderReadFrame(FrameReader* fr, void* opaque, WriteFrameCallback wr
 void* Mp4FrameReaderGetOpaquePointer(FrameReader* fr);
 int64_t Mp4FrameReaderGetDuration(FrameReader* fr);
 int64_t Mp4FrameReaderGetNumFrames(FrameReader* fr);
+
+// Per-track access. Tracks are numbered 0..Mp4FrameReaderGetNumTracks()-1;
+// the functions above operate on track 0.
+int Mp4FrameReaderGetNumTracks(FrameReader* fr);
+enum AVMediaType Mp4FrameReaderGetTrackMediaType(FrameReader* fr, int track);
+void Mp4FrameReaderGetTrackAsc(FrameReader* fr, int track, uint8_t const** ascBuf, int* ascSize);
+void Mp4FrameReaderGetTrackSpsAndPps(FrameReader* fr, int track, uint8_t const** spsBuf, int* spsSize, uint8_t const** ppsBuf, int* ppsSize);
+void Mp4FrameReaderGetTrackTimeBase(FrameReader* fr, int track, int* num, int* den);
+int64_t Mp4FrameReaderGetTrackDuration(FrameReader* fr, int track);
+int64_t Mp4FrameReaderGetTrackNumFrames(FrameReader* fr, int track);
+
+// Selects the tracks returned by the read functions, bit N for track N.
+// Unselected tracks are discarded by the demuxer and their sample data is
+// never read. All tracks are selected by default.
+void Mp4FrameReaderSelectTracks(FrameReader* fr, uint64_t trackMask);
+int Mp4FrameReaderReadTrackFrame(FrameReader* fr, void* opaque, WriteTrackFrameCallback writeFunction);
+
+// Reads up to maxFrames frames of the selected tracks, packing their payloads
+// back to back into arena. offset in each descriptor is relative to arena.
+// Returns the number of frames read, 0 at end of input, or -1 if the next
+// frame alone is larger than arenaSize; frames[0].size then holds its size.
+int Mp4FrameReaderReadFrames(FrameReader* fr, FrameDesc* frames, int maxFrames, uint8_t* arena, int64_t arenaSize);
+
 void FreeMp4FrameReader(FrameReader* fr);
 
 #endif
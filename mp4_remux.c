@@ -2,15 +2,29 @@
  * Copyright (c) 2014 veecr.
  */
 
-#include "muxer.h"
+#include "mp4_remux.h"
+#include "tsmux.h"
+#include "timeline.h"
+#include "uring_input.h"
+#include "tail_input.h"
+#include "fmp4_writer.h"
 #include <libavformat/avformat.h>
 #include <libavutil/timestamp.h>
 #include <libavutil/opt.h>
 
+#define TAIL_IO_BUFFER_SIZE (64 << 10)
+
+// Fmp4Writer fragments are cut at video key frames, or every
+// AUDIO_FRAGMENT_MS for audio, and at most FRAGMENT_MAX_SAMPLES long.
+#define FRAGMENT_MAX_SAMPLES 1024
+#define AUDIO_FRAGMENT_MS 2000
+
 typedef struct {
     AVStream *st;
     AVFormatContext *ofmt_ctx;
     int64_t next_pts;
+    TimeRescaler rescale;
+    Timeline timeline;
 } OutputStream;
 
 /*
@@ -30,7 +44,6 @@ static void log_packet(AVStream *stream, const AVPacket *pkt, const char *tag)
 */
 
 static int write_packet(AVFormatContext *ifmt_ctx, OutputStream *out_stream) {
-    AVStream *in_stream;
     AVPacket pkt, ipkt;
     int ret;
 
@@ -41,13 +54,12 @@ static int write_packet(AVFormatContext *ifmt_ctx, OutputStream *out_stream) {
 
     pkt = ipkt;
 
-    in_stream  = ifmt_ctx->streams[pkt.stream_index];
-
-    //log_packet(in_stream, &pkt, "in");
+    //log_packet(ifmt_ctx->streams[pkt.stream_index], &pkt, "in");
 
-    pkt.pts = av_rescale_q_rnd(pkt.pts, in_stream->time_base, out_stream->st->time_base, AV_ROUND_NEAR_INF|AV_ROUND_PASS_MINMAX);
-    pkt.dts = av_rescale_q_rnd(pkt.dts, in_stream->time_base, out_stream->st->time_base, AV_ROUND_NEAR_INF|AV_ROUND_PASS_MINMAX);
-    pkt.duration = (int)av_rescale_q(pkt.duration, in_stream->time_base, out_stream->st->time_base);
+    pkt.pts = TimeRescale(&out_stream->rescale, pkt.pts);
+    pkt.dts = TimeRescale(&out_stream->rescale, pkt.dts);
+    pkt.duration = (int)TimeRescale(&out_stream->rescale, pkt.duration);
+    TimelineMapPacket(&out_stream->timeline, &pkt.pts, &pkt.dts, pkt.duration);
     pkt.pos = -1;
     pkt.stream_index = out_stream->st->index;
 
@@ -68,8 +80,14 @@ static int write_packet(AVFormatContext *ifmt_ctx, OutputStream *out_stream) {
 
 static int addStreams(OutputStream* os, AVFormatContext* ofmt_ctx, AVFormatContext* ifmt_ctx) {
     int ret;
+    unsigned int i;
     AVStream *in_stream = ifmt_ctx->streams[0];
 
+    // Only the first input stream is remuxed; skip the others in the demuxer.
+    for (i = 1; i < ifmt_ctx->nb_streams; i++) {
+        ifmt_ctx->streams[i]->discard = AVDISCARD_ALL;
+    }
+
     os->st = avformat_new_stream(ofmt_ctx, in_stream->codec->codec);
     if (!os->st) {
         fprintf(stderr, "Failed allocating output stream\n");
@@ -97,55 +115,40 @@ static int addStreams(OutputStream* os, AVFormatContext* ofmt_ctx, AVFormatConte
     return 0;
 }
 
-int Mp4RemuxToFragmented(
-        char const* filePath,
-        void* wopaque, BufferCallback writeFunction,
-        SeekCallback seekFunction)
+// Remuxes the first stream of an opened input to fragmented MP4 with movenc.
+static int remuxWithMovenc(AVFormatContext *ifmt_ctx, void* wopaque, BufferCallback writeFunction)
 {
     int ret = 0;
-    AVFormatContext *ifmt_ctx = 0, *ofmt_ctx = 0;
-    unsigned char *ibuf, *obuf;
+    AVFormatContext *ofmt_ctx = 0;
+    unsigned char *obuf;
     OutputStream stream = { 0 };
     int more = 1;
-    
+
     // Open output.
     obuf = av_malloc(8192);
     if (obuf == NULL) {
-        goto end;
+        return AVERROR(ENOMEM);
     }
 
     avformat_alloc_output_context2(&ofmt_ctx, NULL, "mp4", 0);
     if (!ofmt_ctx) {
         fprintf(stderr, "Could not create output context\n");
-        ret = AVERROR_UNKNOWN;
-        goto end;
+        av_free(obuf);
+        return AVERROR_UNKNOWN;
     }
-    
+
     ret = av_opt_set(ofmt_ctx, "movflags", "frag_keyframe+empty_moov+omit_tfhd_offset", AV_OPT_SEARCH_CHILDREN);
     if (ret < 0) {
         fprintf(stderr, "Failed to set fragmentation and empty moov option.\n");
+        av_free(obuf);
         goto end;
     }
 
     ofmt_ctx->pb = avio_alloc_context(obuf, 8192, 1, wopaque, 0, writeFunction, 0);
     if (ofmt_ctx->pb == NULL) {
         fprintf(stderr, "Could not create output buffer.");
-        goto end;
-    }
-
-    // Open input.
-    ibuf = av_malloc(8192);
-    if (ibuf == NULL) {
-        goto end;
-    }
-
-    if ((ret = avformat_open_input(&ifmt_ctx, filePath, 0, 0)) < 0) {
-        fprintf(stderr, "Could not open input.");
-        goto end;
-    }
-
-    if ((ret = avformat_find_stream_info(ifmt_ctx, 0)) < 0) {
-        fprintf(stderr, "Failed to retrieve input stream information");
+        av_free(obuf);
+        ret = AVERROR(ENOMEM);
         goto end;
     }
 
@@ -155,12 +158,18 @@ int Mp4RemuxToFragmented(
         goto end;
     }
 
+    UringHintIndex(ifmt_ctx);
+
     ret = avformat_write_header(ofmt_ctx, NULL);
     if (ret < 0) {
         fprintf(stderr, "Error occurred when opening output file\n");
         goto end;
     }
 
+    // The muxer may have changed the output time base in write_header.
+    TimeRescalerInit(&stream.rescale, ifmt_ctx->streams[0]->time_base, stream.st->time_base);
+    TimelineInit(&stream.timeline, 0, 0);
+
     // Dump formats.
     //av_dump_format(vifmt_ctx, 0, 0, 0);
     //av_dump_format(aifmt_ctx, 0, 0, 0);
@@ -173,9 +182,184 @@ int Mp4RemuxToFragmented(
     av_write_trailer(ofmt_ctx);
 
 end:
-    avformat_free_context(ifmt_ctx);
     avformat_free_context(ofmt_ctx);
 
+    return ret;
+}
+
+// Takes H.264 with an avcC or AAC with an AudioSpecificConfig, in a
+// 1/timescale time base as the mov demuxer sets. Returns -1 for anything
+// Fmp4Writer cannot write.
+static int initFmp4Config(Fmp4TrackConfig* config, const AVStream* st)
+{
+    const AVCodecContext* codec = st->codec;
+
+    memset(config, 0, sizeof(Fmp4TrackConfig));
+    if (st->time_base.num != 1 || !codec->extradata || codec->extradata_size <= 0) {
+        return -1;
+    }
+    config->timescale = st->time_base.den;
+
+    if (codec->codec_id == AV_CODEC_ID_H264 && codec->extradata[0] == 1 &&
+        codec->extradata_size <= 1024) {
+        config->type = FMP4_TRACK_VIDEO;
+        config->width = codec->width;
+        config->height = codec->height;
+        config->avcc = codec->extradata;
+        config->avccSize = codec->extradata_size;
+    } else if (codec->codec_id == AV_CODEC_ID_AAC && codec->extradata_size <= 64) {
+        config->type = FMP4_TRACK_AUDIO;
+        config->sampleRate = codec->sample_rate;
+        config->channels = codec->channels;
+        config->asc = codec->extradata;
+        config->ascSize = codec->extradata_size;
+    } else {
+        return -1;
+    }
+
+    return 0;
+}
+
+static int flushFmp4Fragment(Fmp4Writer *writer, AVPacket *pkts, int *held)
+{
+    int ret = Fmp4WriterFlushFragment(writer);
+    int i;
+
+    // The writer references the packet data until the fragment is out.
+    for (i = 0; i < *held; i++) {
+        av_free_packet(&pkts[i]);
+    }
+    *held = 0;
+
+    return ret;
+}
+
+// Remuxes the first stream of an opened input with Fmp4Writer, which
+// patches prebuilt moof templates instead of going through movenc.
+static int remuxWithFmp4Writer(AVFormatContext *ifmt_ctx, const Fmp4TrackConfig *config,
+                               void* wopaque, BufferCallback writeFunction)
+{
+    Fmp4Writer *writer;
+    AVPacket *pkts;
+    Timeline timeline;
+    int64_t base = AV_NOPTS_VALUE;
+    int64_t audioFragment = av_rescale(AUDIO_FRAGMENT_MS, config->timescale, 1000);
+    int video = config->type == FMP4_TRACK_VIDEO;
+    int held = 0, i, ret;
+
+    pkts = av_mallocz(FRAGMENT_MAX_SAMPLES * sizeof(AVPacket));
+    writer = NewFmp4Writer(wopaque, writeFunction, FRAGMENT_MAX_SAMPLES);
+    if (!pkts || !writer) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    if (Fmp4WriterAddTrack(writer, config) < 0 || Fmp4WriterWriteInit(writer) < 0) {
+        ret = AVERROR_UNKNOWN;
+        goto end;
+    }
+
+    UringHintIndex(ifmt_ctx);
+    TimelineInit(&timeline, 0, 0);
+
+    while (1) {
+        AVPacket pkt;
+
+        // As with movenc, a read error ends the output.
+        if (av_read_frame(ifmt_ctx, &pkt) < 0) {
+            break;
+        }
+        if (pkt.stream_index != 0) {
+            av_free_packet(&pkt);
+            continue;
+        }
+
+        if (pkt.dts == AV_NOPTS_VALUE) {
+            pkt.dts = pkt.pts;
+        }
+        TimelineMapPacket(&timeline, &pkt.pts, &pkt.dts, pkt.duration);
+        if (pkt.pts == AV_NOPTS_VALUE) {
+            pkt.pts = pkt.dts;
+        }
+        // Decode times start at zero when the first one is negative.
+        if (base == AV_NOPTS_VALUE) {
+            base = pkt.dts < 0 ? pkt.dts : 0;
+        }
+
+        if (held == FRAGMENT_MAX_SAMPLES ||
+            (held > 0 && (video ? (pkt.flags & AV_PKT_FLAG_KEY) != 0
+                                : pkt.dts - pkts[0].dts >= audioFragment))) {
+            if ((ret = flushFmp4Fragment(writer, pkts, &held)) < 0) {
+                av_free_packet(&pkt);
+                goto end;
+            }
+        }
+
+        pkts[held] = pkt;
+        ret = Fmp4WriterAddSample(writer, 0, pkt.data, pkt.size, pkt.dts - base,
+                                  (int)pkt.duration, (int)(pkt.pts - pkt.dts),
+                                  pkt.flags & AV_PKT_FLAG_KEY);
+        held++;
+        if (ret < 0) {
+            fprintf(stderr, "Sample rejected by the fragment writer\n");
+            ret = AVERROR_INVALIDDATA;
+            goto end;
+        }
+    }
+
+    ret = flushFmp4Fragment(writer, pkts, &held);
+
+end:
+    for (i = 0; i < held; i++) {
+        av_free_packet(&pkts[i]);
+    }
+    av_free(pkts);
+    FreeFmp4Writer(writer);
+
+    return ret;
+}
+
+// Remuxes the first stream of an opened input to fragmented MP4.
+static int remuxFragmented(AVFormatContext *ifmt_ctx, void* wopaque, BufferCallback writeFunction)
+{
+    Fmp4TrackConfig config;
+
+    if (initFmp4Config(&config, ifmt_ctx->streams[0]) == 0) {
+        unsigned int i;
+
+        // Only the first input stream is remuxed; skip the others in the demuxer.
+        for (i = 1; i < ifmt_ctx->nb_streams; i++) {
+            ifmt_ctx->streams[i]->discard = AVDISCARD_ALL;
+        }
+        return remuxWithFmp4Writer(ifmt_ctx, &config, wopaque, writeFunction);
+    }
+
+    return remuxWithMovenc(ifmt_ctx, wopaque, writeFunction);
+}
+
+int Mp4RemuxToFragmented(
+        char const* filePath,
+        void* wopaque, BufferCallback writeFunction,
+        SeekCallback seekFunction)
+{
+    int ret = 0;
+    AVFormatContext *ifmt_ctx = 0;
+
+    // Open input.
+    if ((ret = UringOpenInput(&ifmt_ctx, filePath)) < 0) {
+        fprintf(stderr, "Could not open input.");
+        goto end;
+    }
+
+    if ((ret = avformat_find_stream_info(ifmt_ctx, 0)) < 0) {
+        fprintf(stderr, "Failed to retrieve input stream information");
+        goto end;
+    }
+
+    ret = remuxFragmented(ifmt_ctx, wopaque, writeFunction);
+
+end:
+    UringCloseInput(&ifmt_ctx);
+
     if (ret < 0 && ret != AVERROR_EOF) {
         fprintf(stderr, "Error occurred: %s\n", av_err2str(ret));
         return 1;
@@ -183,3 +367,124 @@ end:
 
     return 0;
 }
+
+// The input has no seek callback, so the mov demuxer reads fragments in
+// file order as they are appended and never probes the moving end of the
+// file for an mfra.
+static int openTailInput(AVFormatContext **ifmt_ctx, TailInput *tail)
+{
+    unsigned char *ibuf;
+    AVIOContext *pb;
+    int ret;
+
+    ibuf = av_malloc(TAIL_IO_BUFFER_SIZE);
+    if (ibuf == NULL) {
+        return AVERROR(ENOMEM);
+    }
+
+    *ifmt_ctx = avformat_alloc_context();
+    if (*ifmt_ctx == NULL) {
+        av_free(ibuf);
+        return AVERROR(ENOMEM);
+    }
+
+    pb = avio_alloc_context(ibuf, TAIL_IO_BUFFER_SIZE, 0, tail, TailInputRead, 0, 0);
+    if (pb == NULL) {
+        fprintf(stderr, "Could not create input buffer.");
+        av_free(ibuf);
+        return AVERROR(ENOMEM);
+    }
+    (*ifmt_ctx)->pb = pb;
+
+    // On failure the context is freed and cleared, but custom I/O is left
+    // to the caller.
+    if ((ret = avformat_open_input(ifmt_ctx, 0, 0, 0)) < 0) {
+        fprintf(stderr, "Could not open input.");
+        av_free(pb->buffer);
+        av_free(pb);
+        return ret;
+    }
+
+    if ((ret = avformat_find_stream_info(*ifmt_ctx, 0)) < 0) {
+        fprintf(stderr, "Failed to retrieve input stream information");
+        return ret;
+    }
+
+    return 0;
+}
+
+static void closeTailInput(AVFormatContext **ifmt_ctx)
+{
+    AVIOContext *pb;
+
+    if (!*ifmt_ctx) {
+        return;
+    }
+
+    pb = (*ifmt_ctx)->pb;
+    avformat_close_input(ifmt_ctx);
+    if (pb) {
+        av_free(pb->buffer);
+        av_free(pb);
+    }
+}
+
+int Mp4RemuxTailToFragmented(
+        char const* filePath, int64_t idleTimeoutMs,
+        void* wopaque, BufferCallback writeFunction)
+{
+    int ret = 0;
+    AVFormatContext *ifmt_ctx = 0;
+    TailInput *tail;
+
+    tail = NewTailInput(filePath, idleTimeoutMs, 0);
+    if (!tail) {
+        return 1;
+    }
+
+    if ((ret = openTailInput(&ifmt_ctx, tail)) < 0) {
+        goto end;
+    }
+
+    ret = remuxFragmented(ifmt_ctx, wopaque, writeFunction);
+
+end:
+    closeTailInput(&ifmt_ctx);
+    FreeTailInput(tail);
+
+    if (ret < 0 && ret != AVERROR_EOF) {
+        fprintf(stderr, "Error occurred: %s\n", av_err2str(ret));
+        return 1;
+    }
+
+    return 0;
+}
+
+int Mp4RemuxTailToTs(
+        char const* filePath, int64_t idleTimeoutMs,
+        void* wopaque, BufferCallback writeFunction)
+{
+    TsRemuxOptions options = { 0 };
+    TailInput *tail;
+    int ret;
+
+    tail = NewTailInput(filePath, idleTimeoutMs, 0);
+    if (!tail) {
+        return 1;
+    }
+
+    // The recording carries both tracks.
+    options.audioFromVideoInput = 1;
+
+    // One session for the whole recording keeps timestamps and continuity
+    // counters running across fragments.
+    ret = remuxToTsWithOptions(
+            0, 0, 0,
+            tail, TailInputRead, 0,
+            wopaque, writeFunction,
+            &options, 0);
+
+    FreeTailInput(tail);
+
+    return ret;
+}
@@ -1,10 +1,22 @@
-#ifndef TS_MUXER_H
-#define TS_MUXER_H
+#ifndef MP4_REMUX_H
+#define MP4_REMUX_H
 
 #include "muxer.h"
 
 int Mp4RemuxToFragmented(
     char const* filePath,
+    void* wopaque, BufferCallback,
+    SeekCallback);
+
+// Tail mode for fragmented MP4s that are still being recorded. Each
+// fragment is remuxed once as it is appended, into one continuous output.
+// Returns when the file has not grown for idleTimeoutMs.
+int Mp4RemuxTailToFragmented(
+    char const* filePath, int64_t idleTimeoutMs,
+    void* wopaque, BufferCallback);
+
+int Mp4RemuxTailToTs(
+    char const* filePath, int64_t idleTimeoutMs,
     void* wopaque, BufferCallback);
 
 #endif
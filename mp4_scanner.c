@@ -0,0 +1,409 @@
+/*
+ * Copyright (c) 2014 veecr.
+ */
+
+#include "mp4_scanner.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define BOX(a, b, c, d) (((uint32_t)(a) << 24) | ((b) << 16) | ((c) << 8) | (d))
+
+// moov boxes beyond this are treated as malformed.
+#define MAX_MOOV_SIZE (256 << 20)
+
+static uint16_t rb16(const uint8_t* p) {
+    return (p[0] << 8) | p[1];
+}
+
+static uint32_t rb32(const uint8_t* p) {
+    return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static uint64_t rb64(const uint8_t* p) {
+    return ((uint64_t)rb32(p) << 32) | rb32(p + 4);
+}
+
+static void fourcc(char* dst, uint32_t type) {
+    dst[0] = type >> 24;
+    dst[1] = type >> 16;
+    dst[2] = type >> 8;
+    dst[3] = type;
+    dst[4] = 0;
+}
+
+// Steps over one child box in [*p, end). Returns 0 when there is none left.
+static int next_box(const uint8_t** p, const uint8_t* end, uint32_t* type, const uint8_t** payload, uint64_t* payloadSize) {
+    uint64_t size;
+    int header = 8;
+
+    if (end - *p < 8) {
+        return 0;
+    }
+
+    size = rb32(*p);
+    *type = rb32(*p + 4);
+    if (size == 1) {
+        if (end - *p < 16) {
+            return 0;
+        }
+        size = rb64(*p + 8);
+        header = 16;
+    } else if (size == 0) {
+        size = end - *p;
+    }
+
+    if (size < (uint64_t)header || size > (uint64_t)(end - *p)) {
+        return 0;
+    }
+
+    *payload = *p + header;
+    *payloadSize = size - header;
+    *p += size;
+
+    return 1;
+}
+
+// Reads an MPEG-4 descriptor length.
+static int read_desc_len(const uint8_t** p, const uint8_t* end) {
+    int len = 0, i;
+
+    for (i = 0; i < 4 && *p < end; i++) {
+        uint8_t b = *(*p)++;
+        len = (len << 7) | (b & 0x7f);
+        if (!(b & 0x80)) {
+            break;
+        }
+    }
+
+    return len;
+}
+
+static void set_config(ScanTrack* t, const uint8_t* data, int size) {
+    if (size <= 0 || t->codecConfig) {
+        return;
+    }
+    t->codecConfig = malloc(size);
+    if (t->codecConfig) {
+        memcpy(t->codecConfig, data, size);
+        t->codecConfigSize = size;
+    }
+}
+
+// ES_Descriptor > DecoderConfigDescriptor > DecoderSpecificInfo.
+static void parse_esds(ScanTrack* t, const uint8_t* p, const uint8_t* end) {
+    int len, flags;
+
+    p += 4;
+    if (p >= end || *p++ != 0x03) {
+        return;
+    }
+    read_desc_len(&p, end);
+    if (end - p < 3) {
+        return;
+    }
+    p += 2;
+    flags = *p++;
+    if (flags & 0x80) {
+        p += 2;
+    }
+    if ((flags & 0x40) && p < end) {
+        p += 1 + *p;
+    }
+    if (flags & 0x20) {
+        p += 2;
+    }
+
+    if (p >= end || *p++ != 0x04) {
+        return;
+    }
+    read_desc_len(&p, end);
+    p += 13;
+
+    if (p >= end || *p++ != 0x05) {
+        return;
+    }
+    len = read_desc_len(&p, end);
+    if (len <= end - p) {
+        set_config(t, p, len);
+    }
+}
+
+static void parse_stsd(ScanTrack* t, const uint8_t* p, uint64_t size) {
+    const uint8_t *end = p + size, *entry, *child;
+    uint64_t entrySize, childSize;
+    uint32_t type, childType;
+
+    if (size < 8) {
+        return;
+    }
+    p += 8;
+
+    if (!next_box(&p, end, &type, &entry, &entrySize)) {
+        return;
+    }
+    fourcc(t->codec, type);
+
+    if (!strcmp(t->handler, "vide") && entrySize >= 78) {
+        t->width = rb16(entry + 24);
+        t->height = rb16(entry + 26);
+        child = entry + 78;
+    } else if (!strcmp(t->handler, "soun") && entrySize >= 28) {
+        int version = rb16(entry + 8);
+        t->channels = rb16(entry + 16);
+        t->sampleRate = rb32(entry + 24) >> 16;
+        child = entry + 28 + (version == 1 ? 16 : version == 2 ? 36 : 0);
+    } else {
+        return;
+    }
+
+    while (next_box(&child, entry + entrySize, &childType, &p, &childSize)) {
+        if (childType == BOX('a','v','c','C') || childType == BOX('h','v','c','C')) {
+            set_config(t, p, (int)childSize);
+        } else if (childType == BOX('e','s','d','s')) {
+            parse_esds(t, p, p + childSize);
+        }
+    }
+}
+
+static void parse_stbl(ScanTrack* t, const uint8_t* p, const uint8_t* end) {
+    const uint8_t* payload;
+    uint64_t size, i;
+    uint32_t type;
+    int hasStss = 0;
+
+    while (next_box(&p, end, &type, &payload, &size)) {
+        switch (type) {
+        case BOX('s','t','s','d'):
+            parse_stsd(t, payload, size);
+            break;
+        case BOX('s','t','s','z'):
+            if (size >= 12) {
+                uint32_t sampleSize = rb32(payload + 4);
+                t->numSamples = rb32(payload + 8);
+                if (sampleSize) {
+                    t->totalBytes = (uint64_t)sampleSize * t->numSamples;
+                } else {
+                    for (i = 0; i < t->numSamples && 12 + i * 4 + 4 <= size; i++) {
+                        t->totalBytes += rb32(payload + 12 + i * 4);
+                    }
+                }
+            }
+            break;
+        case BOX('s','t','s','s'):
+            if (size >= 8) {
+                t->numKeyFrames = rb32(payload + 4);
+                hasStss = 1;
+            }
+            break;
+        }
+    }
+
+    // Without a sync sample table every sample is a sync sample.
+    if (!hasStss) {
+        t->numKeyFrames = t->numSamples;
+    }
+}
+
+static void parse_trak(ScanTrack* t, const uint8_t* p, const uint8_t* end) {
+    const uint8_t *payload, *mp, *mend, *mpayload;
+    uint64_t size, msize;
+    uint32_t type, mtype;
+
+    while (next_box(&p, end, &type, &payload, &size)) {
+        if (type == BOX('t','k','h','d') && size >= 24) {
+            t->trackId = rb32(payload + (payload[0] == 1 ? 20 : 12));
+        } else if (type == BOX('m','d','i','a')) {
+            mp = payload;
+            mend = payload + size;
+            while (next_box(&mp, mend, &mtype, &mpayload, &msize)) {
+                if (mtype == BOX('m','d','h','d') && msize >= 24) {
+                    if (mpayload[0] == 1 && msize >= 32) {
+                        t->timescale = rb32(mpayload + 20);
+                        t->duration = rb64(mpayload + 24);
+                    } else {
+                        t->timescale = rb32(mpayload + 12);
+                        t->duration = rb32(mpayload + 16);
+                    }
+                } else if (mtype == BOX('h','d','l','r') && msize >= 12) {
+                    fourcc(t->handler, rb32(mpayload + 8));
+                }
+            }
+            // minf needs the handler type, which may follow it in mdia.
+            mp = payload;
+            while (next_box(&mp, mend, &mtype, &mpayload, &msize)) {
+                if (mtype == BOX('m','i','n','f')) {
+                    const uint8_t *sp = mpayload, *spayload;
+                    uint64_t ssize;
+                    uint32_t stype;
+                    while (next_box(&sp, mpayload + msize, &stype, &spayload, &ssize)) {
+                        if (stype == BOX('s','t','b','l')) {
+                            parse_stbl(t, spayload, spayload + ssize);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    if (t->timescale) {
+        t->durationMs = t->duration * 1000 / t->timescale;
+        if (t->duration) {
+            t->bitrate = t->totalBytes * 8 * t->timescale / t->duration;
+        }
+    }
+}
+
+static void parse_moov(ScanResult* r, const uint8_t* p, const uint8_t* end) {
+    const uint8_t* payload;
+    uint64_t size;
+    uint32_t type;
+
+    while (next_box(&p, end, &type, &payload, &size)) {
+        if (type == BOX('m','v','h','d') && size >= 20) {
+            uint32_t timescale;
+            uint64_t duration;
+            if (payload[0] == 1 && size >= 32) {
+                timescale = rb32(payload + 20);
+                duration = rb64(payload + 24);
+            } else {
+                timescale = rb32(payload + 12);
+                duration = rb32(payload + 16);
+            }
+            if (timescale) {
+                r->durationMs = duration * 1000 / timescale;
+            }
+        } else if (type == BOX('t','r','a','k') && r->numTracks < MP4_SCAN_MAX_TRACKS) {
+            parse_trak(&r->tracks[r->numTracks++], payload, payload + size);
+        }
+    }
+}
+
+int Mp4ScanFile(const char* path, ScanResult* r) {
+    uint8_t header[16];
+    uint8_t* moov = 0;
+    uint64_t size;
+    int64_t pos = 0;
+    struct stat st;
+    int fd, header_size;
+
+    memset(r, 0, sizeof(ScanResult));
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return r->error = errno;
+    }
+
+    if (fstat(fd, &st) < 0) {
+        r->error = errno;
+        goto end;
+    }
+    r->fileSize = st.st_size;
+    r->error = -1;
+
+    while (pos + 8 <= r->fileSize) {
+        if (pread(fd, header, 16, pos) < 8) {
+            break;
+        }
+
+        size = rb32(header);
+        header_size = 8;
+        if (size == 1) {
+            size = rb64(header + 8);
+            header_size = 16;
+        } else if (size == 0) {
+            size = r->fileSize - pos;
+        }
+        if (size < (uint64_t)header_size) {
+            break;
+        }
+
+        if (rb32(header + 4) == BOX('m','o','o','v')) {
+            if (size > MAX_MOOV_SIZE || pos + (int64_t)size > r->fileSize) {
+                break;
+            }
+            moov = malloc(size);
+            if (!moov) {
+                r->error = ENOMEM;
+                break;
+            }
+            if (pread(fd, moov, size, pos) != (ssize_t)size) {
+                r->error = errno ? errno : -1;
+                break;
+            }
+            parse_moov(r, moov + header_size, moov + size);
+            r->error = 0;
+            break;
+        }
+
+        pos += size;
+    }
+
+    if (r->error == 0 && r->durationMs > 0) {
+        r->bitrate = r->fileSize * 8 * 1000 / r->durationMs;
+    }
+
+end:
+    free(moov);
+    close(fd);
+
+    return r->error;
+}
+
+typedef struct {
+    const char* const* paths;
+    ScanResult* results;
+    int numPaths;
+    int next;
+} ScanJob;
+
+static void* scan_worker(void* arg) {
+    ScanJob* job = arg;
+    int i;
+
+    while ((i = __sync_fetch_and_add(&job->next, 1)) < job->numPaths) {
+        Mp4ScanFile(job->paths[i], &job->results[i]);
+    }
+
+    return 0;
+}
+
+void Mp4ScanFiles(const char* const* paths, int numPaths, ScanResult* results, int numThreads) {
+    ScanJob job = { paths, results, numPaths, 0 };
+    pthread_t* threads;
+    int i, started = 0;
+
+    if (numThreads > numPaths) {
+        numThreads = numPaths;
+    }
+
+    // The calling thread is one of the workers.
+    threads = numThreads > 1 ? calloc(numThreads - 1, sizeof(pthread_t)) : 0;
+    if (threads) {
+        for (i = 0; i < numThreads - 1; i++) {
+            if (pthread_create(&threads[started], 0, scan_worker, &job) == 0) {
+                started++;
+            }
+        }
+    }
+
+    scan_worker(&job);
+
+    for (i = 0; i < started; i++) {
+        pthread_join(threads[i], 0);
+    }
+    free(threads);
+}
+
+void FreeScanResult(ScanResult* result) {
+    int i;
+
+    for (i = 0; i < result->numTracks; i++) {
+        free(result->tracks[i].codecConfig);
+        result->tracks[i].codecConfig = 0;
+    }
+}
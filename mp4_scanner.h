@@ -0,0 +1,45 @@
+#ifndef MP4_SCANNER_H
+#define MP4_SCANNER_H
+
+#include <stdint.h>
+
+#define MP4_SCAN_MAX_TRACKS 8
+
+typedef struct _ScanTrack {
+    int trackId;
+    char handler[5];        // "vide", "soun", ...
+    char codec[5];          // sample entry type, e.g. "avc1", "mp4a"
+    uint32_t timescale;
+    uint64_t duration;      // in timescale units
+    int64_t durationMs;
+    uint32_t numSamples;
+    uint32_t numKeyFrames;
+    uint64_t totalBytes;
+    int64_t bitrate;        // bits per second
+    int width;
+    int height;
+    int sampleRate;
+    int channels;
+    uint8_t* codecConfig;   // avcC payload or AudioSpecificConfig
+    int codecConfigSize;
+} ScanTrack;
+
+typedef struct _ScanResult {
+    int error;              // 0, or an errno value / -1 for malformed files
+    int64_t fileSize;
+    int64_t durationMs;
+    int64_t bitrate;
+    int numTracks;
+    ScanTrack tracks[MP4_SCAN_MAX_TRACKS];
+} ScanResult;
+
+// Reads only the top-level box headers and the moov box. Sample data is
+// never touched, so a scan costs a few small reads per file.
+int Mp4ScanFile(const char* path, ScanResult* result);
+
+// Scans paths on numThreads threads, filling results[i] for paths[i].
+void Mp4ScanFiles(const char* const* paths, int numPaths, ScanResult* results, int numThreads);
+
+void FreeScanResult(ScanResult* result);
+
+#endif
@@ -31,6 +31,8 @@
 #include <libavutil/timestamp.h>
 #include <libavutil/opt.h>
 #include <libavformat/avformat.h>
+#include "timeline.h"
+#include "uring_input.h"
 
 //int64_t seekFunction(void *opaque, int64_t offset, int whence);
 
@@ -48,24 +50,26 @@ static void log_packet(const AVFormatContext *fmt_ctx, const AVPacket *pkt, cons
            time_base->den);
 }
 
-typedef struct _StreamTimings {
-    int ptsOffset;
-    int dtsOffset;
-} StreamTimings;
+#define MAX_CONCAT_STREAMS 2
 
 typedef struct _ConcatContext {
     AVFormatContext *ofmt_ctx;
-    StreamTimings lastTimings[2];
+    Timeline timelines[MAX_CONCAT_STREAMS];
 } ConcatContext;
 
 static void copy_input_to_output(ConcatContext *conCtx, AVFormatContext *ifmt_ctx, AVFormatContext *ofmt_ctx)
 {
-    StreamTimings streamTimings[2];
+    TimeRescaler rescalers[MAX_CONCAT_STREAMS];
+    int i;
+
+    for (i = 0; i < MAX_CONCAT_STREAMS && i < (int)ifmt_ctx->nb_streams && i < (int)ofmt_ctx->nb_streams; i++) {
+        TimeRescalerInit(&rescalers[i], ifmt_ctx->streams[i]->time_base, ofmt_ctx->streams[i]->time_base);
+        // Each input continues where the previous one ended.
+        TimelineSplice(&conCtx->timelines[i]);
+    }
 
     while (1) {
-        AVStream *in_stream, *out_stream;
         AVPacket pkt;
-        StreamTimings lastTimings;
         int ret, si;
 
         ret = av_read_frame(ifmt_ctx, &pkt);
@@ -73,22 +77,21 @@ static void copy_input_to_output(ConcatContext *conCtx, AVFormatContext *ifmt_ct
             break;
 
         si = pkt.stream_index;
-        in_stream  = ifmt_ctx->streams[si];
-        out_stream = ofmt_ctx->streams[si];
-        lastTimings = conCtx->lastTimings[si];
+        if (si >= MAX_CONCAT_STREAMS || si >= (int)ofmt_ctx->nb_streams) {
+            av_free_packet(&pkt);
+            continue;
+        }
 
         //log_packet(ifmt_ctx, &pkt, "in");
 
-        pkt.pts = lastTimings.ptsOffset + av_rescale_q_rnd(pkt.pts, in_stream->time_base, out_stream->time_base, AV_ROUND_NEAR_INF|AV_ROUND_PASS_MINMAX);
-        pkt.dts = lastTimings.dtsOffset + av_rescale_q_rnd(pkt.dts, in_stream->time_base, out_stream->time_base, AV_ROUND_NEAR_INF|AV_ROUND_PASS_MINMAX);
-        pkt.duration = av_rescale_q(pkt.duration, in_stream->time_base, out_stream->time_base);
+        pkt.pts = TimeRescale(&rescalers[si], pkt.pts);
+        pkt.dts = TimeRescale(&rescalers[si], pkt.dts);
+        pkt.duration = (int)TimeRescale(&rescalers[si], pkt.duration);
+        TimelineMapPacket(&conCtx->timelines[si], &pkt.pts, &pkt.dts, pkt.duration);
         pkt.pos = -1;
 
         //log_packet(ofmt_ctx, &pkt, "out");
 
-        streamTimings[si].ptsOffset = pkt.pts + pkt.duration;
-        streamTimings[si].dtsOffset = pkt.dts + pkt.duration;
-
         ret = av_interleaved_write_frame(ofmt_ctx, &pkt);
         if (ret < 0) {
             fprintf(stderr, "Error muxing packet\n");
@@ -97,9 +100,6 @@ static void copy_input_to_output(ConcatContext *conCtx, AVFormatContext *ifmt_ct
 
         av_free_packet(&pkt);
     }
-
-    conCtx->lastTimings[0] = streamTimings[0];
-    conCtx->lastTimings[1] = streamTimings[1];
 }
 
 int createStream(int numFiles, char **filenames, void* opaque, int(*writeFunction)(void *opaque, uint8_t *buf, int buf_size))
@@ -108,7 +108,6 @@ int createStream(int numFiles, char **filenames, void* opaque, int(*writeFunctio
     AVFormatContext *ifmt_ctx = NULL, *ofmt_ctx = NULL;
     const char *in_filename;
     int ret, i, filenameIndex = 0;
-    int64_t durationOffset = 0;
     unsigned char* buf = 0;
     
     buf = av_malloc(8192);
@@ -120,7 +119,7 @@ int createStream(int numFiles, char **filenames, void* opaque, int(*writeFunctio
 
     av_register_all();
 
-    if ((ret = avformat_open_input(&ifmt_ctx, in_filename, 0, 0)) < 0) {
+    if ((ret = UringOpenInput(&ifmt_ctx, in_filename)) < 0) {
         fprintf(stderr, "Could not open input file '%s'", in_filename);
         goto end;
     }
@@ -132,6 +131,8 @@ int createStream(int numFiles, char **filenames, void* opaque, int(*writeFunctio
 
     av_dump_format(ifmt_ctx, 0, in_filename, 0);
 
+    UringHintIndex(ifmt_ctx);
+
     avformat_alloc_output_context2(&ofmt_ctx, NULL, "mp4", NULL);
     if (!ofmt_ctx) {
         fprintf(stderr, "Could not create output context\n");
@@ -186,14 +187,17 @@ int createStream(int numFiles, char **filenames, void* opaque, int(*writeFunctio
 
     ConcatContext conCtx;
     memset(&conCtx, 0, sizeof(ConcatContext));
+    for (i = 0; i < MAX_CONCAT_STREAMS; i++) {
+        TimelineInit(&conCtx.timelines[i], 0, 0);
+    }
 
     copy_input_to_output(&conCtx, ifmt_ctx, ofmt_ctx);
 
     while (++filenameIndex < numFiles) {
-        avformat_close_input(&ifmt_ctx);
+        UringCloseInput(&ifmt_ctx);
 
         in_filename = filenames[filenameIndex];
-        if ((ret = avformat_open_input(&ifmt_ctx, in_filename, 0, 0)) < 0) {
+        if ((ret = UringOpenInput(&ifmt_ctx, in_filename)) < 0) {
             fprintf(stderr, "Could not open input file '%s'", in_filename);
             goto end;
         }
@@ -205,13 +209,14 @@ int createStream(int numFiles, char **filenames, void* opaque, int(*writeFunctio
 
         av_dump_format(ifmt_ctx, 0, in_filename, 0);
 
+        UringHintIndex(ifmt_ctx);
         copy_input_to_output(&conCtx, ifmt_ctx, ofmt_ctx);
     }
 
     av_write_trailer(ofmt_ctx);
 end:
 
-    avformat_close_input(&ifmt_ctx);
+    UringCloseInput(&ifmt_ctx);
 
     /* close output */
     //if (ofmt_ctx && !(ofmt->flags & AVFMT_NOFILE))
@@ -1,7 +1,7 @@
 package grune
 
 // #cgo CFLAGS: -I/usr/local/include
-// #cgo LDFLAGS: -L/usr/local/lib -lavformat -lavcodec -lavutil -lswscale
+// #cgo LDFLAGS: -L/usr/local/lib -lavformat -lavcodec -lavutil -lswscale -lpthread
 // #include "tsmux.h"
 // #include <stdio.h>
 // #include <stdlib.h>
@@ -23,21 +23,40 @@ package grune
 //}
 //
 //typedef int(*callback_fcn)(void* opaque, uint8_t* buf, int buf_size);
-//void WriteFunction(void*, void*, int);
-//int ReadFunction(void*, void*, int);
+//typedef int64_t(*seek_fcn)(void* opaque, int64_t to, int whence);
+//void WriteFunction(uintptr_t, void*, int);
+//int ReadFunction(uintptr_t, void*, int);
+//int64_t SeekFunction(uintptr_t, int64_t, int);
+//int KeyFunction(uintptr_t, int64_t, void*, void*);
 //
 //int writeFunction_cgo(void* opaque, uint8_t* buf, int buf_size) {
-//    WriteFunction(opaque, buf, buf_size);
+//    WriteFunction((uintptr_t)opaque, buf, buf_size);
 //    return 0;
 //}
 //
 //int readFunction_cgo(void* opaque, uint8_t* buf, int buf_size) {
-//    return ReadFunction(opaque, buf, buf_size);
+//    return ReadFunction((uintptr_t)opaque, buf, buf_size);
+//}
+//
+//int64_t seekFunction_cgo(void* opaque, int64_t to, int whence) {
+//    return SeekFunction((uintptr_t)opaque, to, whence);
+//}
+//
+//int keyFunction_cgo(void* opaque, int64_t segment, uint8_t* key, uint8_t* iv) {
+//    return KeyFunction((uintptr_t)opaque, segment, key, iv);
+//}
+//
+//static void* handleToOpaque(uintptr_t h) {
+//    return (void*)h;
 //}
 import "C"
 import (
 	"fmt"
 	"io"
+	"runtime"
+	"runtime/cgo"
+	"sync"
+	"time"
 	"unsafe"
 )
 
@@ -54,6 +73,51 @@ type ReaderContext struct {
 	r io.Reader
 }
 
+type KeyContext struct {
+	keys func(segment int64) (key, iv [16]byte, err error)
+}
+
+// Every call into the native muxer holds an OS thread until it returns, so
+// the number of concurrent remuxes is bounded. Callers beyond the limit wait
+// as goroutines instead of as blocked threads.
+var (
+	remuxPoolMu sync.Mutex
+	remuxPool   = make(chan struct{}, runtime.GOMAXPROCS(0))
+)
+
+// SetRemuxConcurrency sets the maximum number of remuxes running in native
+// code at once. Remuxes already running finish against the previous limit.
+func SetRemuxConcurrency(n int) {
+	if n < 1 {
+		n = 1
+	}
+	remuxPoolMu.Lock()
+	remuxPool = make(chan struct{}, n)
+	remuxPoolMu.Unlock()
+}
+
+func acquireRemuxSlot() chan struct{} {
+	remuxPoolMu.Lock()
+	pool := remuxPool
+	remuxPoolMu.Unlock()
+	pool <- struct{}{}
+	return pool
+}
+
+func releaseRemuxSlot(pool chan struct{}) {
+	<-pool
+}
+
+// newOpaque wraps v in a cgo.Handle so that no Go pointer is passed to C.
+// The returned release function must be called once C is done with it.
+func newOpaque(v interface{}) (unsafe.Pointer, func()) {
+	if v == nil {
+		return nil, func() {}
+	}
+	h := cgo.NewHandle(v)
+	return C.handleToOpaque(C.uintptr_t(h)), h.Delete
+}
+
 /*
 func StreamVideo(w io.Writer, filenames []string) error {
 	cargs := C.makeCharArray(C.int(len(filenames)))
@@ -72,8 +136,8 @@ func StreamVideo(w io.Writer, filenames []string) error {
 
 func Mp4ToTs(ar io.Reader, vr io.Reader, w io.Writer) error {
 	var (
-		arctx *ReaderContext
-		vrctx *ReaderContext
+		arctx interface{}
+		vrctx interface{}
 	)
 	if ar != nil {
 		arctx = &ReaderContext{ar}
@@ -81,13 +145,126 @@ func Mp4ToTs(ar io.Reader, vr io.Reader, w io.Writer) error {
 	if vr != nil {
 		vrctx = &ReaderContext{vr}
 	}
-	wctx := &WriterContext{w}
+	aropaque, releaseAr := newOpaque(arctx)
+	defer releaseAr()
+	vropaque, releaseVr := newOpaque(vrctx)
+	defer releaseVr()
+	wopaque, releaseW := newOpaque(&WriterContext{w})
+	defer releaseW()
+
+	pool := acquireRemuxSlot()
+	defer releaseRemuxSlot(pool)
+
 	ret := C.remuxToTs(
-		unsafe.Pointer(arctx), (C.callback_fcn)(unsafe.Pointer(C.readFunction_cgo)),
-		unsafe.Pointer(vrctx), (C.callback_fcn)(unsafe.Pointer(C.readFunction_cgo)),
-		unsafe.Pointer(wctx), (C.callback_fcn)(unsafe.Pointer(C.writeFunction_cgo)))
+		aropaque, (C.callback_fcn)(unsafe.Pointer(C.readFunction_cgo)),
+		vropaque, (C.callback_fcn)(unsafe.Pointer(C.readFunction_cgo)),
+		wopaque, (C.callback_fcn)(unsafe.Pointer(C.writeFunction_cgo)))
 	if ret != 0 {
 		return fmt.Errorf("Error muxing.")
 	}
 	return nil
 }
+
+// TsOptions configures Mp4ToTsWithOptions.
+type TsOptions struct {
+	// MemoryLimit is a hard limit on the memory the remux session may hold,
+	// or 0 for none. Readers that implement io.Seeker let the session switch
+	// to seek-based reading of the lagging track when it nears the limit.
+	MemoryLimit int64
+	// AudioPesDuration packs consecutive AAC frames into one PES packet
+	// until it spans this duration. 0 leaves PES sizing to the muxer.
+	AudioPesDuration time.Duration
+	// Encryption encrypts the output as HLS segment Segment. Keys is called
+	// once per remux for the segment's key and IV.
+	Encryption Encryption
+	Segment    int64
+	Keys       func(segment int64) (key, iv [16]byte, err error)
+}
+
+// Encryption selects an HLS segment encryption method.
+type Encryption int
+
+const (
+	EncryptNone      Encryption = C.HLS_CRYPT_NONE
+	EncryptAES128    Encryption = C.HLS_CRYPT_AES_128
+	EncryptSampleAES Encryption = C.HLS_CRYPT_SAMPLE_AES
+)
+
+// TsStats reports on a finished remux session.
+type TsStats struct {
+	PeakMemory int64
+}
+
+// Mp4ToTsWithBudget is Mp4ToTs with a hard limit on the memory the remux
+// session may hold. Returns the peak memory used by the session.
+func Mp4ToTsWithBudget(ar io.Reader, vr io.Reader, w io.Writer, limit int64) (int64, error) {
+	stats, err := Mp4ToTsWithOptions(ar, vr, w, TsOptions{MemoryLimit: limit})
+	return stats.PeakMemory, err
+}
+
+// Mp4ToTsWithOptions is Mp4ToTs with options. If vr also carries the audio
+// track, ar may be nil.
+func Mp4ToTsWithOptions(ar io.Reader, vr io.Reader, w io.Writer, opts TsOptions) (TsStats, error) {
+	wopaque, releaseW := newOpaque(&WriterContext{w})
+	defer releaseW()
+	return mp4ToTs(ar, vr, wopaque, unsafe.Pointer(C.writeFunction_cgo), opts)
+}
+
+// mp4ToTs runs a remux writing through the C callback write, so output
+// sinks implemented in C are called without a round trip through Go.
+func mp4ToTs(ar io.Reader, vr io.Reader, wopaque unsafe.Pointer, write unsafe.Pointer, opts TsOptions) (TsStats, error) {
+	var (
+		arctx interface{}
+		vrctx interface{}
+		aseek C.seek_fcn
+		vseek C.seek_fcn
+	)
+	if ar != nil {
+		arctx = &ReaderContext{ar}
+		if _, ok := ar.(io.Seeker); ok {
+			aseek = (C.seek_fcn)(unsafe.Pointer(C.seekFunction_cgo))
+		}
+	}
+	if vr != nil {
+		vrctx = &ReaderContext{vr}
+		if _, ok := vr.(io.Seeker); ok {
+			vseek = (C.seek_fcn)(unsafe.Pointer(C.seekFunction_cgo))
+		}
+	}
+	aropaque, releaseAr := newOpaque(arctx)
+	defer releaseAr()
+	vropaque, releaseVr := newOpaque(vrctx)
+	defer releaseVr()
+
+	options := C.TsRemuxOptions{
+		memoryLimit:         C.int64_t(opts.MemoryLimit),
+		audioPesDurationMs:  C.int64_t(opts.AudioPesDuration / time.Millisecond),
+		audioFromVideoInput: 1,
+	}
+	if opts.Encryption != EncryptNone {
+		if opts.Keys == nil {
+			return TsStats{}, fmt.Errorf("Encryption needs a Keys function.")
+		}
+		kopaque, releaseK := newOpaque(&KeyContext{opts.Keys})
+		defer releaseK()
+		options.encryption = C.HlsCryptMethod(opts.Encryption)
+		options.segmentIndex = C.int64_t(opts.Segment)
+		options.kopaque = kopaque
+		options.keyFunction = (C.HlsKeyCallback)(unsafe.Pointer(C.keyFunction_cgo))
+	}
+
+	pool := acquireRemuxSlot()
+	defer releaseRemuxSlot(pool)
+
+	var cstats C.TsRemuxStats
+	ret := C.remuxToTsWithOptions(
+		aropaque, (C.callback_fcn)(unsafe.Pointer(C.readFunction_cgo)), aseek,
+		vropaque, (C.callback_fcn)(unsafe.Pointer(C.readFunction_cgo)), vseek,
+		wopaque, (C.callback_fcn)(write),
+		&options, &cstats)
+	stats := TsStats{PeakMemory: int64(cstats.peakMemory)}
+	if ret != 0 {
+		return stats, fmt.Errorf("Error muxing.")
+	}
+	return stats, nil
+}
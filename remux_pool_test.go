@@ -0,0 +1,79 @@
+package grune
+
+import (
+	"runtime"
+	"runtime/cgo"
+	"testing"
+	"time"
+)
+
+func TestRemuxConcurrencyLimit(t *testing.T) {
+	SetRemuxConcurrency(2)
+	defer SetRemuxConcurrency(runtime.GOMAXPROCS(0))
+
+	a := acquireRemuxSlot()
+	b := acquireRemuxSlot()
+	acquired := make(chan chan struct{})
+	go func() {
+		acquired <- acquireRemuxSlot()
+	}()
+
+	select {
+	case <-acquired:
+		t.Fatal("Third remux started with a limit of 2.")
+	case <-time.After(50 * time.Millisecond):
+	}
+
+	releaseRemuxSlot(a)
+	select {
+	case c := <-acquired:
+		releaseRemuxSlot(c)
+	case <-time.After(time.Second):
+		t.Fatal("Waiting remux did not start after a release.")
+	}
+	releaseRemuxSlot(b)
+}
+
+func TestRemuxConcurrencyResize(t *testing.T) {
+	SetRemuxConcurrency(1)
+	defer SetRemuxConcurrency(runtime.GOMAXPROCS(0))
+
+	// A remux running against the old pool does not hold up the new one,
+	// and releases into the pool it came from.
+	old := acquireRemuxSlot()
+	SetRemuxConcurrency(1)
+	done := make(chan struct{})
+	go func() {
+		releaseRemuxSlot(acquireRemuxSlot())
+		close(done)
+	}()
+	select {
+	case <-done:
+	case <-time.After(time.Second):
+		t.Fatal("Remux waited on a slot of the previous pool.")
+	}
+	releaseRemuxSlot(old)
+
+	SetRemuxConcurrency(0)
+	if n := cap(remuxPool); n != 1 {
+		t.Fatalf("Concurrency 0 gave a pool of %d, want 1.", n)
+	}
+}
+
+func TestNewOpaque(t *testing.T) {
+	ctx := &WriterContext{}
+	p, release := newOpaque(ctx)
+	if p == nil {
+		t.Fatal("No handle for a context.")
+	}
+	if v := cgo.Handle(uintptr(p)).Value(); v != ctx {
+		t.Fatalf("Handle resolves to %v, want %v.", v, ctx)
+	}
+	release()
+
+	p, release = newOpaque(nil)
+	if p != nil {
+		t.Fatal("A nil context must stay nil in C.")
+	}
+	release()
+}
@@ -0,0 +1,104 @@
+package grune
+
+// #include <stdlib.h>
+// #include "mp4_scanner.h"
+import "C"
+import (
+	"fmt"
+	"syscall"
+	"time"
+	"unsafe"
+)
+
+type ScanTrack struct {
+	ID           int
+	Handler      string
+	Codec        string
+	Timescale    uint32
+	Duration     time.Duration
+	NumSamples   int
+	NumKeyFrames int
+	TotalBytes   int64
+	Bitrate      int64
+	Width        int
+	Height       int
+	SampleRate   int
+	Channels     int
+	CodecConfig  []byte
+}
+
+type ScanResult struct {
+	Path     string
+	Err      error
+	FileSize int64
+	Duration time.Duration
+	Bitrate  int64
+	Tracks   []ScanTrack
+}
+
+// ScanMp4Files reads the metadata of each file from its moov box only, on
+// the given number of native threads.
+func ScanMp4Files(paths []string, threads int) []ScanResult {
+	n := len(paths)
+	if n == 0 {
+		return nil
+	}
+
+	cpaths := (*[1 << 28]*C.char)(C.calloc(C.size_t(n), C.size_t(unsafe.Sizeof((*C.char)(nil)))))[:n:n]
+	for i, p := range paths {
+		cpaths[i] = C.CString(p)
+	}
+	cresults := (*[1 << 28]C.ScanResult)(C.calloc(C.size_t(n), C.size_t(unsafe.Sizeof(C.ScanResult{}))))[:n:n]
+	defer func() {
+		for i := range cpaths {
+			C.free(unsafe.Pointer(cpaths[i]))
+			C.FreeScanResult(&cresults[i])
+		}
+		C.free(unsafe.Pointer(&cpaths[0]))
+		C.free(unsafe.Pointer(&cresults[0]))
+	}()
+
+	C.Mp4ScanFiles(&cpaths[0], C.int(n), &cresults[0], C.int(threads))
+
+	results := make([]ScanResult, n)
+	for i := range results {
+		results[i] = convertScanResult(paths[i], &cresults[i])
+	}
+	return results
+}
+
+func convertScanResult(path string, r *C.ScanResult) ScanResult {
+	res := ScanResult{Path: path}
+	switch {
+	case r.error > 0:
+		res.Err = syscall.Errno(r.error)
+		return res
+	case r.error < 0:
+		res.Err = fmt.Errorf("%s: no valid moov box", path)
+		return res
+	}
+
+	res.FileSize = int64(r.fileSize)
+	res.Duration = time.Duration(r.durationMs) * time.Millisecond
+	res.Bitrate = int64(r.bitrate)
+	for i := 0; i < int(r.numTracks); i++ {
+		t := &r.tracks[i]
+		res.Tracks = append(res.Tracks, ScanTrack{
+			ID:           int(t.trackId),
+			Handler:      C.GoString(&t.handler[0]),
+			Codec:        C.GoString(&t.codec[0]),
+			Timescale:    uint32(t.timescale),
+			Duration:     time.Duration(t.durationMs) * time.Millisecond,
+			NumSamples:   int(t.numSamples),
+			NumKeyFrames: int(t.numKeyFrames),
+			TotalBytes:   int64(t.totalBytes),
+			Bitrate:      int64(t.bitrate),
+			Width:        int(t.width),
+			Height:       int(t.height),
+			SampleRate:   int(t.sampleRate),
+			Channels:     int(t.channels),
+			CodecConfig:  C.GoBytes(unsafe.Pointer(t.codecConfig), t.codecConfigSize),
+		})
+	}
+	return res
+}
@@ -0,0 +1,131 @@
+/*
+ * Copyright (c) 2014 veecr.
+ */
+
+#include "tail_input.h"
+#include <libavutil/error.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#define TAIL_DEFAULT_POLL_MS 250
+
+struct _TailInput {
+    int fd;
+    int notifyFd;
+    int64_t pos;
+    int64_t idleTimeoutMs;
+    int64_t pollIntervalMs;
+};
+
+static int64_t now_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Blocks until the file may have grown or timeoutMs passes.
+static void wait_for_growth(TailInput* in, int64_t timeoutMs) {
+    if (timeoutMs > in->pollIntervalMs) {
+        timeoutMs = in->pollIntervalMs;
+    }
+
+#ifdef __linux__
+    if (in->notifyFd >= 0) {
+        struct pollfd pfd = { in->notifyFd, POLLIN, 0 };
+        char events[4096];
+
+        if (poll(&pfd, 1, (int)timeoutMs) > 0) {
+            // Only the wakeup matters; the file size is checked again.
+            while (read(in->notifyFd, events, sizeof(events)) > 0) {
+            }
+        }
+        return;
+    }
+#endif
+
+    usleep(timeoutMs * 1000);
+}
+
+TailInput* NewTailInput(const char* path, int64_t idleTimeoutMs, int64_t pollIntervalMs) {
+    TailInput* in = calloc(1, sizeof(TailInput));
+
+    if (!in) {
+        return 0;
+    }
+
+    in->notifyFd = -1;
+    in->idleTimeoutMs = idleTimeoutMs;
+    in->pollIntervalMs = pollIntervalMs > 0 ? pollIntervalMs : TAIL_DEFAULT_POLL_MS;
+
+    in->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (in->fd < 0) {
+        fprintf(stderr, "Could not open %s for tailing.\n", path);
+        free(in);
+        return 0;
+    }
+
+#ifdef __linux__
+    in->notifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (in->notifyFd >= 0 && inotify_add_watch(in->notifyFd, path, IN_MODIFY | IN_CLOSE_WRITE) < 0) {
+        close(in->notifyFd);
+        in->notifyFd = -1;
+    }
+#endif
+
+    return in;
+}
+
+int TailInputRead(void* opaque, uint8_t* buf, int size) {
+    TailInput* in = opaque;
+    int64_t idleSince = -1;
+
+    while (1) {
+        ssize_t n = pread(in->fd, buf, size, in->pos);
+        int64_t now;
+
+        if (n > 0) {
+            in->pos += n;
+            return (int)n;
+        }
+        if (n < 0 && errno != EINTR) {
+            return AVERROR(errno);
+        }
+
+        now = now_ms();
+        if (idleSince < 0) {
+            idleSince = now;
+        } else if (now - idleSince >= in->idleTimeoutMs) {
+            return AVERROR_EOF;
+        }
+
+        wait_for_growth(in, in->idleTimeoutMs - (now - idleSince));
+    }
+}
+
+int64_t TailInputPosition(const TailInput* in) {
+    return in->pos;
+}
+
+void FreeTailInput(TailInput* in) {
+    if (!in) {
+        return;
+    }
+
+    if (in->notifyFd >= 0) {
+        close(in->notifyFd);
+    }
+    close(in->fd);
+    free(in);
+}
@@ -0,0 +1,23 @@
+#ifndef TAIL_INPUT_H
+#define TAIL_INPUT_H
+
+#include "muxer.h"
+
+typedef struct _TailInput TailInput;
+
+// A file input that follows a file while it is being written. At the end of
+// the file, reads wait for it to grow, woken by inotify where available and
+// by polling every pollIntervalMs otherwise. Once the file has not grown
+// for idleTimeoutMs, reads return end of file.
+TailInput* NewTailInput(const char* path, int64_t idleTimeoutMs, int64_t pollIntervalMs);
+
+// BufferCallback reading sequentially from the file.
+int TailInputRead(void* opaque, uint8_t* buf, int size);
+
+// Bytes consumed so far; everything before this has been handed to the
+// demuxer.
+int64_t TailInputPosition(const TailInput* in);
+
+void FreeTailInput(TailInput* in);
+
+#endif
@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2014 veecr.
+ */
+
+#include "../adts.h"
+#include "check.h"
+#include <string.h>
+
+static void check_header(const uint8_t* asc, int payloadSize, const uint8_t* expected) {
+    uint8_t hdr[ADTS_HEADER_SIZE];
+    AdtsConfig c;
+
+    CHECK_EQ(AdtsConfigFromAsc(&c, asc, 2), 0);
+    AdtsWriteHeader(&c, hdr, payloadSize);
+    if (memcmp(hdr, expected, ADTS_HEADER_SIZE)) {
+        fprintf(stderr, "header for %02x %02x, %d bytes: %02x %02x %02x %02x %02x %02x %02x\n",
+                asc[0], asc[1], payloadSize, hdr[0], hdr[1], hdr[2], hdr[3], hdr[4], hdr[5], hdr[6]);
+        failures++;
+    }
+}
+
+static void test_headers(void) {
+    // AAC-LC, 44.1 kHz, stereo.
+    static const uint8_t lc[] = { 0x12, 0x10 };
+    static const uint8_t lcHeader[] = { 0xff, 0xf1, 0x50, 0x80, 0x2f, 0x5f, 0xfc };
+    // AAC Main, 48 kHz, mono, at the largest frame length.
+    static const uint8_t aacMain[] = { 0x09, 0x88 };
+    static const uint8_t mainHeader[] = { 0xff, 0xf1, 0x0c, 0x43, 0xff, 0xff, 0xfc };
+    // AAC-LC, 96 kHz, 7.1: the channel configuration straddles two bytes.
+    static const uint8_t surround[] = { 0x10, 0x38 };
+    static const uint8_t surroundHeader[] = { 0xff, 0xf1, 0x41, 0xc0, 0x00, 0xff, 0xfc };
+
+    check_header(lc, 371, lcHeader);
+    check_header(aacMain, 8191 - ADTS_HEADER_SIZE, mainHeader);
+    check_header(surround, 0, surroundHeader);
+}
+
+static void test_config(void) {
+    // AAC-LC, 22.05 kHz, mono, with trailing GASpecificConfig bits.
+    static const uint8_t asc[] = { 0x13, 0x88, 0x56, 0xe5 };
+    AdtsConfig c;
+
+    CHECK_EQ(AdtsConfigFromAsc(&c, asc, sizeof(asc)), 0);
+    CHECK_EQ(c.objectType, 2);
+    CHECK_EQ(c.sampleRateIndex, 7);
+    CHECK_EQ(c.channelConfig, 1);
+    CHECK_EQ(AdtsSampleRate(&c), 22050);
+
+    c.sampleRateIndex = 3;
+    CHECK_EQ(AdtsSampleRate(&c), 48000);
+    c.sampleRateIndex = 12;
+    CHECK_EQ(AdtsSampleRate(&c), 7350);
+}
+
+static void test_rejected(void) {
+    // SBR (object type 5), PCE channel layout, explicit sample rate.
+    static const uint8_t sbr[] = { 0x2b, 0x92 };
+    static const uint8_t pce[] = { 0x12, 0x00 };
+    static const uint8_t explicitRate[] = { 0x17, 0x80, 0x56, 0x22, 0x10 };
+    static const uint8_t objectTypeZero[] = { 0x02, 0x10 };
+    AdtsConfig c;
+
+    CHECK(AdtsConfigFromAsc(&c, sbr, sizeof(sbr)) < 0);
+    CHECK(AdtsConfigFromAsc(&c, pce, sizeof(pce)) < 0);
+    CHECK(AdtsConfigFromAsc(&c, explicitRate, sizeof(explicitRate)) < 0);
+    CHECK(AdtsConfigFromAsc(&c, objectTypeZero, sizeof(objectTypeZero)) < 0);
+    CHECK(AdtsConfigFromAsc(&c, sbr, 1) < 0);
+    CHECK(AdtsConfigFromAsc(&c, 0, 0) < 0);
+}
+
+int main(void) {
+    test_headers();
+    test_config();
+    test_rejected();
+
+    if (failures) {
+        fprintf(stderr, "adts_test: %d failures\n", failures);
+    }
+
+    return failures != 0;
+}
@@ -0,0 +1,129 @@
+/*
+ * Copyright (c) 2014 veecr.
+ */
+
+#include "../annexb.h"
+#include "check.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Built once as is and once with -U__SSE2__, so both scanners are checked
+// against the same byte-at-a-time reference.
+
+static const uint8_t* reference_find(const uint8_t* p, const uint8_t* end) {
+    for (; end - p >= 3; p++) {
+        if (p[0] == 0 && p[1] == 0 && p[2] == 1) {
+            return p;
+        }
+    }
+
+    return end;
+}
+
+// Scans every suffix of src[0, size) from an exactly sized copy, so a
+// read past the end shows up under valgrind or ASan.
+static void check_buffer(const uint8_t* src, int size) {
+    uint8_t* buf = malloc(size ? size : 1);
+    int i;
+
+    memcpy(buf, src, size);
+    for (i = 0; i <= size; i++) {
+        const uint8_t* got = AnnexBFindStartCode(buf + i, buf + size);
+        const uint8_t* expected = reference_find(buf + i, buf + size);
+
+        if (got != expected) {
+            fprintf(stderr, "size %d from %d: found %d, expected %d\n",
+                    size, i, (int)(got - buf), (int)(expected - buf));
+            failures++;
+            break;
+        }
+    }
+    free(buf);
+}
+
+// Start codes at every position around the 16-byte blocks and at the end.
+static void test_positions(void) {
+    uint8_t buf[64];
+    int size, pos;
+
+    for (size = 0; size <= sizeof(buf); size++) {
+        memset(buf, 0xff, sizeof(buf));
+        check_buffer(buf, size);
+        for (pos = 0; pos + 3 <= size; pos++) {
+            memset(buf, 0xff, sizeof(buf));
+            buf[pos] = 0;
+            buf[pos + 1] = 0;
+            buf[pos + 2] = 1;
+            check_buffer(buf, size);
+        }
+    }
+
+    // Zero pairs that are not start codes, e.g. 00 00 00 and 00 00 02.
+    memset(buf, 0, sizeof(buf));
+    check_buffer(buf, sizeof(buf));
+    buf[17] = 2;
+    buf[33] = 3;
+    buf[63] = 1;
+    check_buffer(buf, sizeof(buf));
+}
+
+static void test_random(void) {
+    uint8_t buf[300];
+    int round, i;
+
+    srand(1);
+    for (round = 0; round < 2000; round++) {
+        int size = rand() % sizeof(buf);
+
+        // Mostly zeros and ones, so candidates and start codes are dense.
+        for (i = 0; i < size; i++) {
+            int r = rand() % 8;
+            buf[i] = r < 5 ? 0 : r < 7 ? 1 : rand();
+        }
+        check_buffer(buf, size);
+    }
+}
+
+static void test_next_nal(void) {
+    static const uint8_t stream[] = {
+        0, 0, 0, 1, 0x09, 0xf0,             // AUD after a 4-byte start code
+        0, 0, 1, 0x67, 0x64, 0x00, 0x00,    // SPS ending in zero bytes
+        0, 0, 0, 1,
+        0, 0, 1, 0x68, 0xee,                // empty NAL unit, then PPS
+        0, 0, 1, 0x65, 0x88, 0x00, 0x00, 0x03, 0x01, 0x00,
+    };
+    static const struct { int offset, size, type; } expected[] = {
+        { 4, 2, 9 }, { 9, 2, 7 }, { 17, 0, 0 }, { 20, 2, 8 }, { 25, 7, 5 },
+    };
+    const uint8_t* pos = stream;
+    const uint8_t* end = stream + sizeof(stream);
+    AnnexBNal nal;
+    int n = 0;
+
+    while (AnnexBNextNal(&pos, end, &nal)) {
+        if (n < 5) {
+            CHECK_EQ(nal.data - stream, expected[n].offset);
+            CHECK_EQ(nal.size, expected[n].size);
+            CHECK_EQ(nal.type, expected[n].type);
+        }
+        n++;
+    }
+    CHECK_EQ(n, 5);
+    CHECK(pos == end);
+
+    pos = stream;
+    CHECK_EQ(AnnexBNextNal(&pos, stream + 3, &nal), 0);
+    CHECK(pos == stream + 3);
+}
+
+int main(void) {
+    test_positions();
+    test_random();
+    test_next_nal();
+
+    if (failures) {
+        fprintf(stderr, "annexb_test: %d failures\n", failures);
+    }
+
+    return failures != 0;
+}
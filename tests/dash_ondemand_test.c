@@ -0,0 +1,124 @@
+/*
+ * Copyright (c) 2014 veecr.
+ */
+
+// plan_fragments and sample_duration are private to the remuxer.
+#include "../dash_ondemand.c"
+#include "check.h"
+
+#define MAX_SAMPLES 300
+
+static AVIndexEntry entries[MAX_SAMPLES];
+static DashFragment frags[MAX_SAMPLES];
+
+// count samples of sampleTicks each, with sizes 100 + i and a key frame
+// every keyInterval samples from firstKey on.
+static void make_stream(AVStream* st, int count, int sampleTicks, int firstKey, int keyInterval) {
+    int i;
+
+    memset(st, 0, sizeof(AVStream));
+    memset(entries, 0, sizeof(entries));
+    for (i = 0; i < count; i++) {
+        entries[i].timestamp = 1000 + (int64_t)i * sampleTicks;
+        entries[i].size = 100 + i;
+        entries[i].flags = i >= firstKey && (i - firstKey) % keyInterval == 0 ? AVINDEX_KEYFRAME : 0;
+    }
+    st->index_entries = entries;
+    st->nb_index_entries = count;
+    st->duration = (int64_t)count * sampleTicks;
+}
+
+static void check_fragment(int i, int first, int count, int64_t duration) {
+    int64_t bytes = 0;
+    int j;
+
+    for (j = first; j < first + count; j++) {
+        bytes += 100 + j;
+    }
+    CHECK_EQ(frags[i].first, first);
+    CHECK_EQ(frags[i].count, count);
+    CHECK_EQ(frags[i].bytes, bytes);
+    CHECK_EQ(frags[i].duration, duration);
+}
+
+// Fragments are cut at the first key frame at least fragmentTicks after
+// the start of the current one.
+static void test_key_frame_cuts(void) {
+    AVStream st;
+    int maxSamples, n;
+
+    // 10 s at 12800 Hz, 25 fps, a key frame every 48 samples, 2 s fragments.
+    make_stream(&st, 250, 512, 0, 48);
+    n = plan_fragments(&st, 25600, frags, &maxSamples);
+    CHECK_EQ(n, 3);
+    check_fragment(0, 0, 96, 96 * 512);
+    check_fragment(1, 96, 96, 96 * 512);
+    check_fragment(2, 192, 58, 58 * 512);
+    CHECK_EQ(maxSamples, 96);
+
+    // A key frame exactly fragmentTicks in starts the next fragment.
+    make_stream(&st, 100, 512, 0, 25);
+    n = plan_fragments(&st, 25 * 512, frags, &maxSamples);
+    CHECK_EQ(n, 4);
+    check_fragment(3, 75, 25, 25 * 512);
+    CHECK_EQ(maxSamples, 25);
+
+    // With fragmentTicks 0 every key frame starts a fragment. The first
+    // fragment starts at sample 0 even though it is not a key frame.
+    make_stream(&st, 100, 512, 10, 30);
+    n = plan_fragments(&st, 0, frags, &maxSamples);
+    CHECK_EQ(n, 4);
+    check_fragment(0, 0, 10, 10 * 512);
+    check_fragment(1, 10, 30, 30 * 512);
+    check_fragment(3, 70, 30, 30 * 512);
+    CHECK_EQ(maxSamples, 30);
+
+    // No key frame after the first sample: a single fragment.
+    make_stream(&st, 50, 512, 0, 1000);
+    n = plan_fragments(&st, 512, frags, &maxSamples);
+    CHECK_EQ(n, 1);
+    check_fragment(0, 0, 50, 50 * 512);
+    CHECK_EQ(maxSamples, 50);
+}
+
+static void test_last_sample_duration(void) {
+    AVStream st;
+    int maxSamples, n;
+
+    // The track duration gives the last sample a longer duration.
+    make_stream(&st, 10, 1000, 0, 5);
+    st.duration = 9000 + 1500;
+    n = plan_fragments(&st, 5000, frags, &maxSamples);
+    CHECK_EQ(n, 2);
+    check_fragment(1, 5, 5, 4000 + 1500);
+    CHECK_EQ(sample_duration(&st, 9), 1500);
+
+    // Without a usable track duration it repeats the previous delta.
+    st.duration = 0;
+    CHECK_EQ(sample_duration(&st, 9), 1000);
+    st.duration = 5000;
+    CHECK_EQ(sample_duration(&st, 9), 1000);
+
+    // A single sample without a duration has none.
+    make_stream(&st, 1, 1000, 0, 1);
+    st.duration = 0;
+    n = plan_fragments(&st, 5000, frags, &maxSamples);
+    CHECK_EQ(n, 1);
+    check_fragment(0, 0, 1, 0);
+
+    make_stream(&st, 0, 1000, 0, 1);
+    n = plan_fragments(&st, 5000, frags, &maxSamples);
+    CHECK_EQ(n, 0);
+    CHECK_EQ(maxSamples, 0);
+}
+
+int main(void) {
+    test_key_frame_cuts();
+    test_last_sample_duration();
+
+    if (failures) {
+        fprintf(stderr, "dash_ondemand_test: %d failures\n", failures);
+    }
+
+    return failures != 0;
+}
@@ -0,0 +1,165 @@
+/*
+ * Copyright (c) 2014 veecr.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "../fd_sink.h"
+#include "check.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifndef F_GET_SEALS
+#define F_GET_SEALS 1034
+#endif
+
+static uint8_t pattern[20000];
+
+static void write_chunks(FdSink* s, int size, int chunk) {
+    int done = 0;
+
+    while (done < size) {
+        int n = size - done < chunk ? size - done : chunk;
+        CHECK_EQ(FdSinkWrite(s, pattern + done, n), n);
+        done += n;
+    }
+}
+
+static void check_segment(int fd, int64_t length, int64_t expected) {
+    uint8_t* buf = malloc(expected + 1);
+    struct stat st;
+
+    CHECK(fd >= 0);
+    CHECK_EQ(length, expected);
+    CHECK(fstat(fd, &st) == 0 && st.st_size == expected);
+    CHECK_EQ(pread(fd, buf, expected + 1, 0), expected);
+    CHECK(!memcmp(buf, pattern, expected));
+    free(buf);
+}
+
+// Segments grow past the size hint, come back sized to their length, and
+// are sealed where the kernel supports it.
+static void test_memfd_segments(void) {
+    FdSink* s = NewFdSink("fd_sink_test", 4096);
+    int64_t length;
+    int fd, fd2;
+
+    CHECK(s != 0);
+
+    write_chunks(s, 10000, 333);
+    CHECK_EQ(FdSinkFinishSegment(s, &fd, &length), 0);
+    check_segment(fd, length, 10000);
+    if (fcntl(fd, F_GET_SEALS) > 0) {
+        CHECK(write(fd, "x", 1) < 0);
+        CHECK(ftruncate(fd, 0) < 0);
+    }
+
+    // The next write starts a new segment.
+    write_chunks(s, 5, 5);
+    CHECK_EQ(FdSinkFinishSegment(s, &fd2, &length), 0);
+    CHECK(fd2 != fd);
+    check_segment(fd2, length, 5);
+    close(fd2);
+
+    // An empty segment still gets a descriptor.
+    CHECK_EQ(FdSinkFinishSegment(s, &fd2, &length), 0);
+    check_segment(fd2, length, 0);
+    close(fd2);
+
+    check_segment(fd, 10000, 10000);
+    close(fd);
+
+    // A segment left unfinished is freed with the sink.
+    write_chunks(s, 100, 100);
+    FreeFdSink(s);
+}
+
+// A caller's file is written from offset 0 and truncated to the segment.
+static void test_caller_fd(void) {
+    char path[] = "/tmp/fd_sink_testXXXXXX";
+    int fd = mkstemp(path);
+    FdSink* s = NewFdSink("fd_sink_test", 0);
+    int64_t length;
+    int out;
+
+    CHECK(fd >= 0 && s != 0);
+    CHECK_EQ(write(fd, pattern, sizeof(pattern)), sizeof(pattern));
+
+    CHECK_EQ(FdSinkUseFd(s, fd), 0);
+    write_chunks(s, 3000, 1000);
+    CHECK(FdSinkUseFd(s, fd) < 0);
+    CHECK_EQ(FdSinkFinishSegment(s, &out, &length), 0);
+    CHECK_EQ(out, fd);
+    check_segment(fd, length, 3000);
+
+    // Still open and writable: the caller owns it.
+    CHECK_EQ(pwrite(fd, "x", 1, 0), 1);
+
+    FreeFdSink(s);
+    close(fd);
+    unlink(path);
+}
+
+// A discarded segment is dropped and the next write starts over. A
+// caller's file is truncated and left open.
+static void test_discard(void) {
+    char path[] = "/tmp/fd_sink_testXXXXXX";
+    int fd = mkstemp(path);
+    FdSink* s = NewFdSink("fd_sink_test", 4096);
+    struct stat st;
+    int64_t length;
+    int out;
+
+    CHECK(fd >= 0 && s != 0);
+
+    write_chunks(s, 9000, 1000);
+    FdSinkDiscardSegment(s);
+    write_chunks(s, 7, 7);
+    CHECK_EQ(FdSinkFinishSegment(s, &out, &length), 0);
+    check_segment(out, length, 7);
+    close(out);
+
+    // Discarding before the first write is harmless.
+    FdSinkDiscardSegment(s);
+
+    CHECK_EQ(FdSinkUseFd(s, fd), 0);
+    write_chunks(s, 5000, 1000);
+    FdSinkDiscardSegment(s);
+    CHECK(fstat(fd, &st) == 0 && st.st_size == 0);
+    CHECK(fcntl(fd, F_GETFD) >= 0);
+
+    // The discarded fd is no longer used.
+    write_chunks(s, 10, 10);
+    CHECK_EQ(FdSinkFinishSegment(s, &out, &length), 0);
+    CHECK(out != fd);
+    check_segment(out, length, 10);
+    close(out);
+    CHECK(fstat(fd, &st) == 0 && st.st_size == 0);
+
+    FreeFdSink(s);
+    close(fd);
+    unlink(path);
+}
+
+int main(void) {
+    int i;
+
+    for (i = 0; i < sizeof(pattern); i++) {
+        pattern[i] = i * 7 + (i >> 8);
+    }
+
+    test_memfd_segments();
+    test_caller_fd();
+    test_discard();
+
+    if (failures) {
+        fprintf(stderr, "fd_sink_test: %d failures\n", failures);
+    }
+
+    return failures != 0;
+}
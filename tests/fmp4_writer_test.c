@@ -0,0 +1,203 @@
+/*
+ * Copyright (c) 2014 veecr.
+ */
+
+#include "../fmp4_writer.h"
+#include "check.h"
+#include <string.h>
+
+#define TAG(a, b, c, d) a, b, c, d
+#define U32(v) ((v) >> 24) & 0xff, ((v) >> 16) & 0xff, ((v) >> 8) & 0xff, (v) & 0xff
+
+static const uint8_t avcc[] = { 0x01, 0x64, 0x00, 0x1f, 0xff, 0xe1, 0x00, 0x04, 0x67, 0x64, 0x00, 0x1f, 0x01, 0x00, 0x02, 0x68, 0xee };
+static const uint8_t asc[] = { 0x11, 0x90 };
+
+// Video at 90 kHz: a key frame and two others from 1 s, the last with a
+// negative composition offset. Audio at 48 kHz: two frames from 2 s.
+static const uint8_t first_moof[] = {
+    U32(216), TAG('m', 'o', 'o', 'f'),
+    U32(16), TAG('m', 'f', 'h', 'd'), U32(0), U32(1),
+
+    // The 64 byte template: traf, tfhd, tfdt, trun header.
+    U32(112), TAG('t', 'r', 'a', 'f'),
+    U32(16), TAG('t', 'f', 'h', 'd'), U32(0x020000), U32(1),
+    U32(20), TAG('t', 'f', 'd', 't'), U32(0x01000000), U32(0), U32(90000),
+    U32(68), TAG('t', 'r', 'u', 'n'), U32(0x01000f01), U32(3), U32(224),
+    // duration, size, flags, composition offset
+    U32(3000), U32(100), U32(0x02000000), U32(6000),
+    U32(3000), U32(50), U32(0x01010000), U32(0),
+    U32(3000), U32(150), U32(0x01010000), U32(0xfffffa24),
+
+    U32(80), TAG('t', 'r', 'a', 'f'),
+    U32(16), TAG('t', 'f', 'h', 'd'), U32(0x020000), U32(2),
+    U32(20), TAG('t', 'f', 'd', 't'), U32(0x01000000), U32(0), U32(96000),
+    // Audio data follows the 300 bytes of video.
+    U32(36), TAG('t', 'r', 'u', 'n'), U32(0x01000301), U32(2), U32(524),
+    U32(1024), U32(20),
+    U32(1024), U32(30),
+
+    U32(358), TAG('m', 'd', 'a', 't'),
+};
+
+// A fragment of one audio frame: only the audio traf, with sequence 2.
+static const uint8_t second_moof[] = {
+    U32(96), TAG('m', 'o', 'o', 'f'),
+    U32(16), TAG('m', 'f', 'h', 'd'), U32(0), U32(2),
+    U32(72), TAG('t', 'r', 'a', 'f'),
+    U32(16), TAG('t', 'f', 'h', 'd'), U32(0x020000), U32(2),
+    U32(20), TAG('t', 'f', 'd', 't'), U32(0x01000000), U32(0), U32(98048),
+    U32(28), TAG('t', 'r', 'u', 'n'), U32(0x01000301), U32(1), U32(104),
+    U32(1024), U32(20),
+    U32(28), TAG('m', 'd', 'a', 't'),
+};
+
+typedef struct {
+    uint8_t data[4096];
+    int size;
+    int writes;
+} Output;
+
+static int collect(void* opaque, uint8_t* buf, int size) {
+    Output* o = opaque;
+
+    if (o->size + size > (int)sizeof(o->data)) {
+        return -1;
+    }
+    memcpy(o->data + o->size, buf, size);
+    o->size += size;
+    o->writes++;
+
+    return size;
+}
+
+static int add_tracks(Fmp4Writer* w) {
+    Fmp4TrackConfig video = { 0 }, audio = { 0 };
+
+    video.type = FMP4_TRACK_VIDEO;
+    video.width = 1280;
+    video.height = 720;
+    video.avcc = avcc;
+    video.avccSize = sizeof(avcc);
+    audio.type = FMP4_TRACK_AUDIO;
+    audio.sampleRate = 48000;
+    audio.channels = 2;
+    audio.asc = asc;
+    audio.ascSize = sizeof(asc);
+
+    if (Fmp4WriterAddTrack(w, &video) != 0 || Fmp4WriterAddTrack(w, &audio) != 1) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static uint32_t rb32(const uint8_t* p) {
+    return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static void test_init(void) {
+    Output o = { { 0 } };
+    Fmp4Writer* w = NewFmp4Writer(&o, collect, 8);
+    int ftyp;
+
+    CHECK_EQ(add_tracks(w), 0);
+    CHECK_EQ(Fmp4WriterWriteInit(w), 0);
+    CHECK_EQ(o.writes, 1);
+
+    ftyp = rb32(o.data);
+    CHECK(memcmp(o.data + 4, "ftyp", 4) == 0);
+    CHECK(memcmp(o.data + ftyp + 4, "moov", 4) == 0);
+    CHECK_EQ(ftyp + (int)rb32(o.data + ftyp), o.size);
+
+    // Tracks cannot be added once the init segment is out.
+    CHECK_EQ(add_tracks(w), -1);
+
+    FreeFmp4Writer(w);
+}
+
+static void test_fragments(void) {
+    Output o = { { 0 } };
+    Fmp4Writer* w = NewFmp4Writer(&o, collect, 8);
+    uint8_t video[300], audio[64];
+    int counts[FMP4_MAX_TRACKS] = { 3, 2 };
+    int i, start;
+
+    for (i = 0; i < 300; i++) {
+        video[i] = i;
+    }
+    for (i = 0; i < 64; i++) {
+        audio[i] = 0x80 + i;
+    }
+
+    CHECK_EQ(Fmp4WriterFlushFragment(w), -1);
+    CHECK_EQ(add_tracks(w), 0);
+    CHECK_EQ(Fmp4WriterWriteInit(w), 0);
+    start = o.size;
+    o.writes = 0;
+
+    // Interleaved, with the video samples adjacent in memory and the audio
+    // samples not.
+    CHECK_EQ(Fmp4WriterAddSample(w, 0, video, 100, 90000, 3000, 6000, 1), 0);
+    CHECK_EQ(Fmp4WriterAddSample(w, 1, audio, 20, 96000, 1024, 0, 1), 0);
+    CHECK_EQ(Fmp4WriterAddSample(w, 0, video + 100, 50, 93000, 3000, 0, 0), 0);
+    CHECK_EQ(Fmp4WriterAddSample(w, 1, audio + 32, 30, 97024, 1024, 0, 1), 0);
+    CHECK_EQ(Fmp4WriterAddSample(w, 0, video + 150, 150, 96000, 3000, -1500, 0), 0);
+    CHECK_EQ(Fmp4WriterPendingSamples(w), 5);
+    CHECK_EQ(Fmp4WriterMoofSize(w, counts), 216);
+
+    CHECK_EQ(Fmp4WriterFlushFragment(w), 0);
+    CHECK_EQ(Fmp4WriterPendingSamples(w), 0);
+    CHECK_EQ(o.size - start, (int)sizeof(first_moof) + 350);
+    CHECK(memcmp(o.data + start, first_moof, sizeof(first_moof)) == 0);
+    start += sizeof(first_moof);
+    CHECK(memcmp(o.data + start, video, 300) == 0);
+    CHECK(memcmp(o.data + start + 300, audio, 20) == 0);
+    CHECK(memcmp(o.data + start + 320, audio + 32, 30) == 0);
+    // moof, mdat header, one run of video, two audio buffers.
+    CHECK_EQ(o.writes, 5);
+
+    // Nothing pending writes nothing.
+    start = o.size;
+    CHECK_EQ(Fmp4WriterFlushFragment(w), 0);
+    CHECK_EQ(o.size, start);
+
+    CHECK_EQ(Fmp4WriterAddSample(w, 1, audio, 20, 98048, 1024, 0, 1), 0);
+    CHECK_EQ(Fmp4WriterFlushFragment(w), 0);
+    CHECK_EQ(o.size - start, (int)sizeof(second_moof) + 20);
+    CHECK(memcmp(o.data + start, second_moof, sizeof(second_moof)) == 0);
+
+    FreeFmp4Writer(w);
+}
+
+static void test_limits(void) {
+    Output o = { { 0 } };
+    Fmp4Writer* w = NewFmp4Writer(&o, collect, 2);
+    uint8_t data[4] = { 0 };
+
+    CHECK(NewFmp4Writer(&o, collect, 0) == 0);
+    CHECK_EQ(add_tracks(w), 0);
+    CHECK_EQ(Fmp4WriterWriteInit(w), 0);
+
+    CHECK_EQ(Fmp4WriterAddSample(w, 2, data, 4, 0, 1, 0, 1), -1);
+    CHECK_EQ(Fmp4WriterAddSample(w, 0, data, 4, 0, -1, 0, 1), -1);
+    CHECK_EQ(Fmp4WriterAddSample(w, 0, data, 4, 0, 1, 0, 1), 0);
+    CHECK_EQ(Fmp4WriterAddSample(w, 0, data, 4, 1, 1, 0, 0), 0);
+    // The fragment holds at most maxSamples.
+    CHECK_EQ(Fmp4WriterAddSample(w, 0, data, 4, 2, 1, 0, 0), -1);
+    CHECK_EQ(Fmp4WriterFlushFragment(w), 0);
+    CHECK_EQ(Fmp4WriterAddSample(w, 0, data, 4, 2, 1, 0, 0), 0);
+
+    FreeFmp4Writer(w);
+}
+
+int main(void) {
+    test_init();
+    test_fragments();
+    test_limits();
+
+    if (failures) {
+        fprintf(stderr, "fmp4_writer_test: %d failures\n", failures);
+    }
+
+    return failures != 0;
+}
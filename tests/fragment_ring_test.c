@@ -0,0 +1,259 @@
+/*
+ * Copyright (c) 2014 veecr.
+ */
+
+#include "../fragment_ring.h"
+#include "check.h"
+#include <libavutil/mem.h>
+#include <pthread.h>
+#include <string.h>
+
+// Fragment seq is size_of(seq) bytes of seq & 0xff, so any read can be
+// checked against the sequence number alone.
+static int size_of(int64_t seq) {
+    return 16 + (int)(seq % 64);
+}
+
+static int64_t append(FragmentRing* ring, int64_t seq, int64_t startMs, int64_t durationMs) {
+    int size = size_of(seq);
+    uint8_t* data = av_malloc(size);
+
+    memset(data, (int)(seq & 0xff), size);
+    return FragmentRingAppend(ring, data, size, startMs, durationMs);
+}
+
+// Expects fragments r->seq, r->seq + 1, ... A negative r->seq takes the
+// sequence from the first fragment, for reads that race with eviction.
+typedef struct {
+    int64_t seq;
+    int calls;
+    int bad;
+} Reader;
+
+static int check_fragment(void* opaque, uint8_t* buf, int size) {
+    Reader* r = opaque;
+    int i;
+
+    if (r->seq < 0) {
+        r->seq = buf[0];
+    }
+
+    if (size != size_of(r->seq)) {
+        r->bad++;
+    }
+    for (i = 0; i < size; i++) {
+        if (buf[i] != (r->seq & 0xff)) {
+            r->bad++;
+            break;
+        }
+    }
+    r->calls++;
+    r->seq++;
+
+    return size;
+}
+
+static void check_bounds(FragmentRing* ring, int64_t firstSeq, int64_t lastSeq, int64_t startMs, int64_t endMs) {
+    int64_t first, last, start, end;
+
+    FragmentRingGetBounds(ring, &first, &last, &start, &end);
+    CHECK_EQ(first, firstSeq);
+    CHECK_EQ(last, lastSeq);
+    CHECK_EQ(start, startMs);
+    CHECK_EQ(end, endMs);
+}
+
+static void test_count_eviction(void) {
+    FragmentRing* ring = NewFragmentRing(3, 0, 0);
+    Reader r = { 0 };
+    int64_t seq;
+
+    check_bounds(ring, -1, -1, 0, 0);
+    CHECK_EQ(FragmentRingFindByTime(ring, 0), -1);
+
+    for (seq = 0; seq < 5; seq++) {
+        CHECK_EQ(append(ring, seq, seq * 1000, 1000), seq);
+    }
+    check_bounds(ring, 2, 4, 2000, 5000);
+    CHECK_EQ(FragmentRingGetMemoryUsage(ring), size_of(2) + size_of(3) + size_of(4));
+
+    CHECK_EQ(FragmentRingGetFragment(ring, 1, &r, check_fragment), -1);
+    CHECK_EQ(FragmentRingGetFragment(ring, 5, &r, check_fragment), -1);
+    r.seq = 3;
+    CHECK_EQ(FragmentRingGetFragment(ring, 3, &r, check_fragment), size_of(3));
+    CHECK(r.calls == 1 && r.bad == 0);
+
+    FreeFragmentRing(ring);
+}
+
+static void test_budget_eviction(void) {
+    // Fragments 0..2 are 16, 17 and 18 bytes.
+    FragmentRing* ring = NewFragmentRing(10, 40, 0);
+    uint8_t* big = av_malloc(41);
+
+    CHECK_EQ(append(ring, 0, 0, 1000), 0);
+    CHECK_EQ(append(ring, 1, 1000, 1000), 1);
+    CHECK_EQ(FragmentRingGetMemoryUsage(ring), 33);
+    CHECK_EQ(append(ring, 2, 2000, 1000), 2);
+    check_bounds(ring, 1, 2, 1000, 3000);
+    CHECK_EQ(FragmentRingGetMemoryUsage(ring), 35);
+
+    // Larger than the whole budget: refused, and nothing is evicted.
+    CHECK_EQ(FragmentRingAppend(ring, big, 41, 3000, 1000), -1);
+    check_bounds(ring, 1, 2, 1000, 3000);
+
+    FreeFragmentRing(ring);
+}
+
+static void test_window_eviction(void) {
+    FragmentRing* ring = NewFragmentRing(10, 0, 1000);
+    int64_t seq;
+
+    for (seq = 0; seq < 3; seq++) {
+        append(ring, seq, seq * 400, 400);
+    }
+    check_bounds(ring, 0, 2, 0, 1200);
+
+    // Ending at 1600 the window starts at 600: fragment 0 goes, and
+    // fragment 1 stays as it covers 600.
+    append(ring, 3, 1200, 400);
+    check_bounds(ring, 1, 3, 400, 1600);
+
+    FreeFragmentRing(ring);
+}
+
+static void test_find_by_time(void) {
+    FragmentRing* ring = NewFragmentRing(4, 0, 0);
+    Reader r = { 0 };
+    int64_t seq;
+
+    // Eviction moves head, so the search runs over a wrapped ring.
+    for (seq = 0; seq < 7; seq++) {
+        append(ring, seq, seq * 400, 400);
+    }
+    check_bounds(ring, 3, 6, 1200, 2800);
+
+    CHECK_EQ(FragmentRingFindByTime(ring, 0), 3);
+    CHECK_EQ(FragmentRingFindByTime(ring, 1200), 3);
+    CHECK_EQ(FragmentRingFindByTime(ring, 1599), 3);
+    CHECK_EQ(FragmentRingFindByTime(ring, 1600), 4);
+    CHECK_EQ(FragmentRingFindByTime(ring, 2399), 5);
+    CHECK_EQ(FragmentRingFindByTime(ring, 2400), 6);
+    CHECK_EQ(FragmentRingFindByTime(ring, 100000), 6);
+
+    // From the fragment covering 1700 up to the one starting before 2400.
+    r.seq = 4;
+    CHECK_EQ(FragmentRingGetRange(ring, 1700, 2400, &r, check_fragment), 2);
+    CHECK(r.calls == 2 && r.bad == 0);
+
+    r.seq = 3;
+    r.calls = 0;
+    CHECK_EQ(FragmentRingGetRange(ring, 0, 100000, &r, check_fragment), 4);
+    CHECK(r.calls == 4 && r.bad == 0);
+
+    CHECK_EQ(FragmentRingGetRange(ring, 0, 1000, &r, check_fragment), 0);
+
+    FreeFragmentRing(ring);
+}
+
+#define NUM_APPENDS 20000
+#define NUM_READERS 4
+
+typedef struct {
+    FragmentRing* ring;
+    int done;
+    int reads;
+    int bad;
+} Shared;
+
+static void* append_thread(void* arg) {
+    Shared* sh = arg;
+    int64_t seq;
+
+    for (seq = 0; seq < NUM_APPENDS; seq++) {
+        append(sh->ring, seq, seq * 10, 10);
+    }
+    __atomic_store_n(&sh->done, 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+static void* read_thread(void* arg) {
+    Shared* sh = arg;
+    int reads = 0, bad = 0;
+
+    while (!__atomic_load_n(&sh->done, __ATOMIC_ACQUIRE)) {
+        int64_t first, last, start, end, seq;
+        Reader r = { 0 };
+
+        FragmentRingGetBounds(sh->ring, &first, &last, &start, &end);
+        if (first < 0) {
+            continue;
+        }
+        if (last - first >= 8 || end - start != (last - first + 1) * 10) {
+            bad++;
+        }
+
+        // The fragment may have been evicted since; if not, it is intact.
+        r.seq = first + (last - first) / 2;
+        if (FragmentRingGetFragment(sh->ring, r.seq, &r, check_fragment) >= 0) {
+            reads++;
+        }
+        bad += r.bad;
+
+        seq = FragmentRingFindByTime(sh->ring, start + 15);
+        if (seq >= 0 && seq < first) {
+            bad++;
+        }
+
+        r.seq = -1;
+        r.bad = 0;
+        FragmentRingGetRange(sh->ring, start, end, &r, check_fragment);
+        bad += r.bad;
+    }
+
+    __sync_fetch_and_add(&sh->reads, reads);
+    __sync_fetch_and_add(&sh->bad, bad);
+
+    return 0;
+}
+
+static void test_concurrent(void) {
+    Shared sh = { 0 };
+    pthread_t writer, readers[NUM_READERS];
+    int i;
+
+    sh.ring = NewFragmentRing(8, 0, 0);
+
+    for (i = 0; i < NUM_READERS; i++) {
+        pthread_create(&readers[i], 0, read_thread, &sh);
+    }
+    pthread_create(&writer, 0, append_thread, &sh);
+
+    pthread_join(writer, 0);
+    for (i = 0; i < NUM_READERS; i++) {
+        pthread_join(readers[i], 0);
+    }
+
+    CHECK_EQ(sh.bad, 0);
+    CHECK(sh.reads > 0);
+    check_bounds(sh.ring, NUM_APPENDS - 8, NUM_APPENDS - 1, (NUM_APPENDS - 8) * 10, NUM_APPENDS * 10);
+
+    FreeFragmentRing(sh.ring);
+}
+
+int main(void) {
+    CHECK(NewFragmentRing(0, 0, 0) == 0);
+
+    test_count_eviction();
+    test_budget_eviction();
+    test_window_eviction();
+    test_find_by_time();
+    test_concurrent();
+
+    if (failures) {
+        fprintf(stderr, "fragment_ring_test: %d failures\n", failures);
+    }
+
+    return failures != 0;
+}
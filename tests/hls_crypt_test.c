@@ -0,0 +1,254 @@
+/*
+ * Copyright (c) 2014 veecr.
+ */
+
+// The cipher path is private to hls_crypt.c.
+#include "../hls_crypt.c"
+#include "check.h"
+
+// Expected output computed with OpenSSL for key 00 01 .. 0f and IV f0 f1 .. ff.
+
+// 100 bytes of i * 7.
+static const uint8_t aes128_segment[112] = {
+    0xfd, 0x6d, 0x13, 0xf5, 0x6f, 0x1c, 0x8e, 0x51, 0x0c, 0x52, 0x68, 0xab,
+    0x3f, 0x04, 0x66, 0xd6, 0x6d, 0x7b, 0xa1, 0x79, 0x65, 0x14, 0x5d, 0xeb,
+    0xc2, 0x59, 0x66, 0xe8, 0xa9, 0x68, 0x70, 0xa2, 0xfa, 0xb4, 0x04, 0x50,
+    0x20, 0xf5, 0xd6, 0x08, 0x51, 0xf5, 0xa3, 0xf9, 0xa2, 0x2d, 0x3f, 0x91,
+    0xb1, 0xe9, 0x2f, 0x2e, 0x2b, 0xd2, 0x10, 0x87, 0x6d, 0x18, 0x54, 0x0f,
+    0xde, 0xc1, 0xb7, 0x14, 0xe4, 0x95, 0xac, 0xf4, 0x50, 0xba, 0xf5, 0x19,
+    0xa0, 0x69, 0xdc, 0x33, 0x3a, 0x86, 0x29, 0xf3, 0xef, 0xb5, 0x81, 0x48,
+    0x2b, 0x08, 0x14, 0xe1, 0xff, 0x3d, 0x2b, 0xff, 0x8d, 0x6e, 0x64, 0x0b,
+    0xd1, 0x97, 0xf9, 0x25, 0x1d, 0x36, 0x06, 0xf7, 0x70, 0x58, 0x55, 0xf7,
+    0xe4, 0x48, 0x1b, 0x0c,
+};
+
+// The first 32 of them: a whole block of padding.
+static const uint8_t aes128_aligned[48] = {
+    0xfd, 0x6d, 0x13, 0xf5, 0x6f, 0x1c, 0x8e, 0x51, 0x0c, 0x52, 0x68, 0xab,
+    0x3f, 0x04, 0x66, 0xd6, 0x6d, 0x7b, 0xa1, 0x79, 0x65, 0x14, 0x5d, 0xeb,
+    0xc2, 0x59, 0x66, 0xe8, 0xa9, 0x68, 0x70, 0xa2, 0x29, 0xe0, 0x5c, 0x0b,
+    0x04, 0x16, 0x70, 0x06, 0x0d, 0x6a, 0x6b, 0x59, 0x95, 0x5f, 0x20, 0x8b,
+};
+
+// An escaped IDR slice with emulation prevention bytes in its first encrypted
+// block and in a clear run.
+static const uint8_t idr_slice[214] = {
+    0x65, 0x2d, 0x3a, 0x47, 0x54, 0x61, 0x6e, 0x7b, 0x88, 0x95, 0xa2, 0xaf,
+    0xbc, 0xc9, 0xd6, 0xe3, 0x28, 0x35, 0x42, 0x4f, 0x5c, 0x69, 0x76, 0x83,
+    0x90, 0x9d, 0xaa, 0xb7, 0xc4, 0xd1, 0xde, 0x23, 0x30, 0x3d, 0x00, 0x00,
+    0x03, 0x01, 0x71, 0x7e, 0x8b, 0xf2, 0x1c, 0x00, 0xbf, 0xcc, 0xd9, 0xe6,
+    0x2b, 0x02, 0x45, 0x52, 0x5f, 0x6c, 0x79, 0x86, 0x93, 0xa0, 0xad, 0xba,
+    0xc7, 0xd4, 0xe1, 0x26, 0x33, 0x40, 0x4d, 0x5a, 0x67, 0x74, 0x81, 0x8e,
+    0x9b, 0xa8, 0xb5, 0xc2, 0xcf, 0xdc, 0x21, 0x2e, 0x3b, 0x48, 0x55, 0x62,
+    0x6f, 0x7c, 0x89, 0x96, 0xa3, 0xb0, 0xbd, 0xca, 0xd7, 0xe4, 0x29, 0x36,
+    0x43, 0x50, 0x5d, 0x6a, 0x77, 0x00, 0x00, 0x03, 0x02, 0xab, 0xb8, 0xc5,
+    0xd2, 0xdf, 0x24, 0x31, 0x3e, 0x4b, 0x58, 0x65, 0x72, 0x7f, 0x8c, 0x99,
+    0xa6, 0xb3, 0xc0, 0xcd, 0xda, 0xe7, 0x2c, 0x39, 0x46, 0x53, 0x60, 0x6d,
+    0x7a, 0x87, 0x94, 0xa1, 0xae, 0xbb, 0xc8, 0xd5, 0xe2, 0x27, 0x34, 0x41,
+    0x4e, 0x5b, 0x68, 0x75, 0x82, 0x8f, 0x9c, 0xa9, 0xb6, 0xc3, 0xd0, 0xdd,
+    0x22, 0x2f, 0x3c, 0x49, 0x56, 0x63, 0x70, 0x7d, 0x8a, 0x97, 0xa4, 0xb1,
+    0xbe, 0xcb, 0xd8, 0xe5, 0x2a, 0x37, 0x44, 0x51, 0x5e, 0x6b, 0x78, 0x85,
+    0x92, 0x9f, 0xac, 0xb9, 0xc6, 0xd3, 0xe0, 0x25, 0x32, 0x3f, 0x4c, 0x59,
+    0x66, 0x73, 0x80, 0x8d, 0x9a, 0xa7, 0xb4, 0xc1, 0xce, 0xdb, 0x20, 0x2d,
+    0x3a, 0x47, 0x54, 0x61, 0x6e, 0x7b, 0x88, 0x95, 0xa2, 0xaf,
+};
+
+// Blocks at 32 and 192 encrypted. The first ends in 00 00 ahead of a clear 02,
+// which takes a new emulation prevention byte.
+static const uint8_t idr_slice_encrypted[214] = {
+    0x65, 0x2d, 0x3a, 0x47, 0x54, 0x61, 0x6e, 0x7b, 0x88, 0x95, 0xa2, 0xaf,
+    0xbc, 0xc9, 0xd6, 0xe3, 0x28, 0x35, 0x42, 0x4f, 0x5c, 0x69, 0x76, 0x83,
+    0x90, 0x9d, 0xaa, 0xb7, 0xc4, 0xd1, 0xde, 0x23, 0x0d, 0x42, 0x91, 0x81,
+    0xeb, 0xb4, 0x09, 0x2d, 0xdd, 0x21, 0x36, 0xce, 0x72, 0xbd, 0x00, 0x00,
+    0x03, 0x02, 0x45, 0x52, 0x5f, 0x6c, 0x79, 0x86, 0x93, 0xa0, 0xad, 0xba,
+    0xc7, 0xd4, 0xe1, 0x26, 0x33, 0x40, 0x4d, 0x5a, 0x67, 0x74, 0x81, 0x8e,
+    0x9b, 0xa8, 0xb5, 0xc2, 0xcf, 0xdc, 0x21, 0x2e, 0x3b, 0x48, 0x55, 0x62,
+    0x6f, 0x7c, 0x89, 0x96, 0xa3, 0xb0, 0xbd, 0xca, 0xd7, 0xe4, 0x29, 0x36,
+    0x43, 0x50, 0x5d, 0x6a, 0x77, 0x00, 0x00, 0x03, 0x02, 0xab, 0xb8, 0xc5,
+    0xd2, 0xdf, 0x24, 0x31, 0x3e, 0x4b, 0x58, 0x65, 0x72, 0x7f, 0x8c, 0x99,
+    0xa6, 0xb3, 0xc0, 0xcd, 0xda, 0xe7, 0x2c, 0x39, 0x46, 0x53, 0x60, 0x6d,
+    0x7a, 0x87, 0x94, 0xa1, 0xae, 0xbb, 0xc8, 0xd5, 0xe2, 0x27, 0x34, 0x41,
+    0x4e, 0x5b, 0x68, 0x75, 0x82, 0x8f, 0x9c, 0xa9, 0xb6, 0xc3, 0xd0, 0xdd,
+    0x22, 0x2f, 0x3c, 0x49, 0x56, 0x63, 0x70, 0x7d, 0x8a, 0x97, 0xa4, 0xb1,
+    0xbe, 0xcb, 0xd8, 0xe5, 0x2a, 0x37, 0x44, 0x51, 0x5e, 0x6b, 0x78, 0x85,
+    0x92, 0x9f, 0xac, 0xb9, 0xc6, 0xd3, 0xe0, 0x25, 0x32, 0x3f, 0x4c, 0x59,
+    0x66, 0x73, 0x5a, 0x17, 0xc2, 0xcc, 0x71, 0xb5, 0xc6, 0x42, 0x21, 0x0b,
+    0x8b, 0x1f, 0xf8, 0x65, 0x9a, 0xe7, 0x88, 0x95, 0xa2, 0xaf,
+};
+
+// 69 bytes of 0x80 + i * 3: three blocks after the leader, five bytes clear.
+static const uint8_t aac_frame_encrypted[69] = {
+    0x80, 0x83, 0x86, 0x89, 0x8c, 0x8f, 0x92, 0x95, 0x98, 0x9b, 0x9e, 0xa1,
+    0xa4, 0xa7, 0xaa, 0xad, 0xfd, 0x7b, 0x67, 0xaf, 0xd9, 0x90, 0x0f, 0x9d,
+    0xa7, 0xee, 0xe9, 0xd2, 0x27, 0x63, 0xe8, 0x42, 0xed, 0xa7, 0xa9, 0x83,
+    0x39, 0x19, 0x82, 0xcb, 0xc8, 0xa8, 0x7f, 0x8d, 0x74, 0xfb, 0x57, 0xee,
+    0xb0, 0x60, 0x42, 0x97, 0x12, 0x16, 0xe8, 0x3e, 0x88, 0x6e, 0x1e, 0x3d,
+    0x56, 0x5c, 0x77, 0x0d, 0x40, 0x43, 0x46, 0x49, 0x4c,
+};
+
+static int test_key(void* opaque, int64_t segment, uint8_t* key, uint8_t* iv) {
+    int i;
+
+    for (i = 0; i < HLS_KEY_SIZE; i++) {
+        key[i] = i;
+        iv[i] = 0xf0 + i;
+    }
+
+    return 0;
+}
+
+typedef struct {
+    uint8_t data[512];
+    int size;
+} Output;
+
+static int collect(void* opaque, uint8_t* buf, int size) {
+    Output* o = opaque;
+
+    if (o->size + size > (int)sizeof(o->data)) {
+        return -1;
+    }
+    memcpy(o->data + o->size, buf, size);
+    o->size += size;
+
+    return size;
+}
+
+// AES-NI is used whenever the CPU has it; the av_aes path is forced by
+// switching it off before the key is set.
+static HlsCrypt* new_crypt(HlsCryptMethod method, int aesni) {
+    HlsCrypt* c = NewHlsCrypt(method, 0, test_key);
+
+    if (!aesni && c->aesni) {
+        c->aesni = 0;
+        c->aes = av_aes_alloc();
+    }
+
+    return c;
+}
+
+static void check_output(const Output* o, const uint8_t* expected, int size) {
+    CHECK_EQ(o->size, size);
+    CHECK(o->size == size && memcmp(o->data, expected, size) == 0);
+}
+
+static void test_aes_128(int aesni) {
+    static const int chunks[] = { 1, 15, 33, 3, 48 };
+    HlsCrypt* c = new_crypt(HLS_CRYPT_AES_128, aesni);
+    uint8_t plain[100];
+    Output o = { { 0 } };
+    int i, n;
+
+    for (i = 0; i < 100; i++) {
+        plain[i] = i * 7;
+    }
+
+    // Uneven writes leave partial blocks pending between calls.
+    CHECK_EQ(HlsCryptStartSegment(c, 0, &o, collect), 0);
+    for (i = 0, n = 0; i < 5; n += chunks[i++]) {
+        CHECK_EQ(HlsCryptWrite(c, plain + n, chunks[i]), chunks[i]);
+    }
+    CHECK_EQ(HlsCryptEndSegment(c), 0);
+    check_output(&o, aes128_segment, sizeof(aes128_segment));
+
+    // The next segment restarts the chain from the IV.
+    o.size = 0;
+    CHECK_EQ(HlsCryptStartSegment(c, 1, &o, collect), 0);
+    CHECK_EQ(HlsCryptWrite(c, plain, 32), 32);
+    CHECK_EQ(HlsCryptEndSegment(c), 0);
+    check_output(&o, aes128_aligned, sizeof(aes128_aligned));
+
+    FreeHlsCrypt(c);
+}
+
+static void test_sample_aes_video(int aesni) {
+    static const uint8_t aud[] = { 0, 0, 0, 1, 0x09, 0xf0 };
+    static const uint8_t sps[] = { 0, 0, 0, 1, 0x67, 0x42, 0xc0, 0x1e, 0x95, 0xa0, 0x14, 0x1f, 0x88 };
+    static const uint8_t start[] = { 0, 0, 0, 1 };
+    HlsCrypt* c = new_crypt(HLS_CRYPT_SAMPLE_AES, aesni);
+    uint8_t in[512], expected[512], out[HLS_CRYPT_VIDEO_BOUND(512)];
+    uint8_t* shortSlice;
+    Output o = { { 0 } };
+    int n = 0;
+
+    memcpy(in + n, aud, sizeof(aud));
+    n += sizeof(aud);
+    memcpy(in + n, sps, sizeof(sps));
+    n += sizeof(sps);
+    memcpy(in + n, start, sizeof(start));
+    n += sizeof(start);
+    memcpy(expected, in, n);
+    memcpy(in + n, idr_slice, sizeof(idr_slice));
+    memcpy(expected + n, idr_slice_encrypted, sizeof(idr_slice_encrypted));
+    n += sizeof(idr_slice);
+
+    // A 48 byte non-IDR slice is too short to encrypt.
+    shortSlice = in + n;
+    shortSlice[0] = 0;
+    shortSlice[1] = 0;
+    shortSlice[2] = 1;
+    shortSlice[3] = 0x41;
+    memset(shortSlice + 4, 0x5a, 47);
+    memcpy(expected + n, shortSlice, 51);
+    n += 51;
+
+    CHECK_EQ(HlsCryptStartSegment(c, 0, &o, collect), 0);
+    CHECK_EQ(HlsCryptEncryptVideo(c, in, n, out), n);
+    CHECK(memcmp(out, expected, n) == 0);
+
+    FreeHlsCrypt(c);
+}
+
+static void test_sample_aes_audio(int aesni) {
+    HlsCrypt* c = new_crypt(HLS_CRYPT_SAMPLE_AES, aesni);
+    uint8_t frame[69], small[16];
+    Output o = { { 0 } };
+    int i;
+
+    for (i = 0; i < 69; i++) {
+        frame[i] = 0x80 + i * 3;
+    }
+    memcpy(small, frame, 16);
+
+    CHECK_EQ(HlsCryptStartSegment(c, 0, &o, collect), 0);
+    HlsCryptEncryptAudio(c, frame, 69);
+    CHECK(memcmp(frame, aac_frame_encrypted, 69) == 0);
+
+    // The IV is reset for every frame.
+    for (i = 0; i < 69; i++) {
+        frame[i] = 0x80 + i * 3;
+    }
+    HlsCryptEncryptAudio(c, frame, 69);
+    CHECK(memcmp(frame, aac_frame_encrypted, 69) == 0);
+
+    // Frames no longer than the leader stay clear.
+    HlsCryptEncryptAudio(c, small, 16);
+    CHECK(memcmp(small, frame, 16) == 0);
+
+    FreeHlsCrypt(c);
+}
+
+int main(void) {
+    HlsCrypt* c = NewHlsCrypt(HLS_CRYPT_AES_128, 0, test_key);
+    int aesni = c->aesni;
+
+    FreeHlsCrypt(c);
+
+    test_aes_128(0);
+    test_sample_aes_video(0);
+    test_sample_aes_audio(0);
+
+    if (aesni) {
+        test_aes_128(1);
+        test_sample_aes_video(1);
+        test_sample_aes_audio(1);
+    } else {
+        fprintf(stderr, "hls_crypt_test: no AES-NI, only the av_aes path was tested\n");
+    }
+
+    if (failures) {
+        fprintf(stderr, "hls_crypt_test: %d failures\n", failures);
+    }
+
+    return failures != 0;
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2014 veecr.
+ */
+
+#include "../mem_budget.h"
+#include "check.h"
+
+static void test_accounting(void) {
+    MemBudget b;
+
+    MemBudgetInit(&b, 1000);
+    CHECK_EQ(b.used, 0);
+    CHECK_EQ(b.peak, 0);
+
+    MemBudgetCharge(&b, 600);
+    MemBudgetCharge(&b, 300);
+    CHECK_EQ(b.used, 900);
+    CHECK_EQ(b.peak, 900);
+
+    // Peak stays at the high-water mark.
+    MemBudgetRelease(&b, 500);
+    MemBudgetCharge(&b, 100);
+    CHECK_EQ(b.used, 500);
+    CHECK_EQ(b.peak, 900);
+
+    MemBudgetRelease(&b, 500);
+    CHECK_EQ(b.used, 0);
+    CHECK_EQ(b.peak, 900);
+}
+
+static void test_limits(void) {
+    MemBudget b;
+
+    // Near the limit from 7/8 of it, over it past the limit itself.
+    MemBudgetInit(&b, 1000);
+    MemBudgetCharge(&b, 874);
+    CHECK(!MemBudgetNearLimit(&b));
+    MemBudgetCharge(&b, 1);
+    CHECK(MemBudgetNearLimit(&b));
+    CHECK(!MemBudgetOverLimit(&b));
+    MemBudgetCharge(&b, 125);
+    CHECK(!MemBudgetOverLimit(&b));
+    MemBudgetCharge(&b, 1);
+    CHECK(MemBudgetOverLimit(&b));
+    CHECK(MemBudgetNearLimit(&b));
+    MemBudgetRelease(&b, 1001);
+    CHECK(!MemBudgetOverLimit(&b));
+    CHECK(!MemBudgetNearLimit(&b));
+
+    // A limit of 0 only records usage.
+    MemBudgetInit(&b, 0);
+    MemBudgetCharge(&b, (int64_t)1 << 40);
+    CHECK(!MemBudgetNearLimit(&b));
+    CHECK(!MemBudgetOverLimit(&b));
+    CHECK_EQ(b.peak, (int64_t)1 << 40);
+}
+
+int main(void) {
+    test_accounting();
+    test_limits();
+
+    if (failures) {
+        fprintf(stderr, "mem_budget_test: %d failures\n", failures);
+    }
+
+    return failures != 0;
+}
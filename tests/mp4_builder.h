@@ -0,0 +1,85 @@
+#ifndef MP4_BUILDER_H
+#define MP4_BUILDER_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// A small in-memory MP4 writer for the tests. Boxes are opened with
+// box_start and get their size patched in by box_end.
+typedef struct {
+    uint8_t data[65536];
+    int size;
+    int stack[16];
+    int depth;
+} Mp4Builder;
+
+static void put8(Mp4Builder* b, int v) {
+    b->data[b->size++] = v;
+}
+
+static void put16(Mp4Builder* b, int v) {
+    put8(b, v >> 8);
+    put8(b, v);
+}
+
+static void put32(Mp4Builder* b, uint32_t v) {
+    put16(b, v >> 16);
+    put16(b, v);
+}
+
+static void put64(Mp4Builder* b, uint64_t v) {
+    put32(b, v >> 32);
+    put32(b, v);
+}
+
+static void put_bytes(Mp4Builder* b, const void* data, int size) {
+    memcpy(b->data + b->size, data, size);
+    b->size += size;
+}
+
+static void put_tag(Mp4Builder* b, const char* tag) {
+    put_bytes(b, tag, 4);
+}
+
+static void put_zeros(Mp4Builder* b, int n) {
+    memset(b->data + b->size, 0, n);
+    b->size += n;
+}
+
+static void box_start(Mp4Builder* b, const char* type) {
+    b->stack[b->depth++] = b->size;
+    put32(b, 0);
+    put_tag(b, type);
+}
+
+static void box_end(Mp4Builder* b) {
+    int start = b->stack[--b->depth];
+    int size = b->size - start;
+
+    b->data[start] = size >> 24;
+    b->data[start + 1] = size >> 16;
+    b->data[start + 2] = size >> 8;
+    b->data[start + 3] = size;
+}
+
+static void put_hdlr(Mp4Builder* b, const char* handler) {
+    box_start(b, "hdlr");
+    put_zeros(b, 8);
+    put_tag(b, handler);
+    put_zeros(b, 13);
+    box_end(b);
+}
+
+static void write_file(const char* path, const uint8_t* data, int size) {
+    FILE* f = fopen(path, "wb");
+
+    if (!f || fwrite(data, 1, size, f) != (size_t)size) {
+        fprintf(stderr, "Could not write %s\n", path);
+        exit(1);
+    }
+    fclose(f);
+}
+
+#endif
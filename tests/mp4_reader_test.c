@@ -0,0 +1,479 @@
+/*
+ * Copyright (c) 2014 veecr.
+ */
+
+#include "../mp4_reader.h"
+#include "check.h"
+#include "mp4_builder.h"
+#include <libavformat/avformat.h>
+
+#define NUM_VIDEO 6
+#define NUM_AUDIO 8
+#define NUM_FRAMES (NUM_VIDEO + NUM_AUDIO)
+
+// Samples in file order: track, index within the track.
+static const int layout[NUM_FRAMES][2] = {
+    { 0, 0 }, { 1, 0 }, { 1, 1 }, { 0, 1 }, { 1, 2 }, { 1, 3 }, { 0, 2 },
+    { 1, 4 }, { 0, 3 }, { 1, 5 }, { 0, 4 }, { 1, 6 }, { 1, 7 }, { 0, 5 },
+};
+
+static const uint8_t sps[] = { 0x67, 0x42, 0xc0, 0x1e, 0xd9, 0x00, 0xa0, 0x47, 0xfe, 0xc8 };
+static const uint8_t pps[] = { 0x68, 0xce, 0x3c, 0x80 };
+static const uint8_t asc[] = { 0x11, 0x90 };
+
+static int sample_size(int track, int i) {
+    return track == 0 ? 100 + 10 * i : 20 + i;
+}
+
+static int sample_byte(int track, int i) {
+    return (track == 0 ? 0x10 : 0x80) + i;
+}
+
+static int64_t sample_dts(int track, int i) {
+    return track == 0 ? i * 3000 : i * 1024;
+}
+
+static void put_matrix(Mp4Builder* b) {
+    put32(b, 0x00010000);
+    put_zeros(b, 12);
+    put32(b, 0x00010000);
+    put_zeros(b, 12);
+    put32(b, 0x40000000);
+}
+
+static void put_sample_tables(Mp4Builder* b, int track, int count, int delta, int64_t mdatStart) {
+    int64_t offsets[NUM_VIDEO > NUM_AUDIO ? NUM_VIDEO : NUM_AUDIO];
+    int64_t pos = mdatStart + 8;
+    int i;
+
+    for (i = 0; i < NUM_FRAMES; i++) {
+        if (layout[i][0] == track) {
+            offsets[layout[i][1]] = pos;
+        }
+        pos += sample_size(layout[i][0], layout[i][1]);
+    }
+
+    box_start(b, "stts");
+    put32(b, 0);
+    put32(b, 1);
+    put32(b, count);
+    put32(b, delta);
+    box_end(b);
+    if (track == 0) {
+        // Key frames at samples 0 and 3.
+        box_start(b, "stss");
+        put32(b, 0);
+        put32(b, 2);
+        put32(b, 1);
+        put32(b, 4);
+        box_end(b);
+    }
+    box_start(b, "stsc");
+    put32(b, 0);
+    put32(b, 1);
+    put32(b, 1);
+    put32(b, 1);
+    put32(b, 1);
+    box_end(b);
+    box_start(b, "stsz");
+    put32(b, 0);
+    put32(b, 0);
+    put32(b, count);
+    for (i = 0; i < count; i++) {
+        put32(b, sample_size(track, i));
+    }
+    box_end(b);
+    box_start(b, "stco");
+    put32(b, 0);
+    put32(b, count);
+    for (i = 0; i < count; i++) {
+        put32(b, offsets[i]);
+    }
+    box_end(b);
+}
+
+static void put_trak_header(Mp4Builder* b, int trackId, int timescale, int duration, const char* handler) {
+    box_start(b, "tkhd");
+    put32(b, 3);
+    put_zeros(b, 8);
+    put32(b, trackId);
+    put32(b, 0);
+    put32(b, duration);
+    put_zeros(b, 16);
+    put_matrix(b);
+    put32(b, trackId == 1 ? 320 << 16 : 0);
+    put32(b, trackId == 1 ? 240 << 16 : 0);
+    box_end(b);
+    box_start(b, "mdia");
+    box_start(b, "mdhd");
+    put_zeros(b, 12);
+    put32(b, timescale);
+    put32(b, duration);
+    put16(b, 0x55c4);
+    put16(b, 0);
+    box_end(b);
+    put_hdlr(b, handler);
+    box_start(b, "minf");
+    box_start(b, "dinf");
+    box_start(b, "dref");
+    put32(b, 0);
+    put32(b, 1);
+    box_start(b, "url ");
+    put32(b, 1);
+    box_end(b);
+    box_end(b);
+    box_end(b);
+}
+
+static void put_video_trak(Mp4Builder* b, int64_t mdatStart) {
+    box_start(b, "trak");
+    put_trak_header(b, 1, 90000, NUM_VIDEO * 3000, "vide");
+    box_start(b, "vmhd");
+    put32(b, 1);
+    put_zeros(b, 8);
+    box_end(b);
+    box_start(b, "stbl");
+    box_start(b, "stsd");
+    put32(b, 0);
+    put32(b, 1);
+    box_start(b, "avc1");
+    put_zeros(b, 6);
+    put16(b, 1);
+    put_zeros(b, 16);
+    put16(b, 320);
+    put16(b, 240);
+    put32(b, 0x00480000);
+    put32(b, 0x00480000);
+    put32(b, 0);
+    put16(b, 1);
+    put_zeros(b, 32);
+    put16(b, 0x18);
+    put16(b, 0xffff);
+    box_start(b, "avcC");
+    put8(b, 1);
+    put8(b, sps[1]);
+    put8(b, sps[2]);
+    put8(b, sps[3]);
+    put8(b, 0xff);
+    put8(b, 0xe1);
+    put16(b, sizeof(sps));
+    put_bytes(b, sps, sizeof(sps));
+    put8(b, 1);
+    put16(b, sizeof(pps));
+    put_bytes(b, pps, sizeof(pps));
+    box_end(b);
+    box_end(b);
+    box_end(b);
+    put_sample_tables(b, 0, NUM_VIDEO, 3000, mdatStart);
+    box_end(b);
+    box_end(b);
+    box_end(b);
+    box_end(b);
+}
+
+static void put_audio_trak(Mp4Builder* b, int64_t mdatStart) {
+    box_start(b, "trak");
+    put_trak_header(b, 2, 48000, NUM_AUDIO * 1024, "soun");
+    box_start(b, "smhd");
+    put_zeros(b, 8);
+    box_end(b);
+    box_start(b, "stbl");
+    box_start(b, "stsd");
+    put32(b, 0);
+    put32(b, 1);
+    box_start(b, "mp4a");
+    put_zeros(b, 6);
+    put16(b, 1);
+    put_zeros(b, 8);
+    put16(b, 2);
+    put16(b, 16);
+    put_zeros(b, 4);
+    put32(b, 48000 << 16);
+    box_start(b, "esds");
+    put32(b, 0);
+    put8(b, 0x03);
+    put8(b, 25);
+    put16(b, 2);
+    put8(b, 0);
+    put8(b, 0x04);
+    put8(b, 17);
+    put8(b, 0x40);
+    put8(b, 0x15);
+    put_zeros(b, 11);
+    put8(b, 0x05);
+    put8(b, sizeof(asc));
+    put_bytes(b, asc, sizeof(asc));
+    put8(b, 0x06);
+    put8(b, 1);
+    put8(b, 0x02);
+    box_end(b);
+    box_end(b);
+    box_end(b);
+    put_sample_tables(b, 1, NUM_AUDIO, 1024, mdatStart);
+    box_end(b);
+    box_end(b);
+    box_end(b);
+    box_end(b);
+}
+
+// A progressive MP4 with moov ahead of mdat, so it can be read without
+// seeking: an H.264 and an AAC track with interleaved samples.
+static void build_input(Mp4Builder* b) {
+    int64_t mdatStart = 0;
+    int pass, i, j;
+
+    for (pass = 0; pass < 2; pass++) {
+        memset(b, 0, sizeof(Mp4Builder));
+        box_start(b, "ftyp");
+        put_tag(b, "isom");
+        put32(b, 0x200);
+        put_tag(b, "isom");
+        put_tag(b, "avc1");
+        box_end(b);
+
+        box_start(b, "moov");
+        box_start(b, "mvhd");
+        put_zeros(b, 12);
+        put32(b, 1000);
+        put32(b, 200);
+        put32(b, 0x00010000);
+        put16(b, 0x0100);
+        put_zeros(b, 10);
+        put_matrix(b);
+        put_zeros(b, 24);
+        put32(b, 3);
+        box_end(b);
+        put_video_trak(b, mdatStart);
+        put_audio_trak(b, mdatStart);
+        box_end(b);
+
+        // The sample offsets depend on the size of moov.
+        mdatStart = b->size;
+    }
+
+    box_start(b, "mdat");
+    for (i = 0; i < NUM_FRAMES; i++) {
+        int track = layout[i][0], index = layout[i][1];
+        for (j = 0; j < sample_size(track, index); j++) {
+            put8(b, sample_byte(track, index));
+        }
+    }
+    box_end(b);
+}
+
+typedef struct {
+    const uint8_t* data;
+    int size;
+    int pos;
+} MemInput;
+
+static int mem_read(void* opaque, uint8_t* buf, int size) {
+    MemInput* in = opaque;
+
+    if (in->pos >= in->size) {
+        return AVERROR_EOF;
+    }
+    if (size > in->size - in->pos) {
+        size = in->size - in->pos;
+    }
+    memcpy(buf, in->data + in->pos, size);
+    in->pos += size;
+
+    return size;
+}
+
+typedef struct {
+    int count;
+    int track[NUM_FRAMES];
+    int index[NUM_FRAMES];
+} ReadLog;
+
+// Records which sample a frame is, and checks it against the input.
+static void log_frame(void* opaque, int track, uint8_t* buf, int size, int64_t pts, int64_t dts, int duration, int isKeyFrame) {
+    ReadLog* log = opaque;
+    int index = size > 0 ? buf[0] - (track == 0 ? 0x10 : 0x80) : -1;
+
+    if (log->count >= NUM_FRAMES || index < 0 || index >= (track == 0 ? NUM_VIDEO : NUM_AUDIO)) {
+        fprintf(stderr, "unexpected frame on track %d, size %d\n", track, size);
+        failures++;
+        return;
+    }
+
+    CHECK_EQ(size, sample_size(track, index));
+    CHECK(buf[size - 1] == sample_byte(track, index));
+    CHECK_EQ(dts, sample_dts(track, index));
+    CHECK_EQ(pts, dts);
+    CHECK_EQ(duration, track == 0 ? 3000 : 1024);
+    CHECK_EQ(isKeyFrame, track == 1 || index == 0 || index == 3);
+
+    log->track[log->count] = track;
+    log->index[log->count] = index;
+    log->count++;
+}
+
+static FrameReader* open_input(MemInput* in, const Mp4Builder* b) {
+    FrameReader* fr;
+
+    in->data = b->data;
+    in->size = b->size;
+    in->pos = 0;
+
+    fr = NewMp4FrameReader(in, mem_read);
+    if (!fr) {
+        fprintf(stderr, "Could not open the test input\n");
+        exit(1);
+    }
+
+    return fr;
+}
+
+static void test_tracks(const Mp4Builder* b) {
+    const uint8_t *spsBuf, *ppsBuf, *ascBuf;
+    int spsSize, ppsSize, ascSize, num, den;
+    MemInput in;
+    FrameReader* fr = open_input(&in, b);
+
+    CHECK_EQ(Mp4FrameReaderGetNumTracks(fr), 2);
+    CHECK_EQ(Mp4FrameReaderGetTrackMediaType(fr, 0), AVMEDIA_TYPE_VIDEO);
+    CHECK_EQ(Mp4FrameReaderGetTrackMediaType(fr, 1), AVMEDIA_TYPE_AUDIO);
+    CHECK_EQ(Mp4FrameReaderGetTrackMediaType(fr, 2), AVMEDIA_TYPE_UNKNOWN);
+    CHECK_EQ(Mp4FrameReaderGetMediaType(fr), AVMEDIA_TYPE_VIDEO);
+
+    Mp4FrameReaderGetTrackTimeBase(fr, 0, &num, &den);
+    CHECK(num == 1 && den == 90000);
+    Mp4FrameReaderGetTrackTimeBase(fr, 1, &num, &den);
+    CHECK(num == 1 && den == 48000);
+    Mp4FrameReaderGetTrackTimeBase(fr, -1, &num, &den);
+    CHECK(num == 0 && den == 0);
+
+    CHECK_EQ(Mp4FrameReaderGetTrackNumFrames(fr, 0), NUM_VIDEO);
+    CHECK_EQ(Mp4FrameReaderGetTrackNumFrames(fr, 1), NUM_AUDIO);
+    CHECK_EQ(Mp4FrameReaderGetTrackNumFrames(fr, 2), 0);
+
+    // Milliseconds: 6 * 3000 / 90000 s and 8 * 1024 / 48000 s, rounded.
+    CHECK_EQ(Mp4FrameReaderGetTrackDuration(fr, 0), 200);
+    CHECK_EQ(Mp4FrameReaderGetTrackDuration(fr, 1), 171);
+    CHECK_EQ(Mp4FrameReaderGetDuration(fr), 200);
+
+    Mp4FrameReaderGetTrackSpsAndPps(fr, 0, &spsBuf, &spsSize, &ppsBuf, &ppsSize);
+    CHECK(spsSize == sizeof(sps) && !memcmp(spsBuf, sps, sizeof(sps)));
+    CHECK(ppsSize == sizeof(pps) && !memcmp(ppsBuf, pps, sizeof(pps)));
+    Mp4FrameReaderGetTrackSpsAndPps(fr, 1, &spsBuf, &spsSize, &ppsBuf, &ppsSize);
+    CHECK(!spsBuf && !ppsBuf && spsSize == 0 && ppsSize == 0);
+
+    Mp4FrameReaderGetTrackAsc(fr, 1, &ascBuf, &ascSize);
+    CHECK(ascSize == sizeof(asc) && !memcmp(ascBuf, asc, sizeof(asc)));
+
+    FreeMp4FrameReader(fr);
+}
+
+// Reads with the given selection and checks that exactly the samples of
+// the selected tracks come back, in file order.
+static void check_selection(const Mp4Builder* b, uint64_t mask) {
+    MemInput in;
+    FrameReader* fr = open_input(&in, b);
+    ReadLog log = { 0 };
+    int expected = 0, i;
+
+    if (mask != ~(uint64_t)0) {
+        Mp4FrameReaderSelectTracks(fr, mask);
+    }
+    while (Mp4FrameReaderReadTrackFrame(fr, &log, log_frame)) {
+    }
+
+    for (i = 0; i < NUM_FRAMES; i++) {
+        if (!(mask & ((uint64_t)1 << layout[i][0]))) {
+            continue;
+        }
+        if (expected < log.count) {
+            CHECK_EQ(log.track[expected], layout[i][0]);
+            CHECK_EQ(log.index[expected], layout[i][1]);
+        }
+        expected++;
+    }
+    CHECK_EQ(log.count, expected);
+
+    FreeMp4FrameReader(fr);
+}
+
+// Checks frames[0..n) against the file order starting at sample first.
+static void check_batch(const FrameDesc* frames, int n, const uint8_t* arena, int first) {
+    int64_t offset = 0;
+    int i;
+
+    for (i = 0; i < n && first + i < NUM_FRAMES; i++) {
+        int track = layout[first + i][0], index = layout[first + i][1];
+
+        CHECK_EQ(frames[i].track, track);
+        CHECK_EQ(frames[i].size, sample_size(track, index));
+        CHECK_EQ(frames[i].offset, offset);
+        CHECK(arena[frames[i].offset] == sample_byte(track, index));
+        CHECK(arena[frames[i].offset + frames[i].size - 1] == sample_byte(track, index));
+        CHECK_EQ(frames[i].isKeyFrame, track == 1 || index == 0 || index == 3);
+        CHECK_EQ(frames[i].dts, sample_dts(track, index));
+        offset += frames[i].size;
+    }
+}
+
+static void test_read_frames(const Mp4Builder* b) {
+    FrameDesc frames[NUM_FRAMES];
+    uint8_t arena[1024];
+    MemInput in;
+    FrameReader* fr = open_input(&in, b);
+
+    // 100 + 20 + 21 fit in 191 bytes; the next video frame (110) does not.
+    CHECK_EQ(Mp4FrameReaderReadFrames(fr, frames, NUM_FRAMES, arena, 191), 3);
+    check_batch(frames, 3, arena, 0);
+
+    // The held frame alone is larger than the arena.
+    CHECK_EQ(Mp4FrameReaderReadFrames(fr, frames, NUM_FRAMES, arena, 100), -1);
+    CHECK_EQ(frames[0].size, 110);
+
+    CHECK_EQ(Mp4FrameReaderReadFrames(fr, frames, 2, arena, sizeof(arena)), 2);
+    check_batch(frames, 2, arena, 3);
+
+    CHECK_EQ(Mp4FrameReaderReadFrames(fr, frames, NUM_FRAMES, arena, sizeof(arena)), NUM_FRAMES - 5);
+    check_batch(frames, NUM_FRAMES - 5, arena, 5);
+    CHECK_EQ(Mp4FrameReaderReadFrames(fr, frames, NUM_FRAMES, arena, sizeof(arena)), 0);
+
+    FreeMp4FrameReader(fr);
+}
+
+// A frame held back by a batch is what the next single-frame read returns.
+static void test_pending_frame(const Mp4Builder* b) {
+    FrameDesc frames[NUM_FRAMES];
+    uint8_t arena[1024];
+    ReadLog log = { 0 };
+    MemInput in;
+    FrameReader* fr = open_input(&in, b);
+
+    CHECK_EQ(Mp4FrameReaderReadFrames(fr, frames, NUM_FRAMES, arena, 191), 3);
+    CHECK_EQ(Mp4FrameReaderReadTrackFrame(fr, &log, log_frame), 1);
+    CHECK_EQ(log.count, 1);
+    CHECK(log.track[0] == 0 && log.index[0] == 1);
+
+    FreeMp4FrameReader(fr);
+}
+
+int main(void) {
+    Mp4Builder* b = malloc(sizeof(Mp4Builder));
+
+    av_register_all();
+    av_log_set_level(AV_LOG_ERROR);
+
+    build_input(b);
+    test_tracks(b);
+    check_selection(b, ~(uint64_t)0);
+    check_selection(b, 1);
+    check_selection(b, 2);
+    check_selection(b, 0);
+    test_read_frames(b);
+    test_pending_frame(b);
+    free(b);
+
+    if (failures) {
+        fprintf(stderr, "mp4_reader_test: %d failures\n", failures);
+    }
+
+    return failures != 0;
+}
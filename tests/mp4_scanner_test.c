@@ -0,0 +1,261 @@
+/*
+ * Copyright (c) 2014 veecr.
+ */
+
+#include "../mp4_scanner.h"
+#include "check.h"
+#include "mp4_builder.h"
+#include <errno.h>
+#include <unistd.h>
+
+// Video track: version 0 tkhd, version 1 mdhd, and an hdlr that follows
+// minf so the handler is only known once mdia has been read.
+static void put_video_trak(Mp4Builder* b) {
+    static const uint8_t avcc[] = { 0x01, 0x64, 0x00, 0x1f, 0xff };
+
+    box_start(b, "trak");
+    box_start(b, "tkhd");
+    put_zeros(b, 12);
+    put32(b, 1);
+    put_zeros(b, 68);
+    box_end(b);
+    box_start(b, "mdia");
+    box_start(b, "mdhd");
+    put32(b, 0x01000000);
+    put_zeros(b, 16);
+    put32(b, 90000);
+    put64(b, 900000);
+    put_zeros(b, 4);
+    box_end(b);
+    box_start(b, "minf");
+    box_start(b, "stbl");
+    box_start(b, "stsd");
+    put32(b, 0);
+    put32(b, 1);
+    box_start(b, "avc1");
+    put_zeros(b, 24);
+    put16(b, 640);
+    put16(b, 360);
+    put_zeros(b, 50);
+    box_start(b, "avcC");
+    put_bytes(b, avcc, sizeof(avcc));
+    box_end(b);
+    box_end(b);
+    box_end(b);
+    box_start(b, "stsz");
+    put32(b, 0);
+    put32(b, 0);
+    put32(b, 3);
+    put32(b, 100);
+    put32(b, 200);
+    put32(b, 300);
+    box_end(b);
+    box_start(b, "stss");
+    put32(b, 0);
+    put32(b, 1);
+    put32(b, 1);
+    box_end(b);
+    box_end(b);
+    box_end(b);
+    put_hdlr(b, "vide");
+    box_end(b);
+    box_end(b);
+}
+
+// Audio track: version 1 tkhd, version 0 mdhd, an esds config and no stss.
+static void put_audio_trak(Mp4Builder* b) {
+    box_start(b, "trak");
+    box_start(b, "tkhd");
+    put32(b, 0x01000000);
+    put_zeros(b, 16);
+    put32(b, 2);
+    put_zeros(b, 68);
+    box_end(b);
+    box_start(b, "mdia");
+    box_start(b, "mdhd");
+    put_zeros(b, 12);
+    put32(b, 48000);
+    put32(b, 480000);
+    put_zeros(b, 4);
+    box_end(b);
+    put_hdlr(b, "soun");
+    box_start(b, "minf");
+    box_start(b, "stbl");
+    box_start(b, "stsd");
+    put32(b, 0);
+    put32(b, 1);
+    box_start(b, "mp4a");
+    put_zeros(b, 16);
+    put16(b, 2);
+    put16(b, 16);
+    put_zeros(b, 4);
+    put32(b, 48000 << 16);
+    box_start(b, "esds");
+    put32(b, 0);
+    put8(b, 0x03);
+    put8(b, 0x80);  // multi-byte descriptor length
+    put8(b, 0x16);
+    put16(b, 2);
+    put8(b, 0);
+    put8(b, 0x04);
+    put8(b, 0x11);
+    put8(b, 0x40);
+    put_zeros(b, 12);
+    put8(b, 0x05);
+    put8(b, 2);
+    put8(b, 0x11);
+    put8(b, 0x90);
+    box_end(b);
+    box_end(b);
+    box_end(b);
+    box_start(b, "stsz");
+    put32(b, 0);
+    put32(b, 10);
+    put32(b, 100);
+    box_end(b);
+    box_end(b);
+    box_end(b);
+    box_end(b);
+    box_end(b);
+}
+
+// ftyp, free, a 64-bit size mdat of mdatSize payload bytes, then moov.
+// Returns the offset of moov.
+static int build_file(Mp4Builder* b, int mdatSize) {
+    int moov;
+
+    memset(b, 0, sizeof(Mp4Builder));
+
+    box_start(b, "ftyp");
+    put_tag(b, "isom");
+    put32(b, 0x200);
+    put_tag(b, "isom");
+    box_end(b);
+    box_start(b, "free");
+    box_end(b);
+    put32(b, 1);
+    put_tag(b, "mdat");
+    put64(b, 16 + mdatSize);
+    put_zeros(b, mdatSize);
+
+    moov = b->size;
+    box_start(b, "moov");
+    box_start(b, "mvhd");
+    put_zeros(b, 12);
+    put32(b, 1000);
+    put32(b, 10000);
+    put_zeros(b, 80);
+    box_end(b);
+    put_video_trak(b);
+    put_audio_trak(b);
+    box_end(b);
+
+    return moov;
+}
+
+static void check_result(const ScanResult* r, int64_t fileSize) {
+    const ScanTrack* v = &r->tracks[0];
+    const ScanTrack* a = &r->tracks[1];
+
+    CHECK_EQ(r->error, 0);
+    CHECK_EQ(r->fileSize, fileSize);
+    CHECK_EQ(r->durationMs, 10000);
+    CHECK_EQ(r->bitrate, fileSize * 8 * 1000 / 10000);
+    CHECK_EQ(r->numTracks, 2);
+    if (r->numTracks != 2) {
+        return;
+    }
+
+    CHECK_EQ(v->trackId, 1);
+    CHECK(!strcmp(v->handler, "vide"));
+    CHECK(!strcmp(v->codec, "avc1"));
+    CHECK_EQ(v->timescale, 90000);
+    CHECK_EQ(v->durationMs, 10000);
+    CHECK_EQ(v->numSamples, 3);
+    CHECK_EQ(v->numKeyFrames, 1);
+    CHECK_EQ(v->totalBytes, 600);
+    CHECK_EQ(v->bitrate, 480);
+    CHECK_EQ(v->width, 640);
+    CHECK_EQ(v->height, 360);
+    CHECK_EQ(v->codecConfigSize, 5);
+
+    CHECK_EQ(a->trackId, 2);
+    CHECK(!strcmp(a->handler, "soun"));
+    CHECK(!strcmp(a->codec, "mp4a"));
+    CHECK_EQ(a->timescale, 48000);
+    CHECK_EQ(a->durationMs, 10000);
+    CHECK_EQ(a->numSamples, 100);
+    CHECK_EQ(a->numKeyFrames, 100);
+    CHECK_EQ(a->totalBytes, 1000);
+    CHECK_EQ(a->sampleRate, 48000);
+    CHECK_EQ(a->channels, 2);
+    CHECK_EQ(a->codecConfigSize, 2);
+    CHECK(a->codecConfigSize == 2 && a->codecConfig[0] == 0x11 && a->codecConfig[1] == 0x90);
+}
+
+int main(void) {
+    char dir[] = "/tmp/mp4_scanner_testXXXXXX";
+    char paths[5][64];
+    const char* names[5] = { "good", "zero_size", "truncated", "no_moov", "missing" };
+    const char* pathList[5];
+    ScanResult results[5];
+    Mp4Builder* b = malloc(sizeof(Mp4Builder));
+    int moov, size, i;
+
+    if (!b || !mkdtemp(dir)) {
+        fprintf(stderr, "Could not create the test directory\n");
+        return 1;
+    }
+    for (i = 0; i < 5; i++) {
+        snprintf(paths[i], sizeof(paths[i]), "%s/%s.mp4", dir, names[i]);
+        pathList[i] = paths[i];
+    }
+
+    moov = build_file(b, 1000);
+    size = b->size;
+    write_file(paths[0], b->data, size);
+
+    // A last box with size 0 runs to the end of the file.
+    b->data[moov] = b->data[moov + 1] = b->data[moov + 2] = b->data[moov + 3] = 0;
+    write_file(paths[1], b->data, size);
+
+    // moov extends past the end of the file.
+    build_file(b, 1000);
+    write_file(paths[2], b->data, size - 1);
+
+    // Only the boxes ahead of moov.
+    write_file(paths[3], b->data, moov);
+
+    CHECK_EQ(Mp4ScanFile(paths[0], &results[0]), 0);
+    check_result(&results[0], size);
+    FreeScanResult(&results[0]);
+
+    CHECK_EQ(Mp4ScanFile(paths[1], &results[1]), 0);
+    check_result(&results[1], size);
+    FreeScanResult(&results[1]);
+
+    CHECK_EQ(Mp4ScanFile(paths[2], &results[2]), -1);
+    CHECK_EQ(results[2].numTracks, 0);
+    CHECK_EQ(Mp4ScanFile(paths[3], &results[3]), -1);
+    CHECK_EQ(Mp4ScanFile(paths[4], &results[4]), ENOENT);
+
+    // The parallel scan fills each result for its own path.
+    Mp4ScanFiles(pathList, 5, results, 3);
+    check_result(&results[0], size);
+    check_result(&results[1], size);
+    CHECK_EQ(results[2].error, -1);
+    CHECK_EQ(results[3].error, -1);
+    CHECK_EQ(results[4].error, ENOENT);
+    for (i = 0; i < 5; i++) {
+        FreeScanResult(&results[i]);
+        unlink(paths[i]);
+    }
+    rmdir(dir);
+    free(b);
+
+    if (failures) {
+        fprintf(stderr, "mp4_scanner_test: %d failures\n", failures);
+    }
+
+    return failures != 0;
+}
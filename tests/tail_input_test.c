@@ -0,0 +1,130 @@
+/*
+ * Copyright (c) 2014 veecr.
+ */
+
+#include "../tail_input.h"
+#include "check.h"
+#include <libavutil/error.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define IDLE_TIMEOUT_MS 300
+
+typedef struct {
+    const char* path;
+    int delayMs;
+    int size;
+} Append;
+
+static int64_t now_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void append(const char* path, int size, int value) {
+    uint8_t buf[256];
+    FILE* f = fopen(path, "ab");
+
+    memset(buf, value, size);
+    if (!f || fwrite(buf, 1, size, f) != (size_t)size) {
+        fprintf(stderr, "Could not append to %s\n", path);
+        return;
+    }
+    fclose(f);
+}
+
+static void* append_later(void* arg) {
+    Append* a = arg;
+
+    usleep(a->delayMs * 1000);
+    append(a->path, a->size, 2);
+
+    return 0;
+}
+
+// Reads return what is there, wait for the file to grow, and report end of
+// file once it has not grown for the idle timeout.
+static void test_follow(const char* path) {
+    TailInput* in = NewTailInput(path, IDLE_TIMEOUT_MS, 50);
+    Append a = { path, 100, 50 };
+    uint8_t buf[1000];
+    pthread_t thread;
+    int64_t start;
+    int n;
+
+    CHECK(in != 0);
+    if (!in) {
+        return;
+    }
+
+    n = TailInputRead(in, buf, sizeof(buf));
+    CHECK_EQ(n, 100);
+    CHECK(buf[0] == 1 && buf[99] == 1);
+    CHECK_EQ(TailInputPosition(in), 100);
+
+    // A short read is not the end: the next read sees the appended data.
+    pthread_create(&thread, 0, append_later, &a);
+    start = now_ms();
+    n = TailInputRead(in, buf, sizeof(buf));
+    CHECK_EQ(n, 50);
+    CHECK(buf[0] == 2 && buf[49] == 2);
+    CHECK(now_ms() - start < IDLE_TIMEOUT_MS);
+    CHECK_EQ(TailInputPosition(in), 150);
+    pthread_join(thread, 0);
+
+    start = now_ms();
+    n = TailInputRead(in, buf, sizeof(buf));
+    CHECK_EQ(n, AVERROR_EOF);
+    CHECK(now_ms() - start >= IDLE_TIMEOUT_MS);
+    CHECK(now_ms() - start < IDLE_TIMEOUT_MS + 1000);
+    CHECK_EQ(TailInputPosition(in), 150);
+
+    FreeTailInput(in);
+}
+
+// Reads return at most the requested size; the rest stays for the next one.
+static void test_partial_read(const char* path) {
+    TailInput* in = NewTailInput(path, IDLE_TIMEOUT_MS, 20);
+    uint8_t buf[64];
+
+    CHECK(in != 0);
+    if (!in) {
+        return;
+    }
+
+    CHECK_EQ(TailInputRead(in, buf, sizeof(buf)), 64);
+    CHECK_EQ(TailInputRead(in, buf, sizeof(buf)), 36);
+    CHECK_EQ(TailInputPosition(in), 100);
+
+    FreeTailInput(in);
+}
+
+int main(void) {
+    char path[] = "/tmp/tail_input_testXXXXXX";
+    int fd = mkstemp(path);
+
+    if (fd < 0) {
+        fprintf(stderr, "Could not create a temporary file\n");
+        return 1;
+    }
+    close(fd);
+
+    append(path, 100, 1);
+    test_partial_read(path);
+    test_follow(path);
+
+    CHECK(NewTailInput("/nonexistent/tail_input_test", IDLE_TIMEOUT_MS, 50) == 0);
+
+    unlink(path);
+
+    if (failures) {
+        fprintf(stderr, "tail_input_test: %d failures\n", failures);
+    }
+
+    return failures != 0;
+}
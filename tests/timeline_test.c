@@ -0,0 +1,153 @@
+/*
+ * Copyright (c) 2014 veecr.
+ */
+
+#include "../timeline.h"
+#include "check.h"
+
+static const AVRational timeBases[] = {
+    { 1, 1 }, { 1, 25 }, { 1, 1000 }, { 1, 1024 }, { 1001, 30000 }, { 1, 19200 },
+    { 1, 44100 }, { 1, 48000 }, { 1, 65536 }, { 1, 90000 }, { 1, 1000000 },
+};
+
+static const int64_t values[] = {
+    0, 1, -1, 2, 3, 511, 512, 513, -512, -513, 1000, 1500, -1500, 44099, 44100,
+    1234567, -7654321, (int64_t)1 << 33, -((int64_t)1 << 33), (int64_t)1 << 40,
+    -((int64_t)1 << 40), (int64_t)1 << 52, -((int64_t)1 << 52),
+};
+
+// Every fast path must round like av_rescale_q_rnd, including halfway
+// values and negative timestamps.
+static void test_rescale(void) {
+    int n = sizeof(timeBases) / sizeof(timeBases[0]);
+    int i, j, k;
+
+    for (i = 0; i < n; i++) {
+        for (j = 0; j < n; j++) {
+            TimeRescaler r;
+
+            TimeRescalerInit(&r, timeBases[i], timeBases[j]);
+            for (k = 0; k < sizeof(values) / sizeof(values[0]); k++) {
+                int64_t expected = av_rescale_q_rnd(values[k], timeBases[i], timeBases[j],
+                                                    AV_ROUND_NEAR_INF|AV_ROUND_PASS_MINMAX);
+                int64_t got = TimeRescale(&r, values[k]);
+
+                if (got != expected) {
+                    fprintf(stderr, "%d/%d -> %d/%d, %lld: got %lld, expected %lld (mode %d)\n",
+                            timeBases[i].num, timeBases[i].den, timeBases[j].num, timeBases[j].den,
+                            (long long)values[k], (long long)got, (long long)expected, r.mode);
+                    failures++;
+                }
+            }
+
+            CHECK_EQ(TimeRescale(&r, INT64_MIN), INT64_MIN);
+            CHECK_EQ(TimeRescale(&r, INT64_MAX), INT64_MAX);
+        }
+    }
+}
+
+static void test_rescale_modes(void) {
+    TimeRescaler r;
+
+    TimeRescalerInit(&r, (AVRational){ 1, 90000 }, (AVRational){ 1, 90000 });
+    CHECK_EQ(r.mode, RESCALE_IDENTITY);
+    TimeRescalerInit(&r, (AVRational){ 1, 1000 }, (AVRational){ 1, 90000 });
+    CHECK_EQ(r.mode, RESCALE_MUL);
+    TimeRescalerInit(&r, (AVRational){ 1, 65536 }, (AVRational){ 1, 1024 });
+    CHECK_EQ(r.mode, RESCALE_SHIFT);
+    TimeRescalerInit(&r, (AVRational){ 1, 90000 }, (AVRational){ 1, 1000 });
+    CHECK_EQ(r.mode, RESCALE_DIV);
+    TimeRescalerInit(&r, (AVRational){ 1, 44100 }, (AVRational){ 1, 90000 });
+    CHECK_EQ(r.mode, RESCALE_GENERIC);
+
+    // Beyond the overflow limit the multiply falls back to av_rescale_rnd.
+    TimeRescalerInit(&r, (AVRational){ 1, 1 }, (AVRational){ 1, 90000 });
+    CHECK_EQ(TimeRescale(&r, INT64_MAX / 90000 + 1),
+             av_rescale_rnd(INT64_MAX / 90000 + 1, 90000, 1, AV_ROUND_NEAR_INF|AV_ROUND_PASS_MINMAX));
+}
+
+static void test_timeline_wrap(void) {
+    int64_t wrap = (int64_t)1 << 33;
+    int64_t pts, dts;
+    Timeline tl;
+
+    TimelineInit(&tl, 33, 0);
+
+    dts = wrap - 3000;
+    pts = dts + 3000;
+    TimelineMapPacket(&tl, &pts, &dts, 3000);
+    CHECK_EQ(dts, wrap - 3000);
+    CHECK_EQ(pts, wrap);
+
+    // The 33-bit counter wraps to 0: the output keeps counting past 2^33.
+    dts = 0;
+    pts = 3000;
+    TimelineMapPacket(&tl, &pts, &dts, 3000);
+    CHECK_EQ(dts, wrap);
+    CHECK_EQ(pts, wrap + 3000);
+
+    dts = 3000;
+    pts = AV_NOPTS_VALUE;
+    TimelineMapPacket(&tl, &pts, &dts, 3000);
+    CHECK_EQ(dts, wrap + 3000);
+    CHECK_EQ(pts, AV_NOPTS_VALUE);
+
+    // A packet without a dts only takes the current offset.
+    dts = AV_NOPTS_VALUE;
+    pts = 9000;
+    TimelineMapPacket(&tl, &pts, &dts, 3000);
+    CHECK_EQ(dts, AV_NOPTS_VALUE);
+    CHECK_EQ(pts, wrap + 9000);
+}
+
+static void test_timeline_splice(void) {
+    int64_t pts, dts;
+    Timeline tl;
+
+    TimelineInit(&tl, 0, 90000);
+
+    dts = pts = 5000;
+    TimelineMapPacket(&tl, &pts, &dts, 1000);
+
+    // Backwards jump: continues at the end of the previous packet.
+    dts = 0;
+    pts = 2000;
+    TimelineMapPacket(&tl, &pts, &dts, 1000);
+    CHECK_EQ(dts, 6000);
+    CHECK_EQ(pts, 8000);
+
+    // A jump within maxGap is kept.
+    dts = 50000;
+    pts = 50000;
+    TimelineMapPacket(&tl, &pts, &dts, 1000);
+    CHECK_EQ(dts, 56000);
+    CHECK_EQ(pts, 56000);
+
+    // One beyond maxGap is spliced.
+    dts = pts = 500000;
+    TimelineMapPacket(&tl, &pts, &dts, 1000);
+    CHECK_EQ(dts, 57000);
+    CHECK_EQ(pts, 57000);
+
+    // An explicit splice applies to the next packet only.
+    TimelineSplice(&tl);
+    dts = pts = 500500;
+    TimelineMapPacket(&tl, &pts, &dts, 1000);
+    CHECK_EQ(dts, 58000);
+    dts = pts = 501500;
+    TimelineMapPacket(&tl, &pts, &dts, 1000);
+    CHECK_EQ(dts, 59000);
+}
+
+int main(void) {
+    test_rescale();
+    test_rescale_modes();
+    test_timeline_wrap();
+    test_timeline_splice();
+
+    if (failures) {
+        fprintf(stderr, "timeline_test: %d failures\n", failures);
+    }
+
+    return failures != 0;
+}
@@ -0,0 +1,400 @@
+/*
+ * Copyright (c) 2014 veecr.
+ */
+
+#include "../ts_splice.h"
+#include "check.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define PKT 188
+#define MAX_PACKETS 64
+
+#define VIDEO_PID 0x100
+#define AUDIO_PID 0x101
+#define CLIP_VIDEO_PID 0x200
+#define CLIP_AUDIO_PID 0x201
+
+// Clip video DTS 5000, 8000, 11000: 9000 long with the last frame.
+#define CLIP_DURATION 9000
+#define SPLICE_DTS 102000
+
+typedef struct {
+    uint8_t data[MAX_PACKETS * PKT];
+    int count;
+    // Next continuity counter per PID.
+    int cc[0x2000];
+} Stream;
+
+typedef struct {
+    uint8_t data[4 * MAX_PACKETS * PKT];
+    int size;
+} Output;
+
+static int collect(void* opaque, uint8_t* buf, int size) {
+    Output* out = opaque;
+
+    memcpy(out->data + out->size, buf, size);
+    out->size += size;
+
+    return size;
+}
+
+static uint8_t* next_packet(Stream* s, int pid, int pusi, int adaptation) {
+    uint8_t* p = s->data + s->count++ * PKT;
+
+    memset(p, 0xaa, PKT);
+    p[0] = 0x47;
+    p[1] = (pusi ? 0x40 : 0) | (pid >> 8);
+    p[2] = pid & 0xff;
+    p[3] = (adaptation ? 0x30 : 0x10) | s->cc[pid];
+    s->cc[pid] = (s->cc[pid] + 1) & 0x0f;
+
+    return p;
+}
+
+static void put_timestamp(uint8_t* b, int prefix, int64_t ts) {
+    b[0] = (prefix << 4) | ((ts >> 29) & 0x0e) | 1;
+    b[1] = ts >> 22;
+    b[2] = ((ts >> 14) & 0xfe) | 1;
+    b[3] = ts >> 7;
+    b[4] = ((ts << 1) & 0xfe) | 1;
+}
+
+static void put_psi(Stream* s, int pid, const uint8_t* section, int size) {
+    uint8_t* p = next_packet(s, pid, 1, 0);
+
+    p[4] = 0;
+    memcpy(p + 5, section, size);
+    memset(p + 5 + size, 0xff, PKT - 5 - size);
+}
+
+// PAT for program 1 on PMT PID 0x1000, and a PMT with a video and an
+// optional audio stream; the PCR is on the video PID. CRCs are not checked.
+static void put_program(Stream* s, int videoPid, int audioPid, int audioType) {
+    uint8_t pat[] = { 0x00, 0xb0, 13, 0, 1, 0xc1, 0, 0, 0, 1, 0xf0, 0x00, 0, 0, 0, 0 };
+    uint8_t pmt[32] = { 0x02, 0xb0, 0, 0, 1, 0xc1, 0, 0, 0xe0 | (videoPid >> 8), videoPid & 0xff, 0xf0, 0 };
+    int n = 12;
+
+    put_psi(s, 0, pat, sizeof(pat));
+
+    pmt[n++] = 0x1b;
+    pmt[n++] = 0xe0 | (videoPid >> 8);
+    pmt[n++] = videoPid & 0xff;
+    pmt[n++] = 0xf0;
+    pmt[n++] = 0;
+    if (audioPid >= 0) {
+        pmt[n++] = audioType;
+        pmt[n++] = 0xe0 | (audioPid >> 8);
+        pmt[n++] = audioPid & 0xff;
+        pmt[n++] = 0xf0;
+        pmt[n++] = 0;
+    }
+    n += 4;
+    pmt[2] = n - 3;
+    put_psi(s, 0x1000, pmt, n);
+}
+
+// The first packet of a PES. Key frames carry the random access indicator
+// and a PCR 1000 ticks before their DTS. dts < 0 writes a PTS only.
+static void put_pes(Stream* s, int pid, int key, int64_t pts, int64_t dts) {
+    uint8_t* p = next_packet(s, pid, 1, key);
+    int h = 4;
+
+    if (key) {
+        int64_t pcr = dts - 1000;
+        p[4] = 7;
+        p[5] = 0x50;
+        p[6] = pcr >> 25;
+        p[7] = pcr >> 17;
+        p[8] = pcr >> 9;
+        p[9] = pcr >> 1;
+        p[10] = ((pcr & 1) << 7) | 0x7e;
+        p[11] = 0;
+        h = 12;
+    }
+
+    p[h] = 0;
+    p[h + 1] = 0;
+    p[h + 2] = 1;
+    p[h + 3] = pid == VIDEO_PID || pid == CLIP_VIDEO_PID ? 0xe0 : 0xc0;
+    p[h + 4] = 0;
+    p[h + 5] = 0;
+    p[h + 6] = 0x80;
+    if (dts >= 0) {
+        p[h + 7] = 0xc0;
+        p[h + 8] = 10;
+        put_timestamp(p + h + 9, 3, pts);
+        put_timestamp(p + h + 14, 1, dts);
+    } else {
+        p[h + 7] = 0x80;
+        p[h + 8] = 5;
+        put_timestamp(p + h + 9, 2, pts);
+    }
+}
+
+static void put_video(Stream* s, int pid, int key, int64_t dts) {
+    put_pes(s, pid, key, dts, dts);
+}
+
+static void put_audio(Stream* s, int pid, int64_t pts) {
+    put_pes(s, pid, 0, pts, -1);
+}
+
+// A PES continuation packet.
+static void put_payload(Stream* s, int pid) {
+    next_packet(s, pid, 0, 0);
+}
+
+static void build_clip(Stream* clip, int audioType) {
+    memset(clip, 0, sizeof(Stream));
+    // The clip's own counters start anywhere.
+    clip->cc[CLIP_VIDEO_PID] = 7;
+    clip->cc[CLIP_AUDIO_PID] = 12;
+
+    put_program(clip, CLIP_VIDEO_PID, CLIP_AUDIO_PID, audioType);
+    put_video(clip, CLIP_VIDEO_PID, 1, 5000);
+    put_audio(clip, CLIP_AUDIO_PID, 5000);
+    put_video(clip, CLIP_VIDEO_PID, 0, 8000);
+    put_audio(clip, CLIP_AUDIO_PID, 7000);
+    put_video(clip, CLIP_VIDEO_PID, 0, 11000);
+}
+
+// Main packets up to the splice point. The audio PES at 100000 is still in
+// progress at the key frame.
+static void build_main_head(Stream* main) {
+    memset(main, 0, sizeof(Stream));
+    put_program(main, VIDEO_PID, AUDIO_PID, 0x0f);
+    put_video(main, VIDEO_PID, 1, 90000);
+    put_audio(main, AUDIO_PID, 90000);
+    put_video(main, VIDEO_PID, 0, 93000);
+    put_audio(main, AUDIO_PID, 92000);
+    put_video(main, VIDEO_PID, 0, 96000);
+    put_video(main, VIDEO_PID, 0, 99000);
+    put_audio(main, AUDIO_PID, 100000);
+}
+
+// After the splice point: the rest of that audio PES and a late one from
+// before the key frame, then audio after it.
+static void build_main_tail(Stream* main) {
+    put_video(main, VIDEO_PID, 1, SPLICE_DTS);
+    put_payload(main, AUDIO_PID);
+    put_audio(main, AUDIO_PID, 101500);
+    put_video(main, VIDEO_PID, 0, 105000);
+    put_audio(main, AUDIO_PID, 103000);
+    put_payload(main, AUDIO_PID);
+    put_video(main, VIDEO_PID, 0, 108000);
+}
+
+static int64_t read_timestamp(const uint8_t* b) {
+    return ((int64_t)(b[0] & 0x0e) << 29) | (b[1] << 22) | ((b[2] & 0xfe) << 14) | (b[3] << 7) | (b[4] >> 1);
+}
+
+// What a packet carries, as checked below.
+typedef struct {
+    int pid;
+    int discontinuity;
+    int64_t pcr;
+    int64_t pts;
+    int64_t dts;
+} PacketInfo;
+
+static PacketInfo describe(const uint8_t* p) {
+    PacketInfo info = { ((p[1] & 0x1f) << 8) | p[2], 0, -1, -1, -1 };
+    int offset = 4;
+
+    if ((p[3] & 0x20) && p[4] > 0) {
+        info.discontinuity = (p[5] & 0x80) != 0;
+        if (p[5] & 0x10) {
+            info.pcr = ((int64_t)p[6] << 25) | (p[7] << 17) | (p[8] << 9) | (p[9] << 1) | (p[10] >> 7);
+        }
+    }
+    if (p[3] & 0x20) {
+        offset += 1 + p[4];
+    }
+    if ((p[1] & 0x40) && (p[3] & 0x10) && info.pid != 0 && info.pid != 0x1000 && !memcmp(p + offset, "\0\0\1", 3)) {
+        info.pts = read_timestamp(p + offset + 9);
+        info.dts = p[offset + 7] & 0x40 ? read_timestamp(p + offset + 14) : info.pts;
+    }
+
+    return info;
+}
+
+// Counters go up by one per packet with payload on every PID, across the
+// clip and main stream, and stay put on adaptation-only packets.
+static void check_continuity(const Output* out) {
+    int cc[0x2000];
+    int i;
+
+    memset(cc, -1, sizeof(cc));
+    for (i = 0; i < out->size; i += PKT) {
+        const uint8_t* p = out->data + i;
+        int pid = ((p[1] & 0x1f) << 8) | p[2];
+        int expected = cc[pid] < 0 ? p[3] & 0x0f : (p[3] & 0x10) ? (cc[pid] + 1) & 0x0f : cc[pid];
+
+        CHECK(p[0] == 0x47);
+        if ((p[3] & 0x0f) != expected) {
+            fprintf(stderr, "Packet %d on PID %#x has counter %d, expected %d\n", i / PKT, pid, p[3] & 0x0f, expected);
+            failures++;
+        }
+        cc[pid] = p[3] & 0x0f;
+    }
+}
+
+static void write_in_chunks(TsSplicer* sp, const uint8_t* buf, int size, int chunk) {
+    int n;
+
+    for (; size > 0; buf += n, size -= n) {
+        n = size < chunk ? size : chunk;
+        CHECK_EQ(TsSplicerWriteMain(sp, buf, n), 0);
+    }
+}
+
+static void test_splice(void) {
+    static Stream main, clip;
+    static Output out;
+    // pid, discontinuity, pcr, pts, dts in output order.
+    static const PacketInfo expected[] = {
+        { 0, 0, -1, -1, -1 },
+        { 0x1000, 0, -1, -1, -1 },
+        { VIDEO_PID, 0, 89000, 90000, 90000 },
+        { AUDIO_PID, 0, -1, 90000, 90000 },
+        { VIDEO_PID, 0, -1, 93000, 93000 },
+        { AUDIO_PID, 0, -1, 92000, 92000 },
+        { VIDEO_PID, 0, -1, 96000, 96000 },
+        { VIDEO_PID, 0, -1, 99000, 99000 },
+        { AUDIO_PID, 0, -1, 100000, 100000 },
+        // Clip video, moved to start at 102000.
+        { VIDEO_PID, 1, -1, -1, -1 },
+        { VIDEO_PID, 0, 101000, 102000, 102000 },
+        { VIDEO_PID, 0, -1, 105000, 105000 },
+        { VIDEO_PID, 0, -1, 108000, 108000 },
+        { VIDEO_PID, 1, -1, -1, -1 },
+        { VIDEO_PID, 0, 101000 + CLIP_DURATION, SPLICE_DTS + CLIP_DURATION, SPLICE_DTS + CLIP_DURATION },
+        // The audio PES in progress, and late audio from before the splice.
+        { AUDIO_PID, 0, -1, -1, -1 },
+        { AUDIO_PID, 0, -1, 101500, 101500 },
+        { VIDEO_PID, 0, -1, 105000 + CLIP_DURATION, 105000 + CLIP_DURATION },
+        // Clip audio, before the first main audio at or after the splice.
+        { AUDIO_PID, 1, -1, -1, -1 },
+        { AUDIO_PID, 0, -1, 102000, 102000 },
+        { AUDIO_PID, 0, -1, 104000, 104000 },
+        { AUDIO_PID, 1, -1, -1, -1 },
+        { AUDIO_PID, 0, -1, 103000 + CLIP_DURATION, 103000 + CLIP_DURATION },
+        { AUDIO_PID, 0, -1, -1, -1 },
+        { VIDEO_PID, 0, -1, 108000 + CLIP_DURATION, 108000 + CLIP_DURATION },
+    };
+    TsSplicer* sp = NewTsSplicer(&out, collect);
+    int i, n;
+
+    build_clip(&clip, 0x0f);
+    build_main_head(&main);
+    n = main.count;
+    build_main_tail(&main);
+
+    out.size = 0;
+    write_in_chunks(sp, main.data, n * PKT, 100);
+    CHECK_EQ(TsSplicerInsertClip(sp, clip.data, clip.count * PKT), 0);
+    CHECK_EQ(TsSplicerInsertClip(sp, clip.data, clip.count * PKT), -1);
+    write_in_chunks(sp, main.data + n * PKT, (main.count - n) * PKT, 500);
+    CHECK_EQ(TsSplicerFlush(sp), 0);
+
+    CHECK_EQ(out.size, (int)(sizeof(expected) / sizeof(expected[0])) * PKT);
+    for (i = 0; i < out.size / PKT && i < (int)(sizeof(expected) / sizeof(expected[0])); i++) {
+        PacketInfo got = describe(out.data + i * PKT);
+        const PacketInfo* e = &expected[i];
+        if (got.pid != e->pid || got.discontinuity != e->discontinuity || got.pcr != e->pcr ||
+            got.pts != e->pts || got.dts != e->dts) {
+            fprintf(stderr, "Packet %d: pid %#x disc %d pcr %lld pts %lld dts %lld, expected pid %#x disc %d pcr %lld pts %lld dts %lld\n",
+                    i, got.pid, got.discontinuity, (long long)got.pcr, (long long)got.pts, (long long)got.dts,
+                    e->pid, e->discontinuity, (long long)e->pcr, (long long)e->pts, (long long)e->dts);
+            failures++;
+        }
+    }
+    check_continuity(&out);
+
+    // The splice is done, so another clip can be queued.
+    CHECK_EQ(TsSplicerInsertClip(sp, clip.data, clip.count * PKT), 0);
+
+    FreeTsSplicer(sp);
+}
+
+// Without a key frame the clip waits and the main stream passes through
+// unchanged.
+static void test_no_key_frame(void) {
+    static Stream main, clip;
+    static Output out;
+    TsSplicer* sp = NewTsSplicer(&out, collect);
+    int n;
+
+    build_clip(&clip, 0x0f);
+    build_main_head(&main);
+    n = main.count;
+    put_video(&main, VIDEO_PID, 0, SPLICE_DTS);
+    put_payload(&main, AUDIO_PID);
+    put_audio(&main, AUDIO_PID, 103000);
+    put_video(&main, VIDEO_PID, 0, 105000);
+
+    out.size = 0;
+    write_in_chunks(sp, main.data, n * PKT, 188);
+    CHECK_EQ(TsSplicerInsertClip(sp, clip.data, clip.count * PKT), 0);
+    write_in_chunks(sp, main.data + n * PKT, (main.count - n) * PKT, 37);
+    CHECK_EQ(TsSplicerFlush(sp), 0);
+
+    CHECK_EQ(out.size, main.count * PKT);
+    CHECK(!memcmp(out.data, main.data, main.count * PKT));
+    CHECK_EQ(TsSplicerInsertClip(sp, clip.data, clip.count * PKT), -1);
+
+    FreeTsSplicer(sp);
+}
+
+static void test_rejected_clips(void) {
+    static Stream main, clip;
+    static Output out;
+    TsSplicer* sp = NewTsSplicer(&out, collect);
+
+    // No video timestamps.
+    memset(&clip, 0, sizeof(clip));
+    put_program(&clip, CLIP_VIDEO_PID, CLIP_AUDIO_PID, 0x0f);
+    put_audio(&clip, CLIP_AUDIO_PID, 5000);
+    CHECK_EQ(TsSplicerInsertClip(sp, clip.data, clip.count * PKT), -1);
+    CHECK_EQ(TsSplicerInsertClip(sp, clip.data, PKT + 1), -1);
+
+    // AC-3 audio in the clip, AAC in the main program. Before the main PMT
+    // is seen the clip is only checked at the splice point.
+    build_clip(&clip, 0x81);
+    CHECK_EQ(TsSplicerInsertClip(sp, clip.data, clip.count * PKT), 0);
+
+    build_main_head(&main);
+    build_main_tail(&main);
+    out.size = 0;
+    // PAT and PMT, then the rest from the first key frame on, where the clip
+    // is dropped and the main stream goes on unchanged.
+    CHECK_EQ(TsSplicerWriteMain(sp, main.data, 2 * PKT), 0);
+    CHECK_EQ(TsSplicerWriteMain(sp, main.data + 2 * PKT, (main.count - 2) * PKT), -1);
+    CHECK_EQ(TsSplicerFlush(sp), 0);
+    CHECK_EQ(out.size, main.count * PKT);
+    CHECK(!memcmp(out.data, main.data, main.count * PKT));
+
+    // Once the main PMT is known the clip is refused up front, as is one
+    // without the main program's audio.
+    CHECK_EQ(TsSplicerInsertClip(sp, clip.data, clip.count * PKT), -1);
+    memset(&clip, 0, sizeof(clip));
+    put_program(&clip, CLIP_VIDEO_PID, -1, 0);
+    put_video(&clip, CLIP_VIDEO_PID, 1, 5000);
+    CHECK_EQ(TsSplicerInsertClip(sp, clip.data, clip.count * PKT), -1);
+
+    FreeTsSplicer(sp);
+}
+
+int main(void) {
+    test_splice();
+    test_no_key_frame();
+    test_rejected_clips();
+
+    if (failures) {
+        fprintf(stderr, "ts_splice_test: %d failures\n", failures);
+    }
+
+    return failures != 0;
+}
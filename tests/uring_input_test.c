@@ -0,0 +1,128 @@
+/*
+ * Copyright (c) 2014 veecr.
+ */
+
+#include "../uring_input.h"
+#include "check.h"
+#include <libavformat/avformat.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define FILE_SIZE (3 * 1024 * 1024 + 123)
+#define BLOCK_SIZE 4096
+
+static uint8_t* make_file(const char* path) {
+    uint8_t* data = malloc(FILE_SIZE);
+    FILE* f = fopen(path, "wb");
+    int i;
+
+    if (!data || !f) {
+        fprintf(stderr, "Could not create %s\n", path);
+        exit(1);
+    }
+    srand(1);
+    for (i = 0; i < FILE_SIZE; i++) {
+        data[i] = rand();
+    }
+    if (fwrite(data, 1, FILE_SIZE, f) != FILE_SIZE) {
+        fprintf(stderr, "Could not write %s\n", path);
+        exit(1);
+    }
+    fclose(f);
+
+    return data;
+}
+
+// Reads straight through in chunks that straddle block boundaries.
+static void test_sequential(UringInput* in, const uint8_t* data) {
+    uint8_t* buf = malloc(FILE_SIZE);
+    int64_t got = 0;
+    int n;
+
+    CHECK_EQ(UringInputSeek(in, 0, SEEK_SET), 0);
+    while ((n = UringInputRead(in, buf + got, 3000)) > 0) {
+        got += n;
+    }
+    CHECK_EQ(n, 0);
+    CHECK_EQ(got, FILE_SIZE);
+    CHECK(!memcmp(buf, data, FILE_SIZE));
+    free(buf);
+}
+
+// Random seeks, with hinted ranges scattered over the file so that
+// read-ahead follows them instead of the read position.
+static void test_random(UringInput* in, const uint8_t* data) {
+    uint8_t buf[9000];
+    int i;
+
+    for (i = 0; i < 64; i++) {
+        UringInputHint(in, rand() % FILE_SIZE, 1 + rand() % 20000);
+    }
+
+    for (i = 0; i < 2000; i++) {
+        int64_t offset = rand() % FILE_SIZE;
+        int size = 1 + rand() % (int)sizeof(buf);
+        int n;
+
+        CHECK_EQ(UringInputSeek(in, offset, SEEK_SET), offset);
+        n = UringInputRead(in, buf, size);
+        if (n <= 0 || n > size || memcmp(buf, data + offset, n)) {
+            fprintf(stderr, "read of %d at %lld returned %d\n", size, (long long)offset, n);
+            failures++;
+            return;
+        }
+    }
+}
+
+static void test_seek(UringInput* in, const uint8_t* data) {
+    uint8_t buf[16];
+
+    CHECK_EQ(UringInputSeek(in, 0, AVSEEK_SIZE), FILE_SIZE);
+    CHECK_EQ(UringInputSeek(in, -10, SEEK_END), FILE_SIZE - 10);
+    CHECK_EQ(UringInputRead(in, buf, sizeof(buf)), 10);
+    CHECK(!memcmp(buf, data + FILE_SIZE - 10, 10));
+    CHECK_EQ(UringInputRead(in, buf, sizeof(buf)), 0);
+
+    CHECK_EQ(UringInputSeek(in, BLOCK_SIZE - 4, SEEK_SET), BLOCK_SIZE - 4);
+    CHECK_EQ(UringInputSeek(in, 2, SEEK_CUR), BLOCK_SIZE - 2);
+    CHECK(UringInputSeek(in, -1, SEEK_SET) < 0);
+}
+
+int main(void) {
+    char path[] = "/tmp/uring_input_testXXXXXX";
+    int fd = mkstemp(path);
+    UringInput* in;
+    uint8_t* data;
+
+    if (fd < 0) {
+        fprintf(stderr, "Could not create a temporary file\n");
+        return 1;
+    }
+    close(fd);
+    data = make_file(path);
+
+    in = NewUringInput(path, BLOCK_SIZE, 4);
+    if (!in) {
+        // Old kernels and some sandboxes have no io_uring.
+        printf("uring_input_test: io_uring unavailable, skipped\n");
+        unlink(path);
+        free(data);
+        return 0;
+    }
+
+    test_sequential(in, data);
+    test_random(in, data);
+    test_seek(in, data);
+    test_sequential(in, data);
+
+    FreeUringInput(in);
+    unlink(path);
+    free(data);
+
+    if (failures) {
+        fprintf(stderr, "uring_input_test: %d failures\n", failures);
+    }
+
+    return failures != 0;
+}
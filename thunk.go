@@ -1,7 +1,18 @@
 package grune
 
+// #include <stdint.h>
 import "C"
-import "unsafe"
+import (
+	"io"
+	"runtime/cgo"
+	"unsafe"
+)
+
+// libavformat seek flags.
+const (
+	avseekSize  = 0x10000
+	avseekForce = 0x20000
+)
 
 func ByteSliceToCArray(byteSlice []byte, array unsafe.Pointer, size int) {
 	var arrayptr = uintptr(array)
@@ -12,21 +23,48 @@ func ByteSliceToCArray(byteSlice []byte, array unsafe.Pointer, size int) {
 	}
 }
 
+// The opaque pointers are cgo.Handles created by newOpaque. The C buffers
+// are only valid for the duration of the call and io.Reader/io.Writer
+// implementations must not retain them.
+
 //export WriteFunction
-func WriteFunction(opaque unsafe.Pointer, buf unsafe.Pointer, num int) {
-	ctx := (*WriterContext)(opaque)
-	bytes := C.GoBytes(buf, C.int(num))
-	ctx.w.Write(bytes)
+func WriteFunction(opaque C.uintptr_t, buf unsafe.Pointer, num C.int) {
+	ctx := cgo.Handle(opaque).Value().(*WriterContext)
+	ctx.w.Write(unsafe.Slice((*byte)(buf), int(num)))
 }
 
 //export ReadFunction
-func ReadFunction(opaque unsafe.Pointer, buf unsafe.Pointer, size int) int {
-	ctx := (*ReaderContext)(opaque)
-	b := make([]byte, size)
-	n, err := ctx.r.Read(b)
-	if err != nil {
+func ReadFunction(opaque C.uintptr_t, buf unsafe.Pointer, size C.int) C.int {
+	ctx := cgo.Handle(opaque).Value().(*ReaderContext)
+	n, err := ctx.r.Read(unsafe.Slice((*byte)(buf), int(size)))
+	if n == 0 && err != nil {
 		return 0
 	}
-	ByteSliceToCArray(b, buf, n)
-	return n
+	return C.int(n)
+}
+
+//export SeekFunction
+func SeekFunction(opaque C.uintptr_t, to C.int64_t, whence C.int) C.int64_t {
+	ctx := cgo.Handle(opaque).Value().(*ReaderContext)
+	seeker, ok := ctx.r.(io.Seeker)
+	if !ok || whence&avseekSize != 0 {
+		return -1
+	}
+	pos, err := seeker.Seek(int64(to), int(whence&^avseekForce))
+	if err != nil {
+		return -1
+	}
+	return C.int64_t(pos)
+}
+
+//export KeyFunction
+func KeyFunction(opaque C.uintptr_t, segment C.int64_t, key unsafe.Pointer, iv unsafe.Pointer) C.int {
+	ctx := cgo.Handle(opaque).Value().(*KeyContext)
+	k, v, err := ctx.keys(int64(segment))
+	if err != nil {
+		return -1
+	}
+	copy(unsafe.Slice((*byte)(key), len(k)), k[:])
+	copy(unsafe.Slice((*byte)(iv), len(v)), v[:])
+	return 0
 }
@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2014 veecr.
+ */
+
+#include "timeline.h"
+
+void TimeRescalerInit(TimeRescaler* r, AVRational from, AVRational to) {
+    int64_t num = (int64_t)from.num * to.den;
+    int64_t den = (int64_t)from.den * to.num;
+    int64_t gcd = av_gcd(num, den);
+
+    memset(r, 0, sizeof(TimeRescaler));
+
+    num /= gcd;
+    den /= gcd;
+    r->mul = num;
+    r->div = den;
+
+    if (num == den) {
+        r->mode = RESCALE_IDENTITY;
+    } else if (den == 1) {
+        r->mode = RESCALE_MUL;
+        r->limit = INT64_MAX / num;
+    } else if (num == 1 && (den & (den - 1)) == 0) {
+        r->mode = RESCALE_SHIFT;
+        while (((int64_t)1 << r->shift) < den) {
+            r->shift++;
+        }
+    } else if (num == 1) {
+        r->mode = RESCALE_DIV;
+    } else {
+        r->mode = RESCALE_GENERIC;
+        r->limit = (INT64_MAX - den / 2) / num;
+    }
+}
+
+int64_t TimeRescaleGeneric(const TimeRescaler* r, int64_t ts) {
+    // Stay in 64 bits while ts * mul cannot overflow.
+    if (r->mode == RESCALE_GENERIC && ts <= r->limit && ts >= -r->limit) {
+        return ts >= 0 ? (ts * r->mul + r->div / 2) / r->div
+                       : -((-ts * r->mul + r->div / 2) / r->div);
+    }
+    return av_rescale_rnd(ts, r->mul, r->div, AV_ROUND_NEAR_INF|AV_ROUND_PASS_MINMAX);
+}
+
+void TimelineInit(Timeline* tl, int wrapBits, int64_t maxGap) {
+    tl->offset = 0;
+    tl->last = AV_NOPTS_VALUE;
+    tl->lastDuration = 0;
+    tl->wrap = wrapBits > 0 ? (int64_t)1 << wrapBits : 0;
+    tl->maxGap = maxGap;
+    tl->splice = 0;
+}
+
+// Appends the next packet to the end of the timeline regardless of its
+// timestamp, e.g. at the start of the next input of a concatenation.
+void TimelineSplice(Timeline* tl) {
+    tl->splice = 1;
+}
+
+void TimelineMapPacket(Timeline* tl, int64_t* pts, int64_t* dts, int64_t duration) {
+    int64_t out, delta;
+
+    if (*dts == AV_NOPTS_VALUE) {
+        if (*pts != AV_NOPTS_VALUE) {
+            *pts += tl->offset;
+        }
+        return;
+    }
+
+    out = *dts + tl->offset;
+
+    if (tl->last != AV_NOPTS_VALUE) {
+        // Counter wrapped: the new timestamp is far behind the previous one.
+        if (tl->wrap && tl->last - out > tl->wrap / 2) {
+            tl->offset += tl->wrap;
+            out += tl->wrap;
+        }
+
+        delta = out - tl->last;
+        if (tl->splice || delta < 0 || (tl->maxGap > 0 && delta > tl->maxGap)) {
+            tl->offset += tl->last + tl->lastDuration - out;
+            out = tl->last + tl->lastDuration;
+        }
+    }
+
+    *dts = out;
+    if (*pts != AV_NOPTS_VALUE) {
+        *pts += tl->offset;
+    }
+
+    tl->last = out;
+    tl->lastDuration = duration;
+    tl->splice = 0;
+}
@@ -0,0 +1,71 @@
+#ifndef TIMELINE_H
+#define TIMELINE_H
+
+#include <stdint.h>
+#include <libavutil/avutil.h>
+#include <libavutil/rational.h>
+#include <libavutil/mathematics.h>
+
+enum {
+    RESCALE_IDENTITY,
+    RESCALE_MUL,
+    RESCALE_SHIFT,
+    RESCALE_DIV,
+    RESCALE_GENERIC
+};
+
+// Precomputed conversion between two time bases. Equivalent to
+// av_rescale_q_rnd(ts, from, to, AV_ROUND_NEAR_INF|AV_ROUND_PASS_MINMAX), but
+// reduces to a multiply, shift or divide when one time base divides the other.
+typedef struct _TimeRescaler {
+    int mode;
+    int shift;
+    int64_t mul;
+    int64_t div;
+    int64_t limit;
+} TimeRescaler;
+
+// A 64-bit monotonic output timeline. Incoming timestamps are unwrapped
+// (when wrapBits is non-zero) and jumps backwards or further than maxGap
+// are spliced onto the end of the previous packet.
+typedef struct _Timeline {
+    int64_t offset;
+    int64_t last;
+    int64_t lastDuration;
+    int64_t wrap;
+    int64_t maxGap;
+    int splice;
+} Timeline;
+
+void TimeRescalerInit(TimeRescaler* r, AVRational from, AVRational to);
+int64_t TimeRescaleGeneric(const TimeRescaler* r, int64_t ts);
+
+static inline int64_t TimeRescale(const TimeRescaler* r, int64_t ts) {
+    if (ts == INT64_MIN || ts == INT64_MAX) {
+        return ts;
+    }
+
+    switch (r->mode) {
+    case RESCALE_IDENTITY:
+        return ts;
+    case RESCALE_MUL:
+        if (ts <= r->limit && ts >= -r->limit) {
+            return ts * r->mul;
+        }
+        break;
+    case RESCALE_SHIFT:
+        return ts >= 0 ? (ts + (r->div >> 1)) >> r->shift
+                       : -((-ts + (r->div >> 1)) >> r->shift);
+    case RESCALE_DIV:
+        return ts >= 0 ? (ts + (r->div >> 1)) / r->div
+                       : -((-ts + (r->div >> 1)) / r->div);
+    }
+
+    return TimeRescaleGeneric(r, ts);
+}
+
+void TimelineInit(Timeline* tl, int wrapBits, int64_t maxGap);
+void TimelineSplice(Timeline* tl);
+void TimelineMapPacket(Timeline* tl, int64_t* pts, int64_t* dts, int64_t duration);
+
+#endif
@@ -0,0 +1,695 @@
+/*
+ * Copyright (c) 2014 veecr.
+ */
+
+#include "ts_splice.h"
+#include <stdio.h>
+#include <string.h>
+#include <libavutil/mem.h>
+
+#define TS_PACKET_SIZE 188
+#define TS_SYNC_BYTE 0x47
+#define TS_MAX_PIDS 8192
+#define TS_NULL_PID 0x1fff
+#define TS_OUTPUT_PACKETS 348  // ~64 KiB per write
+#define TS_TIMESTAMP_MASK ((INT64_C(1) << 33) - 1)
+
+typedef struct {
+    int pmtPid;
+    int pcrPid;
+    int videoPid;
+    int videoType;
+    int audioPid;
+    int audioType;
+} TsProgram;
+
+typedef struct {
+    uint8_t* data;
+    int size;
+    TsProgram program;
+    int64_t firstDts;
+    int64_t duration;
+    // Added to the clip timestamps once the splice point is known.
+    int64_t offset;
+} TsClip;
+
+enum {
+    CLIP_NONE,
+    // Waiting for a main video key frame.
+    CLIP_QUEUED,
+    // Video spliced, waiting for the next main audio PES at or after the
+    // splice point.
+    CLIP_AUDIO,
+};
+
+struct _TsSplicer {
+    void* wopaque;
+    BufferCallback writeFunction;
+
+    uint8_t partial[TS_PACKET_SIZE];
+    int partialSize;
+
+    TsProgram main;
+    // Main timestamps at or after spliceDts, the input DTS of the last
+    // splice point, are shifted by mainOffset and earlier ones by prevOffset.
+    int64_t mainOffset;
+    int64_t prevOffset;
+    int64_t spliceDts;
+
+    // Output continuity counter per PID, -1 until the PID is first seen.
+    int8_t cc[TS_MAX_PIDS];
+
+    TsClip clip;
+    int clipState;
+    // Set when a clip is dropped at the splice point; reported by
+    // TsSplicerWriteMain.
+    int clipRejected;
+
+    uint8_t out[TS_OUTPUT_PACKETS * TS_PACKET_SIZE];
+    int outSize;
+};
+
+static int ts_pid(const uint8_t* p) {
+    return ((p[1] & 0x1f) << 8) | p[2];
+}
+
+static int ts_has_adaptation(const uint8_t* p) {
+    return (p[3] & 0x20) && p[4] > 0;
+}
+
+static int ts_has_pcr(const uint8_t* p) {
+    return ts_has_adaptation(p) && (p[5] & 0x10) && p[4] >= 7;
+}
+
+static int ts_payload_offset(const uint8_t* p) {
+    int offset = 4;
+
+    if (!(p[3] & 0x10)) {
+        return -1;
+    }
+    if (p[3] & 0x20) {
+        offset += 1 + p[4];
+    }
+
+    return offset < TS_PACKET_SIZE ? offset : -1;
+}
+
+static int is_video_type(int streamType) {
+    return streamType == 0x01 || streamType == 0x02 || streamType == 0x1b || streamType == 0x24;
+}
+
+static int is_audio_type(int streamType) {
+    return streamType == 0x03 || streamType == 0x04 || streamType == 0x0f || streamType == 0x11 ||
+           streamType == 0x81;
+}
+
+// Parses a PAT or PMT section that starts in this packet. Sections spanning
+// several packets are not expected for the single program streams handled
+// here.
+static void parse_psi(TsProgram* prog, const uint8_t* p) {
+    int pid = ts_pid(p);
+    int offset = ts_payload_offset(p);
+    int sectionLength, end;
+    const uint8_t* s;
+
+    if (!(p[1] & 0x40) || offset < 0) {
+        return;
+    }
+
+    offset += 1 + p[offset];  // pointer_field
+    if (offset + 12 > TS_PACKET_SIZE) {
+        return;
+    }
+
+    s = p + offset;
+    sectionLength = ((s[1] & 0x0f) << 8) | s[2];
+    end = offset + 3 + sectionLength - 4;  // excluding CRC
+    if (end > TS_PACKET_SIZE) {
+        end = TS_PACKET_SIZE;
+    }
+
+    if (pid == 0 && s[0] == 0x00) {
+        int i;
+        for (i = offset + 8; i + 4 <= end; i += 4) {
+            int program = (p[i] << 8) | p[i + 1];
+            if (program != 0) {
+                prog->pmtPid = ((p[i + 2] & 0x1f) << 8) | p[i + 3];
+                break;
+            }
+        }
+    } else if (pid == prog->pmtPid && s[0] == 0x02) {
+        int i = offset + 12 + (((s[10] & 0x0f) << 8) | s[11]);
+
+        prog->pcrPid = ((s[8] & 0x1f) << 8) | s[9];
+        while (i + 5 <= end) {
+            int streamType = p[i];
+            int esPid = ((p[i + 1] & 0x1f) << 8) | p[i + 2];
+
+            if (is_video_type(streamType) && prog->videoPid < 0) {
+                prog->videoPid = esPid;
+                prog->videoType = streamType;
+            } else if (is_audio_type(streamType) && prog->audioPid < 0) {
+                prog->audioPid = esPid;
+                prog->audioType = streamType;
+            }
+            i += 5 + (((p[i + 3] & 0x0f) << 8) | p[i + 4]);
+        }
+    }
+}
+
+static void init_program(TsProgram* prog) {
+    prog->pmtPid = -1;
+    prog->pcrPid = -1;
+    prog->videoPid = -1;
+    prog->videoType = -1;
+    prog->audioPid = -1;
+    prog->audioType = -1;
+}
+
+static int64_t read_timestamp(const uint8_t* b) {
+    return ((int64_t)(b[0] & 0x0e) << 29) | (b[1] << 22) | ((b[2] & 0xfe) << 14) | (b[3] << 7) |
+           (b[4] >> 1);
+}
+
+static void write_timestamp(uint8_t* b, int64_t ts) {
+    b[0] = (b[0] & 0xf1) | ((ts >> 29) & 0x0e);
+    b[1] = ts >> 22;
+    b[2] = ((ts >> 14) & 0xfe) | 0x01;
+    b[3] = ts >> 7;
+    b[4] = ((ts << 1) & 0xfe) | 0x01;
+}
+
+// Returns the offset of the PES header of a payload unit start, or -1.
+static int pes_header(const uint8_t* p) {
+    int offset = ts_payload_offset(p);
+
+    if (!(p[1] & 0x40) || offset < 0 || offset + 14 > TS_PACKET_SIZE) {
+        return -1;
+    }
+    if (p[offset] != 0 || p[offset + 1] != 0 || p[offset + 2] != 1) {
+        return -1;
+    }
+    // Stream ids without the optional PES header.
+    switch (p[offset + 3]) {
+        case 0xbc: case 0xbe: case 0xbf: case 0xf0: case 0xf1: case 0xf2: case 0xf8: case 0xff:
+            return -1;
+    }
+
+    return offset;
+}
+
+// Decoding timestamp of the PES starting in this packet, or -1.
+static int64_t pes_dts(const uint8_t* p) {
+    int h = pes_header(p);
+    int flags;
+
+    if (h < 0) {
+        return -1;
+    }
+
+    flags = p[h + 7] >> 6;
+    if (flags == 3 && h + 19 <= TS_PACKET_SIZE) {
+        return read_timestamp(p + h + 14);
+    }
+    if (flags & 2) {
+        return read_timestamp(p + h + 9);
+    }
+
+    return -1;
+}
+
+static void shift_pcr(uint8_t* p, int64_t offset) {
+    uint8_t* pcr = p + 6;
+    int64_t base;
+
+    if (offset == 0 || !ts_has_pcr(p)) {
+        return;
+    }
+
+    base = ((int64_t)pcr[0] << 25) | (pcr[1] << 17) | (pcr[2] << 9) | (pcr[3] << 1) | (pcr[4] >> 7);
+    base = (base + offset) & TS_TIMESTAMP_MASK;
+    pcr[0] = base >> 25;
+    pcr[1] = base >> 17;
+    pcr[2] = base >> 9;
+    pcr[3] = base >> 1;
+    pcr[4] = ((base & 1) << 7) | (pcr[4] & 0x7f);
+}
+
+static void shift_pes(uint8_t* p, int64_t offset) {
+    int h = pes_header(p);
+    int flags;
+
+    if (offset == 0 || h < 0) {
+        return;
+    }
+
+    flags = p[h + 7] >> 6;
+    if (flags & 2) {
+        write_timestamp(p + h + 9, (read_timestamp(p + h + 9) + offset) & TS_TIMESTAMP_MASK);
+    }
+    if (flags == 3 && h + 19 <= TS_PACKET_SIZE) {
+        write_timestamp(p + h + 14, (read_timestamp(p + h + 14) + offset) & TS_TIMESTAMP_MASK);
+    }
+}
+
+// Drops the PCR from the adaptation field, moving the fields after it up
+// and stuffing the end.
+static void strip_pcr(uint8_t* p) {
+    uint8_t* end = p + 5 + p[4];
+
+    memmove(p + 6, p + 12, end - (p + 12));
+    memset(end - 6, 0xff, 6);
+    p[5] &= ~0x10;
+}
+
+// Whether the start code prefix at p opens a random access point: an IDR or
+// SPS for H.264, an IRAP picture or VPS/SPS for HEVC, a sequence header for
+// MPEG-2 video.
+static int is_random_access_unit(const uint8_t* p, int streamType) {
+    int type;
+
+    switch (streamType) {
+    case 0x1b:
+        type = p[3] & 0x1f;
+        return type == 5 || type == 7;
+    case 0x24:
+        type = (p[3] >> 1) & 0x3f;
+        return (type >= 16 && type <= 23) || type == 32 || type == 33;
+    default:
+        return p[3] == 0xb3;
+    }
+}
+
+// Looks for a random access point: the adaptation field flag first, then a
+// random access unit in the first packet of the PES.
+static int is_key_frame(const uint8_t* p, int streamType) {
+    int h, i;
+
+    if (ts_has_adaptation(p) && (p[5] & 0x40)) {
+        return 1;
+    }
+
+    h = pes_header(p);
+    if (h < 0) {
+        return 0;
+    }
+
+    for (i = h + 9 + p[h + 8]; i + 3 < TS_PACKET_SIZE; i++) {
+        if (p[i] == 0 && p[i + 1] == 0 && p[i + 2] == 1 && is_random_access_unit(p + i, streamType)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static int flush_output(TsSplicer* sp) {
+    int ret = 0;
+
+    if (sp->outSize > 0) {
+        ret = sp->writeFunction(sp->wopaque, sp->out, sp->outSize);
+        sp->outSize = 0;
+    }
+
+    return ret < 0 ? ret : 0;
+}
+
+// Renumbers the continuity counter and queues the packet for output.
+static int emit_packet(TsSplicer* sp, uint8_t* p) {
+    int pid = ts_pid(p);
+
+    if (pid != TS_NULL_PID) {
+        if (sp->cc[pid] < 0) {
+            sp->cc[pid] = p[3] & 0x0f;
+        } else if (p[3] & 0x10) {
+            sp->cc[pid] = (sp->cc[pid] + 1) & 0x0f;
+        }
+        p[3] = (p[3] & 0xf0) | sp->cc[pid];
+    }
+
+    memcpy(sp->out + sp->outSize, p, TS_PACKET_SIZE);
+    sp->outSize += TS_PACKET_SIZE;
+
+    return sp->outSize == sizeof(sp->out) ? flush_output(sp) : 0;
+}
+
+// Adaptation-field-only packet carrying the discontinuity indicator. It
+// does not advance the continuity counter.
+static int emit_discontinuity(TsSplicer* sp, int pid) {
+    uint8_t p[TS_PACKET_SIZE];
+
+    if (pid < 0 || sp->cc[pid] < 0) {
+        return 0;
+    }
+
+    p[0] = TS_SYNC_BYTE;
+    p[1] = pid >> 8;
+    p[2] = pid & 0xff;
+    p[3] = 0x20;
+    p[4] = TS_PACKET_SIZE - 5;
+    p[5] = 0x80;
+    memset(p + 6, 0xff, TS_PACKET_SIZE - 6);
+
+    return emit_packet(sp, p);
+}
+
+// Adaptation-field-only packet carrying the PCR of p on pid.
+static int emit_pcr(TsSplicer* sp, int pid, const uint8_t* p) {
+    uint8_t pcr[TS_PACKET_SIZE];
+
+    pcr[0] = TS_SYNC_BYTE;
+    pcr[1] = pid >> 8;
+    pcr[2] = pid & 0xff;
+    pcr[3] = 0x20;
+    pcr[4] = TS_PACKET_SIZE - 5;
+    pcr[5] = 0x10;
+    memcpy(pcr + 6, p + 6, 6);
+    memset(pcr + 12, 0xff, TS_PACKET_SIZE - 12);
+
+    return emit_packet(sp, pcr);
+}
+
+// The video phase of a splice marks the video PID and a separate PCR PID,
+// the audio phase the audio PID.
+static int emit_discontinuities(TsSplicer* sp, int audio) {
+    int ret;
+
+    if (audio) {
+        return emit_discontinuity(sp, sp->main.audioPid);
+    }
+
+    ret = emit_discontinuity(sp, sp->main.videoPid);
+    if (ret >= 0 && sp->main.pcrPid != sp->main.videoPid) {
+        ret = emit_discontinuity(sp, sp->main.pcrPid);
+    }
+
+    return ret;
+}
+
+// Reads the clip program and the extent of its video timeline.
+static int scan_clip(TsClip* clip) {
+    int64_t lastDts = -1, lastDelta = 0;
+    int i;
+
+    init_program(&clip->program);
+    clip->firstDts = -1;
+
+    for (i = 0; i < clip->size; i += TS_PACKET_SIZE) {
+        const uint8_t* p = clip->data + i;
+        int pid = ts_pid(p);
+
+        if (p[0] != TS_SYNC_BYTE) {
+            fprintf(stderr, "Clip lost sync at offset %d\n", i);
+            return -1;
+        }
+
+        if (pid == 0 || pid == clip->program.pmtPid) {
+            parse_psi(&clip->program, p);
+        } else if (pid == clip->program.videoPid) {
+            int64_t dts = pes_dts(p);
+            if (dts < 0) {
+                continue;
+            }
+            if (clip->firstDts < 0) {
+                clip->firstDts = dts;
+            } else {
+                lastDelta = (dts - lastDts) & TS_TIMESTAMP_MASK;
+            }
+            lastDts = dts;
+        }
+    }
+
+    if (clip->program.videoPid < 0 || clip->firstDts < 0) {
+        fprintf(stderr, "Clip has no video timestamps\n");
+        return -1;
+    }
+
+    clip->duration = ((lastDts - clip->firstDts) & TS_TIMESTAMP_MASK) + lastDelta;
+
+    return 0;
+}
+
+// Clip packets are relabelled onto the main PIDs, so the stream types must
+// be the same, including a missing audio stream.
+static int check_clip_program(TsSplicer* sp) {
+    const TsProgram* c = &sp->clip.program;
+
+    if (c->videoType != sp->main.videoType || c->audioType != sp->main.audioType) {
+        fprintf(stderr, "Clip stream types (video %d, audio %d) differ from the main program (video %d, audio %d)\n",
+                c->videoType, c->audioType, sp->main.videoType, sp->main.audioType);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int map_clip_pid(TsSplicer* sp, int pid) {
+    const TsProgram* c = &sp->clip.program;
+
+    if (pid == c->videoPid) {
+        return sp->main.videoPid;
+    }
+    if (pid == c->audioPid) {
+        return sp->main.audioPid;
+    }
+    if (pid == c->pcrPid) {
+        return sp->main.pcrPid;
+    }
+
+    return -1;
+}
+
+static void finish_clip(TsSplicer* sp) {
+    sp->clipState = CLIP_NONE;
+    av_freep(&sp->clip.data);
+}
+
+// Emits the clip packets that go onto the main audio PID, or all the others.
+// Every clip PCR goes out with the video phase, on the main PCR PID.
+static int emit_clip(TsSplicer* sp, int audio) {
+    int ret, i;
+
+    ret = emit_discontinuities(sp, audio);
+
+    for (i = 0; ret >= 0 && i < sp->clip.size; i += TS_PACKET_SIZE) {
+        uint8_t* p = sp->clip.data + i;
+        int pid = map_clip_pid(sp, ts_pid(p));
+        int isAudio = pid == sp->main.audioPid;
+
+        if (pid < 0 || (audio && !isAudio)) {
+            continue;
+        }
+
+        if (!audio) {
+            shift_pcr(p, sp->clip.offset);
+            if (isAudio) {
+                if (ts_has_pcr(p) && sp->main.pcrPid >= 0) {
+                    ret = emit_pcr(sp, sp->main.pcrPid, p);
+                }
+                continue;
+            }
+        } else if (ts_has_pcr(p) && pid == sp->main.pcrPid) {
+            // Already sent with the video phase.
+            strip_pcr(p);
+        }
+
+        p[1] = (p[1] & 0xe0) | (pid >> 8);
+        p[2] = pid & 0xff;
+        shift_pes(p, sp->clip.offset);
+        ret = emit_packet(sp, p);
+
+        // Keep the PCR on the main program's PCR PID during the clip.
+        if (!audio && ret >= 0 && ts_has_pcr(p) && sp->main.pcrPid >= 0 && pid != sp->main.pcrPid) {
+            ret = emit_pcr(sp, sp->main.pcrPid, p);
+        }
+    }
+
+    if (ret >= 0) {
+        ret = emit_discontinuities(sp, audio);
+    }
+
+    return ret;
+}
+
+// Whether the main stream timestamp ts is at or after the last splice point.
+static int after_splice(TsSplicer* sp, int64_t ts) {
+    return sp->spliceDts < 0 || ((ts - sp->spliceDts) & TS_TIMESTAMP_MASK) < (INT64_C(1) << 32);
+}
+
+// Emits the clip video so that it starts at the main input time dts. The
+// clip audio waits for the main audio to reach a PES boundary.
+static int splice_video(TsSplicer* sp, int64_t dts) {
+    int ret;
+
+    if (check_clip_program(sp) < 0) {
+        finish_clip(sp);
+        sp->clipRejected = 1;
+        return 0;
+    }
+
+    sp->clip.offset = (dts + sp->mainOffset - sp->clip.firstDts) & TS_TIMESTAMP_MASK;
+    ret = emit_clip(sp, 0);
+
+    sp->prevOffset = sp->mainOffset;
+    sp->mainOffset = (sp->mainOffset + sp->clip.duration) & TS_TIMESTAMP_MASK;
+    sp->spliceDts = dts;
+
+    if (sp->main.audioPid >= 0) {
+        sp->clipState = CLIP_AUDIO;
+    } else {
+        finish_clip(sp);
+    }
+
+    return ret;
+}
+
+static int splice_audio(TsSplicer* sp) {
+    int ret = emit_clip(sp, 1);
+
+    finish_clip(sp);
+
+    return ret;
+}
+
+// PES timestamps are shifted by which side of the splice point they fall
+// on, so late audio from before it keeps its time. A PCR follows its PID:
+// once the PID has been spliced, the clip's PCRs are behind it.
+static void shift_main_packet(TsSplicer* sp, uint8_t* p, int pid, int64_t dts) {
+    int pcrSpliced = sp->clipState != CLIP_AUDIO || pid != sp->main.audioPid || pid == sp->main.pcrPid;
+
+    shift_pcr(p, pcrSpliced ? sp->mainOffset : sp->prevOffset);
+    if (dts >= 0) {
+        shift_pes(p, after_splice(sp, dts) ? sp->mainOffset : sp->prevOffset);
+    }
+}
+
+// The clip goes in at PES boundaries only: its video before a main video
+// key frame, its audio before the next main audio PES at or after that
+// frame's DTS. An audio PES in progress at the key frame is finished first.
+static int process_main_packet(TsSplicer* sp, uint8_t* p) {
+    int pid = ts_pid(p);
+    int64_t dts;
+    int ret = 0;
+
+    if (p[0] != TS_SYNC_BYTE) {
+        fprintf(stderr, "Main stream lost sync\n");
+        return -1;
+    }
+
+    if (pid == 0 || pid == sp->main.pmtPid) {
+        parse_psi(&sp->main, p);
+    }
+
+    dts = pes_dts(p);
+    if (dts >= 0 && sp->clipState == CLIP_QUEUED && pid == sp->main.videoPid &&
+        is_key_frame(p, sp->main.videoType)) {
+        ret = splice_video(sp, dts);
+    } else if (dts >= 0 && sp->clipState == CLIP_AUDIO && pid == sp->main.audioPid && after_splice(sp, dts)) {
+        ret = splice_audio(sp);
+    }
+    if (ret < 0) {
+        return ret;
+    }
+
+    shift_main_packet(sp, p, pid, dts);
+
+    return emit_packet(sp, p);
+}
+
+TsSplicer* NewTsSplicer(void* wopaque, BufferCallback writeFunction) {
+    TsSplicer* sp = av_mallocz(sizeof(TsSplicer));
+
+    if (!sp) {
+        return NULL;
+    }
+
+    sp->wopaque = wopaque;
+    sp->writeFunction = writeFunction;
+    init_program(&sp->main);
+    sp->spliceDts = -1;
+    memset(sp->cc, -1, sizeof(sp->cc));
+
+    return sp;
+}
+
+int TsSplicerWriteMain(TsSplicer* sp, const uint8_t* buf, int size) {
+    int ret = 0;
+
+    if (sp->partialSize > 0) {
+        int n = TS_PACKET_SIZE - sp->partialSize;
+        if (n > size) {
+            n = size;
+        }
+        memcpy(sp->partial + sp->partialSize, buf, n);
+        sp->partialSize += n;
+        buf += n;
+        size -= n;
+
+        if (sp->partialSize < TS_PACKET_SIZE) {
+            return 0;
+        }
+        sp->partialSize = 0;
+        ret = process_main_packet(sp, sp->partial);
+    }
+
+    while (ret >= 0 && size >= TS_PACKET_SIZE) {
+        // Packets are rewritten in place, so work on a copy of the caller's data.
+        memcpy(sp->partial, buf, TS_PACKET_SIZE);
+        ret = process_main_packet(sp, sp->partial);
+        buf += TS_PACKET_SIZE;
+        size -= TS_PACKET_SIZE;
+    }
+
+    if (ret >= 0 && size > 0) {
+        memcpy(sp->partial, buf, size);
+        sp->partialSize = size;
+    }
+
+    if (ret >= 0 && sp->clipRejected) {
+        sp->clipRejected = 0;
+        ret = -1;
+    }
+
+    return ret;
+}
+
+int TsSplicerInsertClip(TsSplicer* sp, const uint8_t* clip, int size) {
+    if (sp->clipState != CLIP_NONE) {
+        fprintf(stderr, "A clip is already waiting to be spliced\n");
+        return -1;
+    }
+    if (size <= 0 || size % TS_PACKET_SIZE != 0) {
+        fprintf(stderr, "Clip size %d is not a whole number of TS packets\n", size);
+        return -1;
+    }
+
+    sp->clip.data = av_malloc(size);
+    if (!sp->clip.data) {
+        return -1;
+    }
+    memcpy(sp->clip.data, clip, size);
+    sp->clip.size = size;
+
+    // Without the main PMT yet, the stream types are checked at the splice.
+    if (scan_clip(&sp->clip) < 0 || (sp->main.videoPid >= 0 && check_clip_program(sp) < 0)) {
+        av_freep(&sp->clip.data);
+        return -1;
+    }
+
+    sp->clipState = CLIP_QUEUED;
+
+    return 0;
+}
+
+int TsSplicerFlush(TsSplicer* sp) {
+    return flush_output(sp);
+}
+
+void FreeTsSplicer(TsSplicer* sp) {
+    if (!sp) {
+        return;
+    }
+
+    av_free(sp->clip.data);
+    av_free(sp);
+}
@@ -0,0 +1,34 @@
+#ifndef TS_SPLICE_H
+#define TS_SPLICE_H
+
+#include "muxer.h"
+
+typedef struct _TsSplicer TsSplicer;
+
+// Splices pre-packaged TS clips into a TS stream at packet level. The main
+// stream is passed through with its continuity counters renumbered. A
+// queued clip's video is inserted before the next main video key frame,
+// and its audio before the next main audio PES at or after that frame's
+// DTS, so no main PES is cut. Clip PIDs are mapped onto the main program's
+// and clip PCR/PTS/DTS shifted to continue the main timeline. Main
+// timestamps at or after the splice point are shifted by the clip
+// duration. Payloads are never touched.
+TsSplicer* NewTsSplicer(void* wopaque, BufferCallback writeFunction);
+
+// Accepts main stream data in any chunking. Returns -1, after writing all
+// of buf, if a clip was dropped at the splice point because its stream
+// types differ from the main program's.
+int TsSplicerWriteMain(TsSplicer* sp, const uint8_t* buf, int size);
+
+// Queues a clip (whole TS packets, with its own PAT/PMT) for insertion.
+// The data is copied. The clip's video and audio stream types must match
+// the main program's; this is checked here once the main PMT has been
+// seen.
+int TsSplicerInsertClip(TsSplicer* sp, const uint8_t* clip, int size);
+
+// Writes out buffered output.
+int TsSplicerFlush(TsSplicer* sp);
+
+void FreeTsSplicer(TsSplicer* sp);
+
+#endif
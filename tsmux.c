@@ -2,17 +2,61 @@
  * Copyright (c) 2014 veecr.
  */
 
-#include "muxer.h"
+#include "tsmux.h"
+#include "timeline.h"
+#include "mem_budget.h"
+#include "adts.h"
 #include <libavformat/avformat.h>
 #include <libavutil/timestamp.h>
 #include <libavutil/opt.h>
 
+#define IO_BUFFER_SIZE 8192
+#define MAX_OUTPUT_STREAMS 2
+
+typedef struct {
+    AVPacketList *head;
+    AVPacketList *tail;
+} PacketQueue;
+
+// AAC frames collected into one PES, each with its own ADTS header.
+typedef struct {
+    uint8_t *buf;
+    int size;
+    int capacity;
+    int frames;
+    int64_t pts;
+    int64_t dts;
+    int64_t duration;
+} AudioAggregate;
+
 typedef struct {
     AVStream *st;
     AVFormatContext *ofmt_ctx;
+    AVFormatContext *ifmt_ctx;
+    int in_index;
     int64_t next_pts;
+    TimeRescaler rescale;
+    Timeline timeline;
+    AVBitStreamFilterContext *bsfc;
+    PacketQueue queue;
+    int finished;
+    int adts;
+    AdtsConfig adtsConfig;
+    AudioAggregate agg;
+    int64_t aggDuration;
+    int64_t frameDuration;
+    HlsCrypt *crypt;
 } OutputStream;
 
+// Packets are interleaved here rather than in av_interleaved_write_frame so
+// that everything a session holds is accounted against its budget.
+typedef struct {
+    OutputStream *streams[MAX_OUTPUT_STREAMS];
+    int nb_streams;
+    MemBudget budget;
+    int seeking;
+} RemuxSession;
+
 static void log_packet(AVStream *stream, const AVPacket *pkt, const char *tag)
 {
     AVRational *time_base = &stream->time_base;
@@ -27,62 +71,315 @@ static void log_packet(AVStream *stream, const AVPacket *pkt, const char *tag)
            time_base->den);
 }
 
-static int write_packet(AVBitStreamFilterContext *bsfc, AVFormatContext *ifmt_ctx, OutputStream *out_stream) {
-    AVStream *in_stream;
-    AVPacket pkt, ipkt;
-    int ret, bsfr;
+static int64_t packet_cost(const AVPacket *pkt) {
+    return pkt->size + sizeof(AVPacketList);
+}
+
+static int queue_packet(RemuxSession *s, OutputStream *os, AVPacket *pkt) {
+    AVPacketList *node;
+
+    if (av_dup_packet(pkt) < 0 || !(node = av_malloc(sizeof(AVPacketList)))) {
+        av_free_packet(pkt);
+        return AVERROR(ENOMEM);
+    }
+
+    node->pkt = *pkt;
+    node->next = 0;
+    if (os->queue.tail) {
+        os->queue.tail->next = node;
+    } else {
+        os->queue.head = node;
+    }
+    os->queue.tail = node;
+
+    MemBudgetCharge(&s->budget, packet_cost(pkt));
+
+    return 0;
+}
+
+static int write_queued(RemuxSession *s, OutputStream *os) {
+    AVPacketList *node = os->queue.head;
+    int ret;
+
+    os->queue.head = node->next;
+    if (!os->queue.head) {
+        os->queue.tail = 0;
+    }
+
+    MemBudgetRelease(&s->budget, packet_cost(&node->pkt));
+
+    //log_packet(os->st, &node->pkt, "out");
+
+    ret = av_write_frame(os->ofmt_ctx, &node->pkt);
+    av_free_packet(&node->pkt);
+    av_free(node);
+
+    if (ret < 0) {
+        fprintf(stderr, "Error muxing packet\n");
+        return ret;
+    }
+
+    return 0;
+}
+
+// Writes queued packets in dts order while every unfinished stream has one
+// queued. With force set, writes the oldest packets until the session is
+// back under its budget regardless.
+static int drain(RemuxSession *s, int force) {
+    int i, ret;
+
+    while (1) {
+        OutputStream *next = 0;
+
+        if (force && !MemBudgetNearLimit(&s->budget)) {
+            return 0;
+        }
+
+        for (i = 0; i < s->nb_streams; i++) {
+            OutputStream *os = s->streams[i];
+            if (!os->queue.head) {
+                if (!os->finished && !force) {
+                    return 0;
+                }
+                continue;
+            }
+            if (!next || av_compare_ts(os->queue.head->pkt.dts, os->st->time_base,
+                                       next->queue.head->pkt.dts, next->st->time_base) < 0) {
+                next = os;
+            }
+        }
+
+        if (!next) {
+            return 0;
+        }
+
+        if ((ret = write_queued(s, next)) < 0) {
+            return ret;
+        }
+    }
+}
+
+static void free_queue(RemuxSession *s, OutputStream *os) {
+    while (os->queue.head) {
+        AVPacketList *node = os->queue.head;
+        os->queue.head = node->next;
+        MemBudgetRelease(&s->budget, packet_cost(&node->pkt));
+        av_free_packet(&node->pkt);
+        av_free(node);
+    }
+    os->queue.tail = 0;
+}
+
+static int flush_audio(RemuxSession *s, OutputStream *os) {
+    AudioAggregate *agg = &os->agg;
+    AVPacket pkt;
+
+    if (agg->frames == 0) {
+        return 0;
+    }
+
+    if (av_new_packet(&pkt, agg->size) < 0) {
+        return AVERROR(ENOMEM);
+    }
+    memcpy(pkt.data, agg->buf, agg->size);
+    pkt.pts = agg->pts;
+    pkt.dts = agg->dts;
+    pkt.duration = (int)agg->duration;
+    pkt.stream_index = os->st->index;
+    pkt.flags = AV_PKT_FLAG_KEY;
+
+    agg->size = 0;
+    agg->frames = 0;
+
+    return queue_packet(s, os, &pkt);
+}
+
+// Prefixes the frame with an ADTS header, so the TS muxer does not run its
+// own ADTS muxer per packet, and packs frames into one PES until the
+// configured duration is reached.
+static int aggregate_audio(RemuxSession *s, OutputStream *os, AVPacket *pkt) {
+    AudioAggregate *agg = &os->agg;
+    int need = agg->size + ADTS_HEADER_SIZE + pkt->size;
+
+    if (need > agg->capacity) {
+        uint8_t *buf = av_realloc(agg->buf, need);
+        if (!buf) {
+            av_free_packet(pkt);
+            return AVERROR(ENOMEM);
+        }
+        MemBudgetCharge(&s->budget, need - agg->capacity);
+        agg->buf = buf;
+        agg->capacity = need;
+    }
+
+    if (agg->frames == 0) {
+        agg->pts = pkt->pts;
+        agg->dts = pkt->dts;
+        agg->duration = 0;
+    }
+
+    AdtsWriteHeader(&os->adtsConfig, agg->buf + agg->size, pkt->size);
+    memcpy(agg->buf + agg->size + ADTS_HEADER_SIZE, pkt->data, pkt->size);
+    if (os->crypt) {
+        HlsCryptEncryptAudio(os->crypt, agg->buf + agg->size + ADTS_HEADER_SIZE, pkt->size);
+    }
+    agg->size = need;
+    // Demuxers may leave duration unset; without the fallback the
+    // aggregate would never reach its threshold.
+    agg->duration += pkt->duration > 0 ? pkt->duration : os->frameDuration;
+    agg->frames++;
+
+    av_free_packet(pkt);
+
+    if (agg->duration >= os->aggDuration) {
+        return flush_audio(s, os);
+    }
+
+    return 0;
+}
+
+// Replaces the packet with its SAMPLE-AES encrypted copy.
+static int encrypt_video(OutputStream *os, AVPacket *pkt) {
+    AVPacket epkt;
+    int ret;
+
+    if (av_new_packet(&epkt, HLS_CRYPT_VIDEO_BOUND(pkt->size)) < 0) {
+        av_free_packet(pkt);
+        return AVERROR(ENOMEM);
+    }
+
+    ret = HlsCryptEncryptVideo(os->crypt, pkt->data, pkt->size, epkt.data);
+    if (ret < 0) {
+        av_free_packet(&epkt);
+        av_free_packet(pkt);
+        return ret;
+    }
+    epkt.size = ret;
+    memset(epkt.data + epkt.size, 0, FF_INPUT_BUFFER_PADDING_SIZE);
+    epkt.pts = pkt->pts;
+    epkt.dts = pkt->dts;
+    epkt.duration = pkt->duration;
+    epkt.flags = pkt->flags;
+    epkt.stream_index = pkt->stream_index;
+
+    av_free_packet(pkt);
+    *pkt = epkt;
+
+    return 0;
+}
+
+static OutputStream* find_output(RemuxSession *s, AVFormatContext *ifmt_ctx, int in_index) {
+    int i;
 
-    ret = av_read_frame(ifmt_ctx, &ipkt);
+    for (i = 0; i < s->nb_streams; i++) {
+        if (s->streams[i]->ifmt_ctx == ifmt_ctx && s->streams[i]->in_index == in_index) {
+            return s->streams[i];
+        }
+    }
+
+    return 0;
+}
+
+static int read_packet(RemuxSession *s, AVFormatContext *ifmt_ctx) {
+    OutputStream *os;
+    AVPacket pkt;
+    int i, ret;
+
+    ret = av_read_frame(ifmt_ctx, &pkt);
     if (ret < 0) {
+        for (i = 0; i < s->nb_streams; i++) {
+            if (s->streams[i]->ifmt_ctx == ifmt_ctx) {
+                if ((ret = flush_audio(s, s->streams[i])) < 0) {
+                    return ret;
+                }
+                s->streams[i]->finished = 1;
+            }
+        }
         return 0;
     }
 
-    pkt = ipkt;
+    os = find_output(s, ifmt_ctx, pkt.stream_index);
+    if (!os) {
+        av_free_packet(&pkt);
+        return 1;
+    }
 
-    if (bsfc != 0) {
-        bsfr = av_bitstream_filter_filter(
-                bsfc,
+    if (os->bsfc != 0) {
+        AVPacket fpkt = pkt;
+        int bsfr = av_bitstream_filter_filter(
+                os->bsfc,
                 ifmt_ctx->streams[pkt.stream_index]->codec,
                 NULL,
-                &pkt.data,
-                &pkt.size,
-                ipkt.data,
-                ipkt.size,
-                ipkt.flags & AV_PKT_FLAG_KEY);
+                &fpkt.data,
+                &fpkt.size,
+                pkt.data,
+                pkt.size,
+                pkt.flags & AV_PKT_FLAG_KEY);
         if (bsfr < 0) {
             fprintf(stderr, "Error in bitstream filter\n");
-            return ret;
+            av_free_packet(&pkt);
+            return bsfr;
+        }
+        // The filter allocated a new buffer; hand its ownership to the packet.
+        // fpkt keeps the side data, so it must not be freed with pkt.
+        if (bsfr > 0) {
+            pkt.side_data = NULL;
+            pkt.side_data_elems = 0;
+            av_free_packet(&pkt);
+            fpkt.buf = av_buffer_create(fpkt.data, fpkt.size, av_buffer_default_free, NULL, 0);
+            if (!fpkt.buf) {
+                av_free(fpkt.data);
+                return AVERROR(ENOMEM);
+            }
         }
+        pkt = fpkt;
     }
 
-    in_stream  = ifmt_ctx->streams[pkt.stream_index];
+    if (os->crypt && os->bsfc) {
+        if ((ret = encrypt_video(os, &pkt)) < 0) {
+            return ret;
+        }
+    }
 
-    //log_packet(in_stream, &pkt, "in");
+    //log_packet(ifmt_ctx->streams[pkt.stream_index], &pkt, "in");
 
-    pkt.pts = av_rescale_q_rnd(pkt.pts, in_stream->time_base, out_stream->st->time_base, AV_ROUND_NEAR_INF|AV_ROUND_PASS_MINMAX);
-    pkt.dts = av_rescale_q_rnd(pkt.dts, in_stream->time_base, out_stream->st->time_base, AV_ROUND_NEAR_INF|AV_ROUND_PASS_MINMAX);
-    pkt.duration = av_rescale_q(pkt.duration, in_stream->time_base, out_stream->st->time_base);
+    pkt.pts = TimeRescale(&os->rescale, pkt.pts);
+    pkt.dts = TimeRescale(&os->rescale, pkt.dts);
+    pkt.duration = (int)TimeRescale(&os->rescale, pkt.duration);
+    TimelineMapPacket(&os->timeline, &pkt.pts, &pkt.dts, pkt.duration);
     pkt.pos = -1;
-    pkt.stream_index = out_stream->st->index;
+    pkt.stream_index = os->st->index;
 
-    //log_packet(out_stream->st, &pkt, "out");
+    os->next_pts = pkt.pts + pkt.duration;
 
-    out_stream->next_pts = pkt.pts + pkt.duration;
-
-    ret = av_interleaved_write_frame(out_stream->ofmt_ctx, &pkt);
+    if (os->adts) {
+        ret = aggregate_audio(s, os, &pkt);
+    } else {
+        ret = queue_packet(s, os, &pkt);
+    }
     if (ret < 0) {
-        fprintf(stderr, "Error muxing packet\n");
+        fprintf(stderr, "Error queueing packet\n");
         return ret;
     }
 
-    av_free_packet(&pkt);
-
     return 1;
 }
 
-static int addStreams(OutputStream* os, AVFormatContext* ofmt_ctx, AVFormatContext* ifmt_ctx) {
+static int find_stream(AVFormatContext *ifmt_ctx, enum AVMediaType type) {
+    unsigned int i;
+
+    for (i = 0; i < ifmt_ctx->nb_streams; i++) {
+        if (ifmt_ctx->streams[i]->codec->codec_type == type) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+static int addStreams(RemuxSession* s, OutputStream* os, AVFormatContext* ofmt_ctx, AVFormatContext* ifmt_ctx, int in_index) {
     int ret;
-    AVStream *in_stream = ifmt_ctx->streams[0];
+    AVStream *in_stream = ifmt_ctx->streams[in_index];
 
     os->st = avformat_new_stream(ofmt_ctx, in_stream->codec->codec);
     if (!os->st) {
@@ -91,6 +388,9 @@ static int addStreams(OutputStream* os, AVFormatContext* ofmt_ctx, AVFormatConte
     }
 
     os->ofmt_ctx = ofmt_ctx;
+    os->ifmt_ctx = ifmt_ctx;
+    os->in_index = in_index;
+    s->streams[s->nb_streams++] = os;
 
     ret = avcodec_copy_context(os->st->codec, in_stream->codec);
     if (ret < 0) {
@@ -117,23 +417,128 @@ static int addStreams(OutputStream* os, AVFormatContext* ofmt_ctx, AVFormatConte
     return 0;
 }
 
+// Input streams that are not remuxed are skipped by the demuxer.
+static void discardUnmapped(RemuxSession* s, AVFormatContext* ifmt_ctx) {
+    unsigned int i;
+
+    for (i = 0; i < ifmt_ctx->nb_streams; i++) {
+        if (!find_output(s, ifmt_ctx, i)) {
+            ifmt_ctx->streams[i]->discard = AVDISCARD_ALL;
+        }
+    }
+}
+
+// Must run after avformat_write_header, which may change the output time base.
+static void initTiming(OutputStream* os, const TsRemuxOptions* options) {
+    TimeRescalerInit(&os->rescale, os->ifmt_ctx->streams[os->in_index]->time_base, os->st->time_base);
+    TimelineInit(&os->timeline, 0, 0);
+    os->aggDuration = av_rescale_q(options->audioPesDurationMs, (AVRational){ 1, 1000 }, os->st->time_base);
+}
+
+static void initAdts(OutputStream* os) {
+    AVCodecContext *codec = os->ifmt_ctx->streams[os->in_index]->codec;
+
+    if (codec->codec_id == AV_CODEC_ID_AAC &&
+        AdtsConfigFromAsc(&os->adtsConfig, codec->extradata, codec->extradata_size) == 0) {
+        os->adts = 1;
+        os->frameDuration = av_rescale_q(codec->frame_size > 0 ? codec->frame_size : 1024,
+                                         (AVRational){ 1, AdtsSampleRate(&os->adtsConfig) },
+                                         os->st->time_base);
+    }
+}
+
+// SAMPLE-AES is only defined for H.264 and AAC in TS. Runs before
+// avformat_write_header so the first PMT carries the audio config.
+static int initCrypt(OutputStream* os, HlsCrypt* crypt) {
+    AVCodecContext *codec = os->ifmt_ctx->streams[os->in_index]->codec;
+    AdtsConfig config;
+
+    if (codec->codec_id == AV_CODEC_ID_H264) {
+        os->crypt = crypt;
+        return 0;
+    }
+
+    if (codec->codec_id == AV_CODEC_ID_AAC &&
+        AdtsConfigFromAsc(&config, codec->extradata, codec->extradata_size) == 0) {
+        os->crypt = crypt;
+        return HlsCryptSetAudioConfig(crypt, codec->extradata, codec->extradata_size);
+    }
+
+    fprintf(stderr, "SAMPLE-AES supports H.264 and AAC only\n");
+    return AVERROR(EINVAL);
+}
+
+static int openInput(RemuxSession* s, AVFormatContext** ifmt_ctx, const char* name,
+                     void* ropaque, BufferCallback readFunction, SeekCallback seekFunction) {
+    unsigned char *ibuf;
+    int ret;
+
+    ibuf = av_malloc(IO_BUFFER_SIZE);
+    if (ibuf == NULL) {
+        return AVERROR(ENOMEM);
+    }
+    MemBudgetCharge(&s->budget, IO_BUFFER_SIZE);
+
+    *ifmt_ctx = avformat_alloc_context();
+    (*ifmt_ctx)->pb = avio_alloc_context(ibuf, IO_BUFFER_SIZE, 0, ropaque, readFunction, 0, seekFunction);
+    if ((*ifmt_ctx)->pb == NULL) {
+        fprintf(stderr, "Could not create input buffer.");
+        return AVERROR(ENOMEM);
+    }
+
+    if ((ret = avformat_open_input(ifmt_ctx, name, 0, 0)) < 0) {
+        fprintf(stderr, "Could not open input.");
+        return ret;
+    }
+
+    if ((ret = avformat_find_stream_info(*ifmt_ctx, 0)) < 0) {
+        fprintf(stderr, "Failed to retrieve input stream information");
+        return ret;
+    }
+
+    return 0;
+}
+
 int remuxToTs(
         void* aropaque, BufferCallback audioReadFunction,
         void* vropaque, BufferCallback videoReadFunction,
         void* wopaque, BufferCallback writeFunction)
 {
-    int ret;
+    return remuxToTsWithOptions(
+            aropaque, audioReadFunction, 0,
+            vropaque, videoReadFunction, 0,
+            wopaque, writeFunction,
+            0, 0);
+}
+
+int remuxToTsWithOptions(
+        void* aropaque, BufferCallback audioReadFunction, SeekCallback audioSeekFunction,
+        void* vropaque, BufferCallback videoReadFunction, SeekCallback videoSeekFunction,
+        void* wopaque, BufferCallback writeFunction,
+        const TsRemuxOptions* options, TsRemuxStats* stats)
+{
+    int ret = 0, i, idx;
     AVFormatContext *aifmt_ctx = 0, *vifmt_ctx = 0, *ofmt_ctx = 0;
-    unsigned char *aibuf, *vibuf, *obuf;
-    AVBitStreamFilterContext* bsfc = 0;
+    unsigned char *obuf;
     OutputStream video_st = { 0 }, audio_st = { 0 };
-    int more_audio = 0, more_video = 0;
-    
+    RemuxSession session;
+    TsRemuxOptions defaults = { 0 };
+    HlsCrypt *crypt = 0;
+
+    memset(&session, 0, sizeof(RemuxSession));
+
+    if (!options) {
+        options = &defaults;
+    }
+    MemBudgetInit(&session.budget, options->memoryLimit);
+
     // Open output.
-    obuf = av_malloc(8192);
+    obuf = av_malloc(IO_BUFFER_SIZE);
     if (obuf == NULL) {
+        ret = AVERROR(ENOMEM);
         goto end;
     }
+    MemBudgetCharge(&session.budget, IO_BUFFER_SIZE);
 
     avformat_alloc_output_context2(&ofmt_ctx, NULL, "mpegts", NULL);
     if (!ofmt_ctx) {
@@ -141,83 +546,93 @@ int remuxToTs(
         ret = AVERROR_UNKNOWN;
         goto end;
     }
-    
-    ofmt_ctx->pb = avio_alloc_context(obuf, 8192, 1, wopaque, 0, writeFunction, 0);
-    if (ofmt_ctx->pb == NULL) {
-        fprintf(stderr, "Could not create output buffer.");
-        goto end;
-    }
 
-    // Open video input.
-    if (vropaque != 0) {
-        vibuf = av_malloc(8192);
-        if (vibuf == NULL) {
+    // Audio is packed into PES packets here. The muxer rounds the payload
+    // size up to its minimum of 170 bytes, and only buffers audio packets
+    // smaller than that; aggregated packets are larger and go out as one PES
+    // each.
+    if (options->audioPesDurationMs > 0) {
+        ret = av_opt_set(ofmt_ctx, "pes_payload_size", "0", AV_OPT_SEARCH_CHILDREN);
+        if (ret < 0) {
+            fprintf(stderr, "Failed to set PES payload size option.\n");
             goto end;
         }
+    }
 
-        vifmt_ctx = avformat_alloc_context();
-        vifmt_ctx->pb = avio_alloc_context(vibuf, 8192, 0, vropaque, videoReadFunction, 0, 0);
-        if (vifmt_ctx->pb == NULL) {
-            fprintf(stderr, "Could not create input buffer.");
+    // Encryption sits between the muxer and the caller's write callback.
+    if (options->encryption != HLS_CRYPT_NONE) {
+        crypt = NewHlsCrypt(options->encryption, options->kopaque, options->keyFunction);
+        if (!crypt || HlsCryptStartSegment(crypt, options->segmentIndex, wopaque, writeFunction) < 0) {
+            fprintf(stderr, "Could not set up encryption\n");
+            ret = AVERROR_UNKNOWN;
             goto end;
         }
+        wopaque = crypt;
+        writeFunction = HlsCryptWrite;
+    }
 
-        if ((ret = avformat_open_input(&vifmt_ctx, "v.mp4", 0, 0)) < 0) {
-            fprintf(stderr, "Could not open input.");
-            goto end;
-        }
+    ofmt_ctx->pb = avio_alloc_context(obuf, IO_BUFFER_SIZE, 1, wopaque, 0, writeFunction, 0);
+    if (ofmt_ctx->pb == NULL) {
+        fprintf(stderr, "Could not create output buffer.");
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
 
-        if ((ret = avformat_find_stream_info(vifmt_ctx, 0)) < 0) {
-            fprintf(stderr, "Failed to retrieve input stream information");
+    // Open video input.
+    if (vropaque != 0) {
+        if ((ret = openInput(&session, &vifmt_ctx, "v.mp4", vropaque, videoReadFunction, videoSeekFunction)) < 0) {
             goto end;
         }
 
-        ret = addStreams(&video_st, ofmt_ctx, vifmt_ctx);
+        idx = find_stream(vifmt_ctx, AVMEDIA_TYPE_VIDEO);
+        ret = addStreams(&session, &video_st, ofmt_ctx, vifmt_ctx, idx >= 0 ? idx : 0);
         if (ret < 0) {
             fprintf(stderr, "Error occurred when adding video streams.\n");
             goto end;
         }
 
-        bsfc = av_bitstream_filter_init("h264_mp4toannexb");
-        if (!bsfc) {
+        video_st.bsfc = av_bitstream_filter_init("h264_mp4toannexb");
+        if (!video_st.bsfc) {
             fprintf(stderr, "Error occurred when creating bitstream filter\n");
+            ret = AVERROR_UNKNOWN;
             goto end;
         }
 
-        more_video = 1;
+        // A single interleaved input carries the audio track as well.
+        if (aropaque == 0 && options->audioFromVideoInput &&
+            (idx = find_stream(vifmt_ctx, AVMEDIA_TYPE_AUDIO)) >= 0) {
+            ret = addStreams(&session, &audio_st, ofmt_ctx, vifmt_ctx, idx);
+            if (ret < 0) {
+                fprintf(stderr, "Error occurred when adding audio streams.\n");
+                goto end;
+            }
+        }
+
+        discardUnmapped(&session, vifmt_ctx);
     }
 
     // Open audio input.
     if (aropaque != 0) {
-        aibuf = av_malloc(8192);
-        if (aibuf == NULL) {
+        if ((ret = openInput(&session, &aifmt_ctx, "a.mp4", aropaque, audioReadFunction, audioSeekFunction)) < 0) {
             goto end;
         }
 
-        aifmt_ctx = avformat_alloc_context();
-        aifmt_ctx->pb = avio_alloc_context(aibuf, 8192, 0, aropaque, audioReadFunction, 0, 0);
-        if (aifmt_ctx->pb == NULL) {
-            fprintf(stderr, "Could not create input buffer.");
-            goto end;
-        }
-
-        if ((ret = avformat_open_input(&aifmt_ctx, "a.mp4", 0, 0)) < 0) {
-            fprintf(stderr, "Could not open input.");
-            goto end;
-        }
-
-        if ((ret = avformat_find_stream_info(aifmt_ctx, 0)) < 0) {
-            fprintf(stderr, "Failed to retrieve input stream information");
-            goto end;
-        }
-
-        ret = addStreams(&audio_st, ofmt_ctx, aifmt_ctx);
+        idx = find_stream(aifmt_ctx, AVMEDIA_TYPE_AUDIO);
+        ret = addStreams(&session, &audio_st, ofmt_ctx, aifmt_ctx, idx >= 0 ? idx : 0);
         if (ret < 0) {
             fprintf(stderr, "Error occurred when adding audio streams.\n");
             goto end;
         }
 
-        more_audio = 1;
+        discardUnmapped(&session, aifmt_ctx);
+    }
+
+    if (options->encryption == HLS_CRYPT_SAMPLE_AES) {
+        for (i = 0; i < session.nb_streams; i++) {
+            if ((ret = initCrypt(session.streams[i], crypt)) < 0) {
+                goto end;
+            }
+        }
     }
 
     ret = avformat_write_header(ofmt_ctx, NULL);
@@ -226,33 +641,105 @@ int remuxToTs(
         goto end;
     }
 
+    for (i = 0; i < session.nb_streams; i++) {
+        initTiming(session.streams[i], options);
+        initAdts(session.streams[i]);
+    }
+
+    // Seekable inputs are read in file order until the session nears its
+    // budget. They then switch to dts order, so the mov demuxer seeks to the
+    // lagging track instead of queueing everything in between.
+    if (session.budget.limit > 0) {
+        if (vifmt_ctx && videoSeekFunction) {
+            vifmt_ctx->pb->seekable = 0;
+        }
+        if (aifmt_ctx && audioSeekFunction) {
+            aifmt_ctx->pb->seekable = 0;
+        }
+    }
+
     // Dump formats.
     //av_dump_format(vifmt_ctx, 0, 0, 0);
     //av_dump_format(aifmt_ctx, 0, 0, 0);
     //av_dump_format(ofmt_ctx, 0, NULL, 1);
 
-    while (more_audio || more_video) {
-        if (more_video && 
-            (!more_audio || av_compare_ts(video_st.next_pts,
-                                          video_st.st->time_base,
-                                          audio_st.next_pts,
-                                          audio_st.st->time_base) <= 0))
-        {
-            more_video = write_packet(bsfc, vifmt_ctx, &video_st);
-        } else {
-            more_audio = write_packet(0, aifmt_ctx, &audio_st);
+    while (1) {
+        OutputStream *next = 0;
+
+        // Read from the input of the stream that is furthest behind.
+        for (i = 0; i < session.nb_streams; i++) {
+            OutputStream *os = session.streams[i];
+            if (!os->finished &&
+                (!next || av_compare_ts(os->next_pts, os->st->time_base,
+                                        next->next_pts, next->st->time_base) < 0)) {
+                next = os;
+            }
+        }
+
+        if (!next) {
+            break;
+        }
+
+        if ((ret = read_packet(&session, next->ifmt_ctx)) < 0) {
+            goto end;
+        }
+
+        if ((ret = drain(&session, 0)) < 0) {
+            goto end;
         }
+
+        if (MemBudgetNearLimit(&session.budget)) {
+            if (!session.seeking) {
+                if (vifmt_ctx && videoSeekFunction) {
+                    vifmt_ctx->pb->seekable = AVIO_SEEKABLE_NORMAL;
+                }
+                if (aifmt_ctx && audioSeekFunction) {
+                    aifmt_ctx->pb->seekable = AVIO_SEEKABLE_NORMAL;
+                }
+                session.seeking = 1;
+            }
+
+            if ((ret = drain(&session, 1)) < 0) {
+                goto end;
+            }
+
+            if (MemBudgetOverLimit(&session.budget)) {
+                fprintf(stderr, "Remux session exceeded its memory budget\n");
+                ret = AVERROR(ENOMEM);
+                goto end;
+            }
+        }
+    }
+
+    if ((ret = drain(&session, 0)) < 0) {
+        goto end;
     }
 
     av_write_trailer(ofmt_ctx);
 
+    if (crypt) {
+        avio_flush(ofmt_ctx->pb);
+        if ((ret = HlsCryptEndSegment(crypt)) < 0) {
+            goto end;
+        }
+    }
+
 end:
-    av_bitstream_filter_close(bsfc);
+    for (i = 0; i < session.nb_streams; i++) {
+        free_queue(&session, session.streams[i]);
+        av_free(session.streams[i]->agg.buf);
+    }
+    av_bitstream_filter_close(video_st.bsfc);
+    FreeHlsCrypt(crypt);
 
     avformat_free_context(aifmt_ctx);
     avformat_free_context(vifmt_ctx);
     avformat_free_context(ofmt_ctx);
 
+    if (stats) {
+        stats->peakMemory = session.budget.peak;
+    }
+
     if (ret < 0 && ret != AVERROR_EOF) {
         fprintf(stderr, "Error occurred: %s\n", av_err2str(ret));
         return 1;
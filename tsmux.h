@@ -2,10 +2,39 @@
 #define TS_MUXER_H
 
 #include "muxer.h"
+#include "hls_crypt.h"
+
+typedef struct _TsRemuxOptions {
+    // Bytes one session may hold in I/O buffers and queued packets, or 0
+    // for no limit.
+    int64_t memoryLimit;
+    // AAC frames are packed into one PES until it spans this many
+    // milliseconds. 0 leaves PES sizing to the muxer.
+    int64_t audioPesDurationMs;
+    // Encrypts the output as HLS segment segmentIndex, with the key and IV
+    // from keyFunction.
+    HlsCryptMethod encryption;
+    int64_t segmentIndex;
+    void* kopaque;
+    HlsKeyCallback keyFunction;
+    // When only a video input is given, remux its audio track as well.
+    int audioFromVideoInput;
+} TsRemuxOptions;
+
+typedef struct _TsRemuxStats {
+    int64_t peakMemory;
+} TsRemuxStats;
 
 int remuxToTs(
     void* aropaque, BufferCallback,
     void* vropaque, BufferCallback,
     void* wopaque, BufferCallback);
 
+// Seek callbacks are optional.
+int remuxToTsWithOptions(
+    void* aropaque, BufferCallback, SeekCallback,
+    void* vropaque, BufferCallback, SeekCallback,
+    void* wopaque, BufferCallback,
+    const TsRemuxOptions* options, TsRemuxStats* stats);
+
 #endif
@@ -0,0 +1,613 @@
+/*
+ * Copyright (c) 2014 veecr.
+ */
+
+#include "uring_input.h"
+#include <libavformat/avformat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+
+#define URING_BLOCK_SIZE (256 << 10)
+#define URING_QUEUE_DEPTH 16
+#define URING_IO_BUFFER_SIZE (64 << 10)
+
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+
+#include <linux/io_uring.h>
+
+enum {
+    BLOCK_EMPTY,
+    BLOCK_INFLIGHT,
+    BLOCK_READY
+};
+
+typedef struct {
+    int64_t index;
+    int state;
+    int len;
+    int64_t lastUse;
+    uint8_t* data;
+    // Read by the kernel until the read completes.
+    struct iovec iov;
+} Block;
+
+typedef struct {
+    int64_t offset;
+    int64_t size;
+} Hint;
+
+typedef struct {
+    int fd;
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void* sqRing;
+    size_t sqRingSize;
+    void* cqRing;
+    size_t cqRingSize;
+    size_t sqesSize;
+    unsigned entries;
+    unsigned toSubmit;
+} Ring;
+
+struct _UringInput {
+    int fd;
+    int64_t fileSize;
+    int64_t pos;
+    int blockSize;
+    int readAhead;
+    Block* blocks;
+    int numBlocks;
+    int64_t clock;
+    Hint* hints;
+    int numHints;
+    int hintCapacity;
+    int hintsSorted;
+    Ring ring;
+};
+
+static int ring_setup(Ring* r, unsigned entries) {
+    struct io_uring_params p;
+    int singleMmap = 0;
+
+    memset(&p, 0, sizeof(p));
+    r->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0) {
+        return -1;
+    }
+
+    // Headers older than 5.4 have no features field.
+#ifdef IORING_FEAT_SINGLE_MMAP
+    singleMmap = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+#endif
+
+    r->entries = p.sq_entries;
+    r->sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (singleMmap) {
+        if (r->cqRingSize > r->sqRingSize) {
+            r->sqRingSize = r->cqRingSize;
+        }
+        r->cqRingSize = r->sqRingSize;
+    }
+
+    r->sqRing = mmap(0, r->sqRingSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sqRing == MAP_FAILED) {
+        goto fail;
+    }
+
+    if (singleMmap) {
+        r->cqRing = r->sqRing;
+    } else {
+        r->cqRing = mmap(0, r->cqRingSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cqRing == MAP_FAILED) {
+            goto fail;
+        }
+    }
+
+    r->sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(0, r->sqesSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        goto fail;
+    }
+
+    r->sqHead = (unsigned*)((char*)r->sqRing + p.sq_off.head);
+    r->sqTail = (unsigned*)((char*)r->sqRing + p.sq_off.tail);
+    r->sqMask = (unsigned*)((char*)r->sqRing + p.sq_off.ring_mask);
+    r->sqArray = (unsigned*)((char*)r->sqRing + p.sq_off.array);
+    r->cqHead = (unsigned*)((char*)r->cqRing + p.cq_off.head);
+    r->cqTail = (unsigned*)((char*)r->cqRing + p.cq_off.tail);
+    r->cqMask = (unsigned*)((char*)r->cqRing + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)((char*)r->cqRing + p.cq_off.cqes);
+
+    return 0;
+
+fail:
+    close(r->fd);
+    r->fd = -1;
+    return -1;
+}
+
+static void ring_free(Ring* r) {
+    if (r->fd < 0) {
+        return;
+    }
+    munmap(r->sqes, r->sqesSize);
+    if (r->cqRing != r->sqRing) {
+        munmap(r->cqRing, r->cqRingSize);
+    }
+    munmap(r->sqRing, r->sqRingSize);
+    close(r->fd);
+}
+
+static int ring_enter(Ring* r, unsigned minComplete) {
+    int ret;
+
+    do {
+        ret = syscall(__NR_io_uring_enter, r->fd, r->toSubmit, minComplete,
+                      minComplete ? IORING_ENTER_GETEVENTS : 0, 0, 0);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret >= 0) {
+        r->toSubmit -= ret;
+    }
+
+    return ret;
+}
+
+// Queues a read; submissions are batched until the next ring_enter.
+// IORING_OP_READ needs Linux 5.6, READV works on every io_uring kernel.
+static int ring_queue_read(Ring* r, int fd, struct iovec* iov, int64_t offset, uint64_t userData) {
+    unsigned tail = *r->sqTail;
+    unsigned idx;
+    struct io_uring_sqe* sqe;
+
+    if (tail - __atomic_load_n(r->sqHead, __ATOMIC_ACQUIRE) >= r->entries) {
+        return -1;
+    }
+
+    idx = tail & *r->sqMask;
+    sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)iov;
+    sqe->len = 1;
+    sqe->off = offset;
+    sqe->user_data = userData;
+    r->sqArray[idx] = idx;
+
+    __atomic_store_n(r->sqTail, tail + 1, __ATOMIC_RELEASE);
+    r->toSubmit++;
+
+    return 0;
+}
+
+static void reap(UringInput* in) {
+    Ring* r = &in->ring;
+    unsigned head = *r->cqHead;
+    unsigned tail = __atomic_load_n(r->cqTail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; head++) {
+        struct io_uring_cqe* cqe = &r->cqes[head & *r->cqMask];
+        Block* b = &in->blocks[cqe->user_data];
+        b->len = cqe->res;
+        b->state = BLOCK_READY;
+    }
+
+    __atomic_store_n(r->cqHead, head, __ATOMIC_RELEASE);
+}
+
+static Block* find_block(UringInput* in, int64_t index) {
+    int i;
+
+    for (i = 0; i < in->numBlocks; i++) {
+        if (in->blocks[i].state != BLOCK_EMPTY && in->blocks[i].index == index) {
+            return &in->blocks[i];
+        }
+    }
+
+    return 0;
+}
+
+// Least recently used block that is not in flight, never the current one.
+static Block* free_block(UringInput* in, int64_t current) {
+    Block* victim = 0;
+    int i;
+
+    for (i = 0; i < in->numBlocks; i++) {
+        Block* b = &in->blocks[i];
+        if (b->state == BLOCK_EMPTY) {
+            return b;
+        }
+        if (b->state == BLOCK_READY && b->index != current &&
+            (!victim || b->lastUse < victim->lastUse)) {
+            victim = b;
+        }
+    }
+
+    return victim;
+}
+
+static Block* request_block(UringInput* in, int64_t index, int64_t current) {
+    Block* b = find_block(in, index);
+    int64_t offset = index * in->blockSize;
+
+    if (b || offset >= in->fileSize) {
+        return b;
+    }
+
+    b = free_block(in, current);
+    if (!b) {
+        return 0;
+    }
+
+    b->iov.iov_base = b->data;
+    b->iov.iov_len = (size_t)FFMIN(in->blockSize, in->fileSize - offset);
+    if (ring_queue_read(&in->ring, in->fd, &b->iov, offset, b - in->blocks) < 0) {
+        return 0;
+    }
+
+    b->index = index;
+    b->state = BLOCK_INFLIGHT;
+    b->lastUse = in->clock++;
+
+    return b;
+}
+
+static int compare_hints(const void* a, const void* b) {
+    int64_t x = ((const Hint*)a)->offset, y = ((const Hint*)b)->offset;
+    return x < y ? -1 : x > y;
+}
+
+// Index of the first hint ending after offset.
+static int find_hint(UringInput* in, int64_t offset) {
+    int lo = 0, hi = in->numHints;
+
+    if (!in->hintsSorted) {
+        qsort(in->hints, in->numHints, sizeof(Hint), compare_hints);
+        in->hintsSorted = 1;
+    }
+
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (in->hints[mid].offset + in->hints[mid].size <= offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+// Keeps the next readAhead blocks in flight: the blocks holding the next
+// hinted sample ranges, or simply the following blocks without hints.
+static void prefetch(UringInput* in, int64_t current) {
+    int64_t last = current;
+    int queued = 0;
+
+    if (in->numHints > 0) {
+        int h = find_hint(in, in->pos);
+        for (; h < in->numHints && queued < in->readAhead; h++) {
+            int64_t first = FFMAX(in->hints[h].offset / in->blockSize, last + 1);
+            int64_t end = (in->hints[h].offset + in->hints[h].size - 1) / in->blockSize;
+            for (; first <= end && queued < in->readAhead; first++, queued++) {
+                if (!request_block(in, first, current)) {
+                    queued = in->readAhead;
+                }
+                last = first;
+            }
+        }
+    } else {
+        for (; queued < in->readAhead; queued++) {
+            if (!request_block(in, current + 1 + queued, current)) {
+                break;
+            }
+        }
+    }
+}
+
+UringInput* NewUringInput(const char* path, int blockSize, int queueDepth) {
+    UringInput* in;
+    struct stat st;
+    int i;
+
+    if (blockSize <= 0) {
+        blockSize = URING_BLOCK_SIZE;
+    }
+    if (queueDepth <= 0) {
+        queueDepth = URING_QUEUE_DEPTH;
+    }
+
+    in = calloc(1, sizeof(UringInput));
+    if (!in) {
+        return 0;
+    }
+    in->ring.fd = -1;
+
+    in->fd = open(path, O_RDONLY);
+    if (in->fd < 0 || fstat(in->fd, &st) < 0) {
+        goto fail;
+    }
+    in->fileSize = st.st_size;
+
+    if (ring_setup(&in->ring, queueDepth + 2) < 0) {
+        goto fail;
+    }
+
+    in->blockSize = blockSize;
+    in->readAhead = queueDepth;
+    in->numBlocks = queueDepth + 2;
+    in->blocks = calloc(in->numBlocks, sizeof(Block));
+    if (!in->blocks) {
+        goto fail;
+    }
+    for (i = 0; i < in->numBlocks; i++) {
+        in->blocks[i].data = av_malloc(blockSize);
+        if (!in->blocks[i].data) {
+            goto fail;
+        }
+    }
+
+    return in;
+
+fail:
+    FreeUringInput(in);
+    return 0;
+}
+
+int UringInputRead(void* opaque, uint8_t* buf, int size) {
+    UringInput* in = opaque;
+    int64_t current = in->pos / in->blockSize;
+    int offset, n;
+    Block* b;
+
+    if (in->pos >= in->fileSize) {
+        return 0;
+    }
+
+    b = request_block(in, current, current);
+    if (!b) {
+        // Every block is in flight; wait for one and retry.
+        if (ring_enter(&in->ring, 1) < 0) {
+            return AVERROR(errno);
+        }
+        reap(in);
+        b = request_block(in, current, current);
+        if (!b) {
+            return AVERROR(EIO);
+        }
+    }
+
+    prefetch(in, current);
+    if (in->ring.toSubmit > 0 && ring_enter(&in->ring, 0) < 0) {
+        return AVERROR(errno);
+    }
+
+    while (b->state == BLOCK_INFLIGHT) {
+        if (ring_enter(&in->ring, 1) < 0) {
+            return AVERROR(errno);
+        }
+        reap(in);
+    }
+
+    if (b->len < 0) {
+        b->state = BLOCK_EMPTY;
+        return b->len;
+    }
+
+    b->lastUse = in->clock++;
+    offset = (int)(in->pos - current * in->blockSize);
+    n = FFMIN(size, b->len - offset);
+    if (n <= 0) {
+        // The block completed short of the end of the file. Drop it so it is
+        // read again, and serve this read directly; only the file ending
+        // early is end of file.
+        b->state = BLOCK_EMPTY;
+        do {
+            n = pread(in->fd, buf, size, in->pos);
+        } while (n < 0 && errno == EINTR);
+        if (n < 0) {
+            return AVERROR(errno);
+        }
+        in->pos += n;
+        return n;
+    }
+
+    memcpy(buf, b->data + offset, n);
+    in->pos += n;
+
+    return n;
+}
+
+int64_t UringInputSeek(void* opaque, int64_t offset, int whence) {
+    UringInput* in = opaque;
+
+    if (whence & AVSEEK_SIZE) {
+        return in->fileSize;
+    }
+
+    switch (whence & ~AVSEEK_FORCE) {
+    case SEEK_SET:
+        break;
+    case SEEK_CUR:
+        offset += in->pos;
+        break;
+    case SEEK_END:
+        offset += in->fileSize;
+        break;
+    default:
+        return AVERROR(EINVAL);
+    }
+
+    if (offset < 0) {
+        return AVERROR(EINVAL);
+    }
+
+    in->pos = offset;
+
+    return offset;
+}
+
+void UringInputHint(UringInput* in, int64_t offset, int64_t size) {
+    if (in->numHints == in->hintCapacity) {
+        int capacity = in->hintCapacity ? in->hintCapacity * 2 : 1024;
+        Hint* hints = realloc(in->hints, capacity * sizeof(Hint));
+        if (!hints) {
+            return;
+        }
+        in->hints = hints;
+        in->hintCapacity = capacity;
+    }
+
+    in->hints[in->numHints].offset = offset;
+    in->hints[in->numHints].size = size;
+    in->numHints++;
+    in->hintsSorted = 0;
+}
+
+void FreeUringInput(UringInput* in) {
+    int i;
+
+    if (!in) {
+        return;
+    }
+
+    // Buffers must outlive any read still in flight.
+    while (in->ring.fd >= 0 && in->blocks) {
+        int inflight = 0;
+        for (i = 0; i < in->numBlocks; i++) {
+            inflight |= in->blocks[i].state == BLOCK_INFLIGHT;
+        }
+        if (!inflight || ring_enter(&in->ring, 1) < 0) {
+            break;
+        }
+        reap(in);
+    }
+
+    if (in->blocks) {
+        for (i = 0; i < in->numBlocks; i++) {
+            av_free(in->blocks[i].data);
+        }
+        free(in->blocks);
+    }
+    free(in->hints);
+    ring_free(&in->ring);
+    if (in->fd >= 0) {
+        close(in->fd);
+    }
+    free(in);
+}
+
+#else
+
+UringInput* NewUringInput(const char* path, int blockSize, int queueDepth) {
+    return 0;
+}
+
+int UringInputRead(void* opaque, uint8_t* buf, int size) {
+    return AVERROR(ENOSYS);
+}
+
+int64_t UringInputSeek(void* opaque, int64_t offset, int whence) {
+    return AVERROR(ENOSYS);
+}
+
+void UringInputHint(UringInput* in, int64_t offset, int64_t size) {
+}
+
+void FreeUringInput(UringInput* in) {
+}
+
+#endif
+
+static int is_uring_input(AVFormatContext* ifmt_ctx) {
+    return ifmt_ctx && ifmt_ctx->pb && ifmt_ctx->pb->read_packet == UringInputRead;
+}
+
+int UringOpenInput(AVFormatContext** ifmt_ctx, const char* path) {
+    UringInput* in = NewUringInput(path, 0, 0);
+    unsigned char* ibuf;
+    int ret;
+
+    if (!in) {
+        return avformat_open_input(ifmt_ctx, path, 0, 0);
+    }
+
+    ibuf = av_malloc(URING_IO_BUFFER_SIZE);
+    *ifmt_ctx = avformat_alloc_context();
+    if (!ibuf || !*ifmt_ctx) {
+        av_free(ibuf);
+        avformat_free_context(*ifmt_ctx);
+        *ifmt_ctx = 0;
+        FreeUringInput(in);
+        return avformat_open_input(ifmt_ctx, path, 0, 0);
+    }
+
+    (*ifmt_ctx)->pb = avio_alloc_context(ibuf, URING_IO_BUFFER_SIZE, 0, in, UringInputRead, 0, UringInputSeek);
+    if (!(*ifmt_ctx)->pb) {
+        av_free(ibuf);
+        avformat_free_context(*ifmt_ctx);
+        *ifmt_ctx = 0;
+        FreeUringInput(in);
+        return avformat_open_input(ifmt_ctx, path, 0, 0);
+    }
+
+    // avformat_open_input frees the context on failure but not custom I/O.
+    AVIOContext* pb = (*ifmt_ctx)->pb;
+    if ((ret = avformat_open_input(ifmt_ctx, path, 0, 0)) < 0) {
+        av_freep(&pb->buffer);
+        av_free(pb);
+        FreeUringInput(in);
+    }
+
+    return ret;
+}
+
+void UringHintIndex(AVFormatContext* ifmt_ctx) {
+    UringInput* in;
+    unsigned int i;
+    int j;
+
+    if (!is_uring_input(ifmt_ctx)) {
+        return;
+    }
+
+    in = ifmt_ctx->pb->opaque;
+    for (i = 0; i < ifmt_ctx->nb_streams; i++) {
+        AVStream* st = ifmt_ctx->streams[i];
+        if (st->discard == AVDISCARD_ALL) {
+            continue;
+        }
+        for (j = 0; j < st->nb_index_entries; j++) {
+            UringInputHint(in, st->index_entries[j].pos, st->index_entries[j].size);
+        }
+    }
+}
+
+void UringCloseInput(AVFormatContext** ifmt_ctx) {
+    AVIOContext* pb;
+
+    if (!is_uring_input(*ifmt_ctx)) {
+        avformat_close_input(ifmt_ctx);
+        return;
+    }
+
+    pb = (*ifmt_ctx)->pb;
+    avformat_close_input(ifmt_ctx);
+    FreeUringInput(pb->opaque);
+    av_freep(&pb->buffer);
+    av_free(pb);
+}
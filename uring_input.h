@@ -0,0 +1,27 @@
+#ifndef URING_INPUT_H
+#define URING_INPUT_H
+
+#include "muxer.h"
+
+typedef struct _UringInput UringInput;
+
+// A file input read through io_uring. Reads are served from a cache of
+// blockSize blocks; up to queueDepth blocks ahead of the read position are
+// kept in flight, following the hinted sample ranges when there are any.
+// Returns null if io_uring is unavailable.
+UringInput* NewUringInput(const char* path, int blockSize, int queueDepth);
+int UringInputRead(void* opaque, uint8_t* buf, int size);
+int64_t UringInputSeek(void* opaque, int64_t offset, int whence);
+void UringInputHint(UringInput* in, int64_t offset, int64_t size);
+void FreeUringInput(UringInput* in);
+
+struct AVFormatContext;
+
+// Opens path for demuxing through io_uring, falling back to libavformat's
+// file protocol. Sample ranges from the demuxer's index are used as
+// read-ahead hints once the streams are known.
+int UringOpenInput(struct AVFormatContext** ifmt_ctx, const char* path);
+void UringHintIndex(struct AVFormatContext* ifmt_ctx);
+void UringCloseInput(struct AVFormatContext** ifmt_ctx);
+
+#endif